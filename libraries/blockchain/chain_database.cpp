@@ -12,6 +12,7 @@
 #include <fc/io/raw_variant.hpp>
 #include <fc/io/fstream.hpp>
 #include <fc/log/logger.hpp>
+#include <fc/thread/thread.hpp>
 
 #include <fstream>
 #include <iostream>
@@ -90,11 +91,27 @@ namespace bts { namespace blockchain {
 
    namespace detail
    {
+      /** the results of the state independent validation of a block */
+      struct prevalidated_block
+      {
+         uint32_t                                   block_num;
+         public_key_type                            signee;
+         /** the ids of the transactions signed_keys were recovered from, in block order */
+         std::vector<transaction_id_type>           transaction_ids;
+         std::vector< std::unordered_set<address> > signed_keys;
+      };
+
+      /** signature recovery that has been started for a block */
+      struct pending_prevalidation
+      {
+         uint32_t                          block_num;
+         fc::future<prevalidated_block>    result;
+      };
 
       class chain_database_impl
       {
          public:
-            chain_database_impl():self(nullptr),_observer(nullptr){}
+            chain_database_impl():self(nullptr),_observer(nullptr),_prevalidation_thread("prevalidate_blocks"){}
 
             void                       initialize_genesis(fc::path genesis_file);
 
@@ -106,16 +123,28 @@ namespace bts { namespace blockchain {
             void                       pop_block();
             void                       mark_invalid( const block_id_type& id );
             void                       mark_included( const block_id_type& id, bool state );
-            void                       verify_header( const full_block& );
+            void                       verify_header( const full_block&, const fc::optional<prevalidated_block>& prevalidated,
+                                                      bool skip_signature_checks );
+            fc::optional<prevalidated_block> take_prevalidated_block( const block_id_type& block_id );
+            bool                       is_below_last_checkpoint( uint32_t block_num )const;
             void                       apply_transactions( uint32_t block_num,
                                                            const std::vector<signed_transaction>&,
-                                                           const pending_chain_state_ptr& );
+                                                           const pending_chain_state_ptr&,
+                                                           bool skip_signature_check,
+                                                           const fc::optional<prevalidated_block>& prevalidated );
             void                       pay_delegate( fc::time_point_sec time_slot, share_type amount,
                                                            const pending_chain_state_ptr& );
             void                       save_undo_state( const block_id_type& id,
                                                            const pending_chain_state_ptr& );
             void                       update_head_block( const full_block& blk );
-            std::vector<block_id_type> fetch_blocks_at_number( uint32_t block_num );
+            void                       cache_recent_block( const block_id_type& id, const full_block& blk );
+            void                       prune_recent_blocks();
+            block_fork_data*           find_fork_data( const block_id_type& id );
+            block_fork_data*           find_fork_data( const block_id_type& id, uint32_t block_num );
+            block_fork_data&           get_fork_data( const block_id_type& id );
+            block_fork_data&           index_fork_data( const block_id_type& id, uint32_t block_num,
+                                                        const block_fork_data& data );
+            void                       prune_fork_graph();
             void                       recursive_mark_as_linked( const std::unordered_set<block_id_type>& ids );
             void                       recursive_mark_as_invalid( const std::unordered_set<block_id_type>& ids );
             void                       update_random_seed( secret_hash_type new_secret, 
@@ -130,14 +159,19 @@ namespace bts { namespace blockchain {
             chain_observer*                                                     _observer;
             digest_type                                                         _chain_id;
 
-            bts::db::level_map<uint32_t, std::vector<block_id_type> >           _fork_number_db;
-            bts::db::level_map<block_id_type,block_fork_data>                   _fork_db;
+            /** 
+             *  The fork graph only covers the last BTS_BLOCKCHAIN_FORK_GRAPH_DEPTH blocks and is
+             *  not persisted, blocks on the current chain are recreated from _block_num_to_id_db 
+             *  on demand.  _fork_number_db indexes it by block number so it can be pruned.
+             */
+            std::unordered_map<block_id_type,block_fork_data>                   _fork_db;
+            std::map<uint32_t, std::unordered_set<block_id_type> >              _fork_number_db;
             bts::db::level_map<uint32_t, fc::variant >                          _property_db;
             bts::db::level_map<proposal_id_type, proposal_record >              _proposal_db;
             bts::db::level_map<proposal_vote_id_type, proposal_vote >           _proposal_vote_db;
 
             /** the data required to 'undo' the changes a block made to the database */
-            bts::db::level_map<block_id_type,pending_chain_state>               _undo_state_db;
+            bts::db::level_map<block_id_type,undo_log>                          _undo_state_db;
 
             // blocks in the current 'official' chain.
             bts::db::level_map<uint32_t,block_id_type>                          _block_num_to_id_db;
@@ -150,6 +184,22 @@ namespace bts { namespace blockchain {
             signed_block_header                                                 _head_block_header;
             block_id_type                                                       _head_block_id;
 
+            /** 
+             *  trusted block ids, signatures are not checked for the blocks at or below the last one,
+             *  see extend_chain()
+             */
+            std::map<uint32_t,block_id_type>                                    _checkpoints;
+
+            /** recent blocks from every fork, indexed by number so old ones can be pruned */
+            std::unordered_map<block_id_type, full_block>                       _recent_blocks;
+            std::map<uint32_t, std::unordered_set<block_id_type> >              _recent_block_ids_by_num;
+            /** undo states of the recent blocks on the current chain */
+            std::unordered_map<block_id_type, undo_log>                         _recent_undo_states;
+
+            /** signature recovery runs here, ahead of the blocks being applied on the main thread */
+            fc::thread                                                          _prevalidation_thread;
+            std::unordered_map<block_id_type, pending_prevalidation>            _prevalidated_blocks;
+
             bts::db::level_map< transaction_id_type, signed_transaction>        _pending_transaction_db;
             std::map< fee_index, transaction_evaluation_state_ptr >             _pending_fee_index;
 
@@ -172,12 +222,76 @@ namespace bts { namespace blockchain {
             bts::db::level_pod_map< transaction_id_type, transaction_location > _processed_transaction_id_db;
       };
 
-      std::vector<block_id_type> chain_database_impl::fetch_blocks_at_number( uint32_t block_num )
+      /**
+       *  Returns the fork data for id or nullptr if the block is unknown.  Blocks on the
+       *  current chain that are not in the fork graph (pruned, or from before a restart) 
+       *  are linked, valid and included by definition so their record is recreated.
+       */
+      block_fork_data* chain_database_impl::find_fork_data( const block_id_type& id )
+      {
+         auto itr = _fork_db.find( id );
+         if( itr != _fork_db.end() )
+            return &itr->second;
+
+         uint32_t block_num = 0;
+         if( id != block_id_type() ) // the genesis state
+         {
+            auto block = _block_id_to_block_db.fetch_optional( id );
+            if( !block ) return nullptr;
+            block_num = block->block_num;
+         }
+         return find_fork_data( id, block_num );
+      }
+
+      /**
+       *  Like find_fork_data( id ) for callers that already know the block number, which
+       *  saves reading and decoding the block to find out whether it is on the current chain.
+       */
+      block_fork_data* chain_database_impl::find_fork_data( const block_id_type& id, uint32_t block_num )
+      {
+         auto itr = _fork_db.find( id );
+         if( itr != _fork_db.end() )
+            return &itr->second;
+
+         if( id != block_id_type() ) // the genesis state
+         {
+            auto included_id = _block_num_to_id_db.fetch_optional( block_num );
+            if( !included_id || *included_id != id ) return nullptr;
+         }
+
+         block_fork_data included_fork;
+         included_fork.is_linked   = true;
+         included_fork.is_valid    = true;
+         included_fork.is_included = true;
+
+         auto next_id = _block_num_to_id_db.fetch_optional( block_num + 1 );
+         if( !!next_id ) included_fork.next_blocks.insert( *next_id );
+         return &index_fork_data( id, block_num, included_fork );
+      }
+
+      block_fork_data& chain_database_impl::get_fork_data( const block_id_type& id )
+      {
+         auto fork_data = find_fork_data( id );
+         FC_ASSERT( fork_data != nullptr, "unknown block ${id}", ("id",id) );
+         return *fork_data;
+      }
+
+      block_fork_data& chain_database_impl::index_fork_data( const block_id_type& id, uint32_t block_num,
+                                                            const block_fork_data& data )
       {
-         std::vector<block_id_type> current_blocks;
-         auto itr = _fork_number_db.find( block_num );
-         if( itr.valid() ) return itr.value();
-         return current_blocks;
+         _fork_number_db[block_num].insert( id );
+         return _fork_db[id] = data;
+      }
+
+      void chain_database_impl::prune_fork_graph()
+      {
+         while( !_fork_number_db.empty() &&
+                _fork_number_db.begin()->first + BTS_BLOCKCHAIN_FORK_GRAPH_DEPTH <= _head_block_header.block_num )
+         {
+            for( const auto& id : _fork_number_db.begin()->second )
+               _fork_db.erase( id );
+            _fork_number_db.erase( _fork_number_db.begin() );
+         }
       }
 
       void  chain_database_impl::clear_pending(  const full_block& blk )
@@ -209,11 +323,9 @@ namespace bts { namespace blockchain {
             std::unordered_set<block_id_type> pending;
             for( auto item : next_ids )
             {
-                block_fork_data record = _fork_db.fetch( item );
+                block_fork_data& record = get_fork_data( item );
                 record.is_linked = true;
                 pending.insert( record.next_blocks.begin(), record.next_blocks.end() );
-                //ilog( "store: ${id} => ${data}", ("id",item)("data",record) );
-                _fork_db.store( item, record );
             }
             next_ids = pending;
          }
@@ -226,11 +338,9 @@ namespace bts { namespace blockchain {
             std::unordered_set<block_id_type> pending;
             for( auto item : next_ids )
             {
-                block_fork_data record = _fork_db.fetch( item );
+                block_fork_data& record = get_fork_data( item );
                 record.is_valid = false;
                 pending.insert( record.next_blocks.begin(), record.next_blocks.end() );
-                //ilog( "store: ${id} => ${data}", ("id",item)("data",record) );
-                _fork_db.store( item, record );
             }
             next_ids = pending;
          }
@@ -259,27 +369,26 @@ namespace bts { namespace blockchain {
       { try {
           //ilog( "block_number: ${n}   id: ${id}  prev: ${prev}",
            //     ("n",block_data.block_num)("id",block_id)("prev",block_data.previous) );
+          FC_ASSERT( block_data.block_num > 0 );
 
-          // first of all store this block at the given block number
-          _block_id_to_block_db.store( block_id, block_data );
+          auto prev_fork = find_fork_data( block_data.previous, block_data.block_num - 1 );
 
-          // update the parallel block list
-          std::vector<block_id_type> parallel_blocks = fetch_blocks_at_number( block_data.block_num );
-          std::find( parallel_blocks.begin(), parallel_blocks.end(), block_id );
-          parallel_blocks.push_back( block_id );
-          _fork_number_db.store( block_data.block_num, parallel_blocks );
+          // placeholders for unknown blocks are only pruned once the head passes them
+          FC_ASSERT( prev_fork != nullptr || 
+                     block_data.block_num <= _head_block_header.block_num + BTS_BLOCKCHAIN_FORK_GRAPH_DEPTH,
+                     "unlinked block is too far ahead of the head block", 
+                     ("block_num",block_data.block_num)("head_block_num",_head_block_header.block_num) );
 
+          // first of all store this block at the given block number
+          _block_id_to_block_db.store( block_id, block_data );
 
           // now find how it links in.
           block_fork_data prev_fork_data;
-          auto prev_itr = _fork_db.find( block_data.previous );
-          if( prev_itr.valid() ) // we already know about its previous
+          if( prev_fork != nullptr ) // we already know about its previous
           {
              ilog( "           we already know about its previous: ${p}", ("p",block_data.previous) );
-             prev_fork_data = prev_itr.value();
-             prev_fork_data.next_blocks.insert(block_id);
-             //ilog( "              ${id} = ${record}", ("id",prev_itr.key())("record",prev_fork_data) );
-             _fork_db.store( prev_itr.key(), prev_fork_data );
+             prev_fork->next_blocks.insert(block_id);
+             prev_fork_data = *prev_fork;
           }
           else
           {
@@ -288,15 +397,14 @@ namespace bts { namespace blockchain {
              // we must create it and assume it is not linked...
              prev_fork_data.next_blocks.insert(block_id);
              prev_fork_data.is_linked = block_data.previous == block_id_type(); //false;
-             //ilog( "              ${id} = ${record}", ("id",block_data.previous)("record",prev_fork_data) );
-             _fork_db.store( block_data.previous, prev_fork_data );
+             index_fork_data( block_data.previous, block_data.block_num - 1, prev_fork_data );
           }
 
-          block_fork_data current_fork;
-          auto cur_itr = _fork_db.find( block_id );
-          if( cur_itr.valid() )
+          auto cur_fork = find_fork_data( block_id, block_data.block_num );
+          if( cur_fork != nullptr )
           {
-             current_fork = cur_itr.value();
+             block_fork_data& current_fork = *cur_fork;
+             _fork_number_db[block_data.block_num].insert( block_id );
              ilog( "          current_fork: ${fork}", ("fork",current_fork) );
              ilog( "          prev_fork: ${prev_fork}", ("prev_fork",prev_fork_data) );
              if( !current_fork.is_linked && prev_fork_data.is_linked )
@@ -304,41 +412,37 @@ namespace bts { namespace blockchain {
                 // we found the missing link
                 current_fork.is_linked = true;
                 recursive_mark_as_linked( current_fork.next_blocks );
-                _fork_db.store( block_id, current_fork );
              }
+             if( current_fork.is_linked )
+                cache_recent_block( block_id, block_data );
+             return current_fork;
           }
-          else
-          {
-             current_fork.is_linked = prev_fork_data.is_linked;
-             //ilog( "          current_fork: ${id} = ${fork}", ("id",block_id)("fork",current_fork) );
-             _fork_db.store( block_id, current_fork );
-          }
-          return current_fork;
+
+          block_fork_data current_fork;
+          current_fork.is_linked = prev_fork_data.is_linked;
+          // only blocks that link to the genesis block can ever be switched to
+          if( current_fork.is_linked )
+             cache_recent_block( block_id, block_data );
+          return index_fork_data( block_id, block_data.block_num, current_fork );
       } FC_RETHROW_EXCEPTIONS( warn, "", ("block_id",block_id) ) }
 
       void chain_database_impl::mark_invalid( const block_id_type& block_id )
       {
          // fetch the fork data for block_id, mark it as invalid and
          // then mark every item after it as invalid as well.
-         auto fork_data = _fork_db.fetch( block_id );
+         block_fork_data& fork_data = get_fork_data( block_id );
          fork_data.is_valid = false;
-         _fork_db.store( block_id, fork_data );
          recursive_mark_as_invalid( fork_data.next_blocks );
       }
 
       void chain_database_impl::mark_included( const block_id_type& block_id, bool included )
       { try {
          //ilog( "included: ${block_id} = ${state}", ("block_id",block_id)("state",included) );
-         auto fork_data = _fork_db.fetch( block_id );
-       //  if( fork_data.is_included != included )
+         block_fork_data& fork_data = get_fork_data( block_id );
+         fork_data.is_included = included;
+         if( included )
          {
-            fork_data.is_included = included;
-            if( included )
-            {
-               fork_data.is_valid  = true;
-            }
-            //ilog( "store: ${id} => ${data}", ("id",block_id)("data",fork_data) );
-            _fork_db.store( block_id, fork_data );
+            fork_data.is_valid  = true;
          }
          // fetch the fork data for block_id, mark it as included and
       } FC_RETHROW_EXCEPTIONS( warn, "", ("block_id",block_id)("included",included) ) }
@@ -363,16 +467,27 @@ namespace bts { namespace blockchain {
 
       void chain_database_impl::apply_transactions( uint32_t block_num,
                                                     const std::vector<signed_transaction>& user_transactions,
-                                                    const pending_chain_state_ptr& pending_state )
+                                                    const pending_chain_state_ptr& pending_state,
+                                                    bool skip_signature_check,
+                                                    const fc::optional<prevalidated_block>& prevalidated )
       {
          //ilog( "apply transactions ${block_num}", ("block_num",block_num) );
          uint32_t trx_num = 0;
          try {
             // apply changes from each transaction
+            // only trust recovered keys for the exact transactions they were recovered from,
+            // otherwise recover them again while evaluating
+            bool use_prevalidated = !skip_signature_check && !!prevalidated &&
+                                    prevalidated->signed_keys.size() == user_transactions.size() &&
+                                    prevalidated->transaction_ids.size() == user_transactions.size();
             for( auto trx : user_transactions )
             {
+               auto trx_id = trx.id();
                transaction_evaluation_state_ptr trx_eval_state =
                       std::make_shared<transaction_evaluation_state>(pending_state,_chain_id);
+               trx_eval_state->set_skip_signature_check( skip_signature_check );
+               if( use_prevalidated && prevalidated->transaction_ids[trx_num] == trx_id )
+                  trx_eval_state->set_precomputed_signed_keys( prevalidated->signed_keys[trx_num] );
                trx_eval_state->evaluate( trx );
                //ilog( "evaluation: ${e}", ("e",*trx_eval_state) );
               // TODO:  capture the evaluation state with a callback for wallets...
@@ -380,7 +495,7 @@ namespace bts { namespace blockchain {
 
                transaction_location trx_loc( block_num, trx_num );
                //ilog( "store trx location: ${loc}", ("loc",trx_loc) );
-               pending_state->store_transaction_location( trx.id(), trx_loc );
+               pending_state->store_transaction_location( trx_id, trx_loc );
                ++trx_num;
             }
       } FC_RETHROW_EXCEPTIONS( warn, "", ("trx_num",trx_num) ) }
@@ -399,13 +514,17 @@ namespace bts { namespace blockchain {
       void chain_database_impl::save_undo_state( const block_id_type& block_id,
                                                const pending_chain_state_ptr& pending_state )
       { try {
-           pending_chain_state_ptr undo_state = std::make_shared<pending_chain_state>(nullptr);
-           pending_state->get_undo_state( undo_state );
-           _undo_state_db.store( block_id, *undo_state );
+           undo_log undo_state;
+           pending_state->get_undo_log( undo_state );
+           _undo_state_db.store( block_id, undo_state );
+           if( _recent_blocks.find( block_id ) != _recent_blocks.end() )
+              _recent_undo_states[block_id] = std::move( undo_state );
       } FC_RETHROW_EXCEPTIONS( warn, "", ("block_id",block_id) ) }
 
 
-      void chain_database_impl::verify_header( const full_block& block_data )
+      void chain_database_impl::verify_header( const full_block& block_data, 
+                                               const fc::optional<prevalidated_block>& prevalidated,
+                                               bool skip_signature_checks )
       { try {
             // validate preliminaries:
             FC_ASSERT( block_data.block_num == _head_block_header.block_num + 1 );
@@ -426,18 +545,96 @@ namespace bts { namespace blockchain {
             FC_ASSERT( digest_data.validate_digest() );
             FC_ASSERT( digest_data.validate_unique() );
 
+            auto checkpoint_itr = _checkpoints.find( block_data.block_num );
+            if( checkpoint_itr != _checkpoints.end() )
+               FC_ASSERT( block_data.id() == checkpoint_itr->second, "block does not match checkpoint",
+                          ("block_num",block_data.block_num)("checkpoint",checkpoint_itr->second) );
+
+            if( skip_signature_checks )
+               return;
+
             // signign delegate id: 
-            auto signing_delegate_id = self->get_signing_delegate_id( block_data.timestamp );
-            FC_ASSERT( block_data.validate_signee( self->get_signing_delegate_key(block_data.timestamp) ),
-                       "", ("signing_delegate_key", self->get_signing_delegate_key(block_data.timestamp))
-                           ("signing_delegate_id", signing_delegate_id ) );
+            auto signing_delegate_id  = self->get_signing_delegate_id( block_data.timestamp );
+            auto signing_delegate_key = self->get_signing_delegate_key( block_data.timestamp );
+            bool valid_signee = !!prevalidated ? prevalidated->signee == signing_delegate_key.serialize()
+                                               : block_data.validate_signee( signing_delegate_key );
+            FC_ASSERT( valid_signee, "", ("signing_delegate_key", signing_delegate_key)
+                                         ("signing_delegate_id", signing_delegate_id ) );
 
       } FC_RETHROW_EXCEPTIONS( warn, "" ) }
 
+      /**
+       *  Removes the prevalidation results for block_id, waiting for them if they are
+       *  still being computed.  Returns an empty optional if the block was never
+       *  prevalidated or if recovery failed, in which case the caller must recover the
+       *  signatures itself so that any error is reported in the usual way.
+       */
+      fc::optional<prevalidated_block> chain_database_impl::take_prevalidated_block( const block_id_type& block_id )
+      {
+         fc::optional<prevalidated_block> result;
+         auto itr = _prevalidated_blocks.find( block_id );
+         if( itr == _prevalidated_blocks.end() )
+            return result;
+
+         auto prevalidation = itr->second.result;
+         _prevalidated_blocks.erase( itr );
+         try
+         {
+            result = prevalidation.wait();
+         }
+         catch ( const fc::exception& e )
+         {
+            wlog( "prevalidation of block ${id} failed: ${e}", ("id",block_id)("e",e.to_detail_string()) );
+         }
+         return result;
+      }
+
+      bool chain_database_impl::is_below_last_checkpoint( uint32_t block_num )const
+      {
+         return !_checkpoints.empty() && block_num <= _checkpoints.rbegin()->first;
+      }
+
       void chain_database_impl::update_head_block( const full_block& block_data )
       {
          _head_block_header = block_data;
          _head_block_id = block_data.id();
+         prune_recent_blocks();
+         prune_fork_graph();
+      }
+
+      /**
+       *  Keeps blocks near the head in memory so that switching between short forks does
+       *  not have to read and decode them from _block_id_to_block_db again.  At most
+       *  BTS_BLOCKCHAIN_MAX_CACHED_BLOCKS_PER_HEIGHT competing blocks are kept for any 
+       *  height, the rest are read from the database if they are ever needed.
+       */
+      void chain_database_impl::cache_recent_block( const block_id_type& block_id, const full_block& block_data )
+      {
+         if( block_data.block_num + BTS_BLOCKCHAIN_FORK_CACHE_DEPTH <= _head_block_header.block_num ||
+             block_data.block_num > _head_block_header.block_num + BTS_BLOCKCHAIN_FORK_CACHE_DEPTH )
+            return;
+
+         auto& ids_at_height = _recent_block_ids_by_num[block_data.block_num];
+         if( ids_at_height.size() >= BTS_BLOCKCHAIN_MAX_CACHED_BLOCKS_PER_HEIGHT &&
+             ids_at_height.find( block_id ) == ids_at_height.end() )
+            return;
+
+         _recent_blocks[block_id] = block_data;
+         ids_at_height.insert( block_id );
+      }
+
+      void chain_database_impl::prune_recent_blocks()
+      {
+         while( !_recent_block_ids_by_num.empty() &&
+                _recent_block_ids_by_num.begin()->first + BTS_BLOCKCHAIN_FORK_CACHE_DEPTH <= _head_block_header.block_num )
+         {
+            for( const auto& id : _recent_block_ids_by_num.begin()->second )
+            {
+               _recent_blocks.erase( id );
+               _recent_undo_states.erase( id );
+            }
+            _recent_block_ids_by_num.erase( _recent_block_ids_by_num.begin() );
+         }
       }
 
       /**
@@ -531,12 +728,20 @@ namespace bts { namespace blockchain {
 
       /**
        *  Performs all of the block validation steps and throws if error.
+       *
+       *  Signatures are not checked on blocks at or below the last checkpoint.  Such a block
+       *  can only stay on our chain if the checkpoint block at or above it builds on it: the
+       *  block at a checkpointed height must match the checkpoint id, and every block id
+       *  commits to the one before it.  A chain that doesn't lead to the checkpoint stops
+       *  below it, and is rolled back by switch_to_fork() when the checkpoint arrives.
        */
       void chain_database_impl::extend_chain( const full_block& block_data )
       { try {
          auto block_id = block_data.id();
+         bool skip_signature_checks = is_below_last_checkpoint( block_data.block_num );
          try {
-            verify_header( block_data );
+            auto prevalidated = take_prevalidated_block( block_id );
+            verify_header( block_data, prevalidated, skip_signature_checks );
 
             block_summary summary;
             summary.block_data = block_data;
@@ -554,7 +759,8 @@ namespace bts { namespace blockchain {
             //apply_deterministic_updates(pending_state);
 
             //ilog( "block data: ${block_data}", ("block_data",block_data) );
-            apply_transactions( block_data.block_num, block_data.user_transactions, pending_state );
+            apply_transactions( block_data.block_num, block_data.user_transactions, pending_state,
+                                skip_signature_checks, prevalidated );
 
             pay_delegate( block_data.timestamp, block_data.delegate_pay_rate, pending_state );
 
@@ -610,7 +816,7 @@ namespace bts { namespace blockchain {
                ilog( "return: ${h}", ("h",history) );
                return history;
             }
-            auto prev_fork_data = _fork_db.fetch( header.previous );
+            const block_fork_data& prev_fork_data = get_fork_data( header.previous );
 
             /// this shouldn't happen if the database invariants are properly maintained 
             FC_ASSERT( prev_fork_data.is_linked, "we hit a dead end, this fork isn't really linked!" );
@@ -638,14 +844,36 @@ namespace bts { namespace blockchain {
          auto previous_block_id = _head_block_header.previous;
 
          // fetch the undo state for the head block
-         auto undo_state = _undo_state_db.fetch( _head_block_id );
-         undo_state.set_prev_state( self->shared_from_this() );
-         undo_state.apply_changes();
+         undo_log undo_state;
+         auto cached_undo_itr = _recent_undo_states.find( _head_block_id );
+         if( cached_undo_itr != _recent_undo_states.end() )
+         {
+            undo_state = std::move( cached_undo_itr->second );
+            _recent_undo_states.erase( cached_undo_itr );
+         }
+         else
+         {
+            undo_state = _undo_state_db.fetch( _head_block_id );
+         }
+
+         // observers expect to see the reverted records, so only stage the changes
+         // in a pending state when someone is listening
+         pending_chain_state_ptr reverted_state;
+         if( _observer )
+         {
+            reverted_state = std::make_shared<pending_chain_state>( self->shared_from_this() );
+            undo_state.apply( reverted_state );
+            reverted_state->apply_changes();
+         }
+         else
+         {
+            undo_state.apply( self->shared_from_this() );
+         }
 
          _head_block_id = previous_block_id;
          _head_block_header = self->get_block_header( _head_block_id );
 
-         if( _observer ) _observer->state_changed(undo_state.shared_from_this());
+         if( _observer ) _observer->state_changed( reverted_state );
 
       } FC_RETHROW_EXCEPTIONS( warn, "" ) }
 
@@ -723,20 +951,51 @@ namespace bts { namespace blockchain {
       return sorted_delegates;
    } FC_RETHROW_EXCEPTIONS( warn, "" ) }
 
+   /**
+    *  Builds before undo logs kept undo data in undo_state_db in a format that can't be
+    *  read any more, so none of their blocks could be popped.  Everything but the blocks
+    *  themselves is deleted and the ids of the blocks on the current chain are returned 
+    *  so they can be applied again.
+    */
+   static std::vector<block_id_type> prepare_to_replay_old_chain( const fc::path& data_dir )
+   { try {
+      std::vector<block_id_type> block_ids;
+      {
+         bts::db::level_map<uint32_t,block_id_type> block_num_to_id_db;
+         block_num_to_id_db.open( data_dir / "block_num_to_id_db" );
+         for( auto itr = block_num_to_id_db.begin(); itr.valid(); ++itr )
+            block_ids.push_back( itr.value() );
+      }
+
+      static const char* const derived_db_names[] = {
+         "property_db", "proposal_db", "proposal_vote_db", "undo_state_db", "undo_log_db", "block_num_to_id_db",
+         "pending_transaction_db", "asset_db", "balance_db", "name_db", "name_index_db", "symbol_index_db",
+         "delegate_vote_index_db", "ask_db", "bid_db", "short_db", "collateral_db", "processed_transaction_id_db" };
+      for( const char* db_name : derived_db_names )
+         fc::remove_all( data_dir / db_name );
+      return block_ids;
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("data_dir",data_dir) ) }
+
    void chain_database::open( const fc::path& data_dir, fc::path genesis_file )
    { try {
       bool is_new_data_dir = !fc::exists( data_dir );
       try
       {
+          std::vector<block_id_type> blocks_to_replay;
+          if( !is_new_data_dir && fc::exists( data_dir / "undo_state_db" ) )
+          {
+             wlog( "${dir} was written by an older version without undo logs, rebuilding the chain state from its blocks",
+                   ("dir",data_dir) );
+             blocks_to_replay = prepare_to_replay_old_chain( data_dir );
+          }
+
           fc::create_directories( data_dir );
 
-          my->_fork_number_db.open( data_dir / "fork_number_db" );
-          my->_fork_db.open( data_dir / "fork_db" );
           my->_property_db.open( data_dir / "property_db" );
           my->_proposal_db.open( data_dir / "proposal_db" );
           my->_proposal_vote_db.open( data_dir / "proposal_vote_db" );
 
-          my->_undo_state_db.open( data_dir / "undo_state_db" );
+          my->_undo_state_db.open( data_dir / "undo_log_db" );
 
           my->_block_num_to_id_db.open( data_dir / "block_num_to_id_db" );
           my->_block_id_to_block_db.open( data_dir / "block_id_to_block_db" );
@@ -792,6 +1051,21 @@ namespace bts { namespace blockchain {
           if( last_block_num == uint32_t(-1) )
              my->initialize_genesis(genesis_file);
           my->_chain_id = get_property( bts::blockchain::chain_id ).as<digest_type>();
+
+          for( const block_id_type& block_id : blocks_to_replay )
+          {
+             try
+             {
+                push_block( get_block( block_id ) );
+             }
+             catch ( const fc::exception& e )
+             {
+                // anything after this will be downloaded from the network again
+                wlog( "unable to replay block ${id}, stopping at block ${num}: ${e}", 
+                      ("id",block_id)("num",my->_head_block_header.block_num)("e",e.to_detail_string()) );
+                break;
+             }
+          }
       }
       catch( ... )
       {
@@ -804,8 +1078,13 @@ namespace bts { namespace blockchain {
 
    void chain_database::close()
    { try {
-      my->_fork_number_db.close();
-      my->_fork_db.close();
+      my->_prevalidated_blocks.clear();
+      my->_recent_blocks.clear();
+      my->_recent_block_ids_by_num.clear();
+      my->_recent_undo_states.clear();
+
+      my->_fork_db.clear();
+      my->_fork_number_db.clear();
       my->_property_db.close();
       my->_proposal_db.close();
       my->_proposal_vote_db.close();
@@ -874,6 +1153,9 @@ namespace bts { namespace blockchain {
 
    full_block           chain_database::get_block( const block_id_type& block_id )const
    { try {
+      auto cached_itr = my->_recent_blocks.find( block_id );
+      if( cached_itr != my->_recent_blocks.end() )
+         return cached_itr->second;
       return my->_block_id_to_block_db.fetch(block_id);
    } FC_RETHROW_EXCEPTIONS( warn, "", ("block_id",block_id) ) }
 
@@ -883,6 +1165,13 @@ namespace bts { namespace blockchain {
       return get_block( block_id );
    } FC_RETHROW_EXCEPTIONS( warn, "", ("block_num",block_num) ) }
 
+   void                 chain_database::get_packed_block( const block_id_type& block_id, std::vector<char>& packed_block )const
+   { try {
+      // blocks are written to the database before they enter _recent_blocks, so the
+      // database always has them and we can skip packing the cached copy
+      my->_block_id_to_block_db.fetch_raw( block_id, packed_block );
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("block_id",block_id) ) }
+
    signed_block_header  chain_database::get_head_block()const
    {
       return my->_head_block_header;
@@ -893,6 +1182,76 @@ namespace bts { namespace blockchain {
       return my->_processed_transaction_id_db.fetch_optional( trx_id );
    }
 
+   void chain_database::set_checkpoints( const std::map<uint32_t,block_id_type>& checkpoints )
+   {
+      my->_checkpoints = checkpoints;
+   }
+
+   std::map<uint32_t,block_id_type> chain_database::get_checkpoints()const
+   {
+      return my->_checkpoints;
+   }
+
+   void chain_database::prevalidate_block( const full_block& block_data )
+   { try {
+      if( my->is_below_last_checkpoint( block_data.block_num ) )
+         return;
+
+      if( block_data.block_num <= my->_head_block_header.block_num )
+         return;
+
+      auto block_id = block_data.id();
+      if( my->_prevalidated_blocks.find( block_id ) != my->_prevalidated_blocks.end() )
+         return;
+
+      // the block id only covers the header, so make sure the transactions are the ones the
+      // header commits to before the results are stored under that id
+      digest_block digest_data( block_data );
+      if( !digest_data.validate_digest() )
+         return;
+
+      if( my->_prevalidated_blocks.size() >= BTS_BLOCKCHAIN_MAX_PREVALIDATED_BLOCKS )
+      {
+         // drop results for blocks that were never applied and can no longer be
+         for( auto itr = my->_prevalidated_blocks.begin(); itr != my->_prevalidated_blocks.end(); )
+         {
+            if( itr->second.block_num <= my->_head_block_header.block_num || 
+                ( itr->second.result.ready() && itr->second.result.error() ) )
+               itr = my->_prevalidated_blocks.erase( itr );
+            else
+               ++itr;
+         }
+         if( my->_prevalidated_blocks.size() >= BTS_BLOCKCHAIN_MAX_PREVALIDATED_BLOCKS )
+         {
+            // the blocks closest to the head are needed first, so make room by dropping the
+            // furthest one rather than letting far future blocks keep the queue full
+            auto furthest = my->_prevalidated_blocks.begin();
+            for( auto itr = my->_prevalidated_blocks.begin(); itr != my->_prevalidated_blocks.end(); ++itr )
+               if( itr->second.block_num > furthest->second.block_num )
+                  furthest = itr;
+            if( furthest->second.block_num <= block_data.block_num )
+               return;
+            my->_prevalidated_blocks.erase( furthest );
+         }
+      }
+
+      auto chain_id = my->_chain_id;
+      auto transaction_ids = std::move( digest_data.user_transaction_ids );
+      detail::pending_prevalidation& prevalidation = my->_prevalidated_blocks[block_id];
+      prevalidation.block_num = block_data.block_num;
+      prevalidation.result = my->_prevalidation_thread.async( [block_data,transaction_ids,chain_id]() -> detail::prevalidated_block
+      {
+         detail::prevalidated_block result;
+         result.block_num       = block_data.block_num;
+         result.signee          = block_data.signee();
+         result.transaction_ids = transaction_ids;
+         result.signed_keys.reserve( block_data.user_transactions.size() );
+         for( const auto& trx : block_data.user_transactions )
+            result.signed_keys.push_back( transaction_evaluation_state::recover_signed_keys( trx, chain_id ) );
+         return result;
+      } );
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("block",block_data) ) }
+
    /**
     *  Adds the block to the database and manages any reorganizations as a result.
     *
@@ -902,6 +1261,10 @@ namespace bts { namespace blockchain {
       auto block_id        = block_data.id();
       auto current_head_id = my->_head_block_id;
 
+      auto checkpoint_itr = my->_checkpoints.find( block_data.block_num );
+      FC_ASSERT( checkpoint_itr == my->_checkpoints.end() || checkpoint_itr->second == block_id,
+                 "block does not match checkpoint", ("block_num",block_data.block_num)("checkpoint",checkpoint_itr->second) );
+
       block_fork_data fork = my->store_and_index( block_id, block_data );
 
       //ilog( "previous ${p} ==? current ${c}", ("p",block_data.previous)("c",current_head_id) );
@@ -1112,6 +1475,23 @@ namespace bts { namespace blockchain {
       }
       return trxs;
    }
+
+   /**
+    *  Pending transactions are stored ordered by id, so the first one at or after the
+    *  prefix padded with zeros is the only candidate.
+    */
+   osigned_transaction chain_database::get_pending_transaction_by_id_prefix( const transaction_id_type& id_prefix, 
+                                                                             size_t prefix_size )const
+   { try {
+      FC_ASSERT( prefix_size <= sizeof( id_prefix ) );
+      transaction_id_type padded_prefix;
+      memcpy( padded_prefix.data(), id_prefix.data(), prefix_size );
+      auto pending_itr = my->_pending_transaction_db.lower_bound( padded_prefix );
+      if( pending_itr.valid() && memcmp( pending_itr.key().data(), padded_prefix.data(), prefix_size ) == 0 )
+         return pending_itr.value();
+      return osigned_transaction();
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("id_prefix",id_prefix)("prefix_size",prefix_size) ) }
+
    bool chain_database::is_known_transaction( const transaction_id_type& trx_id )
    {
       auto pending_itr = my->_pending_transaction_db.find( trx_id );
@@ -1260,12 +1640,6 @@ namespace bts { namespace blockchain {
          }
       }
 
-      block_fork_data gen_fork;
-      gen_fork.is_valid = true;
-      gen_fork.is_included = true;
-      gen_fork.is_linked = true;
-      _fork_db.store( block_id_type(), gen_fork );
-
       self->set_property( chain_property_enum::active_delegate_list_id, fc::variant(self->next_round_active_delegates()) );
       self->set_property( chain_property_enum::last_asset_id, 0 );
       self->set_property( chain_property_enum::last_name_id, uint64_t(config.names.size()) );
@@ -1288,6 +1662,43 @@ namespace bts { namespace blockchain {
       return my->_block_id_to_block_db.fetch( block_id ).block_num;
    } FC_RETHROW_EXCEPTIONS( warn, "Unable to find block ${block_id}", ("block_id", block_id) ) }
 
+   fc::optional<uint32_t> chain_database::find_block_num( const block_id_type& block_id )const
+   {
+      if( block_id == block_id_type() )
+         return 0;
+      auto cached_itr = my->_recent_blocks.find( block_id );
+      if( cached_itr != my->_recent_blocks.end() )
+         return cached_itr->second.block_num;
+      auto block = my->_block_id_to_block_db.fetch_optional( block_id );
+      if( !block )
+         return fc::optional<uint32_t>();
+      return block->block_num;
+   }
+
+   fc::optional<block_id_type> chain_database::find_block_id( uint32_t block_num )const
+   {
+      return my->_block_num_to_id_db.fetch_optional( block_num );
+   }
+
+   /**
+    *  Walks _block_num_to_id_db with a single iterator, stopping early if 
+    *  there is a gap in the chain.
+    */
+   std::vector<block_id_type> chain_database::get_block_ids( uint32_t first_block_num, uint32_t count )const
+   { try {
+      std::vector<block_id_type> block_ids;
+      block_ids.reserve( count );
+      auto itr = my->_block_num_to_id_db.lower_bound( first_block_num );
+      uint32_t expected_block_num = first_block_num;
+      while( itr.valid() && block_ids.size() < count && itr.key() == expected_block_num )
+      {
+         block_ids.push_back( itr.value() );
+         ++expected_block_num;
+         ++itr;
+      }
+      return block_ids;
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("first_block_num",first_block_num)("count",count) ) }
+
     uint32_t         chain_database::get_head_block_num()const
     {
        return my->_head_block_header.block_num;
@@ -1327,19 +1738,17 @@ namespace bts { namespace blockchain {
        std::ofstream out( filename.generic_string().c_str() );
        out << "digraph G { \n"; 
        out << "rankdir=RL;\n";
-          auto fork_itr = my->_fork_db.begin();
-          while( fork_itr.valid() )
+          for( const auto& fork_item : my->_fork_db )
           {
-             auto fork_data = fork_itr.value();
-             ilog( "${id} => ${r}", ("id",fork_itr.key())("r",fork_data) );
+             const auto& fork_data = fork_item.second;
+             ilog( "${id} => ${r}", ("id",fork_item.first)("r",fork_data) );
              for( auto next : fork_data.next_blocks )
              {
-                out << '"' << std::string ( fork_itr.key() ).substr(0,5) <<"\" "
+                out << '"' << std::string ( fork_item.first ).substr(0,5) <<"\" "
                     << "[color=" << (fork_data.is_included ? "green" : "lightblue") << ",style=filled,"
                     << " shape=" << (fork_data.is_linked  ? "ellipse" : "box" ) << "];\n";
-                out << '"' << std::string ( next ).substr(0,5) <<"\" -> \"" << std::string( fork_itr.key() ).substr(0,5) << "\";\n";
+                out << '"' << std::string ( next ).substr(0,5) <<"\" -> \"" << std::string( fork_item.first ).substr(0,5) << "\";\n";
             }
-             ++fork_itr;
           }
        out << "}"; 
     }
@@ -7,6 +7,7 @@
 #include <fc/filesystem.hpp>
 
 #include <functional>
+#include <map>
 
 namespace bts { namespace blockchain {
 
@@ -46,8 +47,22 @@ namespace bts { namespace blockchain {
 
          void set_observer( chain_observer* observer );
 
+         /**
+          *  Blocks at or below the highest checkpoint are applied as they arrive
+          *  without header and transaction signature verification, all other 
+          *  validation and state changes are still applied.  A block at a 
+          *  checkpointed height must match the checkpointed id or it is rejected,
+          *  so a chain that doesn't lead to the checkpoint is replaced by the
+          *  checkpointed one when it arrives.
+          */
+         void                                set_checkpoints( const std::map<uint32_t,block_id_type>& checkpoints );
+         std::map<uint32_t,block_id_type>    get_checkpoints()const;
+
          transaction_evaluation_state_ptr              store_pending_transaction( const signed_transaction& trx );
          std::vector<transaction_evaluation_state_ptr> get_pending_transactions()const;
+         /** returns a pending transaction whose id starts with the first prefix_size bytes of id_prefix */
+         osigned_transaction                           get_pending_transaction_by_id_prefix( const transaction_id_type& id_prefix, 
+                                                                                             size_t prefix_size )const;
          bool                                          is_known_transaction( const transaction_id_type& trx_id );
          void export_fork_graph( const fc::path& filename )const;
 
@@ -68,10 +83,18 @@ namespace bts { namespace blockchain {
          fc::ecc::public_key           get_signing_delegate_key( fc::time_point_sec )const;
          name_id_type                  get_signing_delegate_id( fc::time_point_sec )const;
          uint32_t                      get_block_num( const block_id_type& )const;
+         /** like get_block_num(), but returns an invalid optional instead of throwing for unknown blocks */
+         fc::optional<uint32_t>        find_block_num( const block_id_type& )const;
+         /** the id of the block at block_num on our current chain, if we have one */
+         fc::optional<block_id_type>   find_block_id( uint32_t block_num )const;
+         /** ids of up to count blocks on our current chain starting at first_block_num, read without loading the blocks */
+         std::vector<block_id_type>    get_block_ids( uint32_t first_block_num, uint32_t count )const;
          signed_block_header           get_block_header( const block_id_type& )const;
          signed_block_header           get_block_header( uint32_t block_num )const;
          full_block                    get_block( const block_id_type& )const;
          full_block                    get_block( uint32_t block_num )const;
+         /** appends the fc::raw packed full_block, as stored, to packed_block without decoding it */
+         void                          get_packed_block( const block_id_type&, std::vector<char>& packed_block )const;
          signed_block_header           get_head_block()const;
          uint32_t                      get_head_block_num()const;
          block_id_type                 get_head_block_id()const;
@@ -89,6 +112,14 @@ namespace bts { namespace blockchain {
           **/
          virtual void push_block( const full_block& block_data );
 
+         /**
+          *  Starts recovering the delegate and transaction signatures of a block on a
+          *  background thread so that it overlaps with applying the blocks before it.
+          *  Nothing is written to the database; push_block() uses the results if they
+          *  are ready and falls back to recovering the signatures itself otherwise.
+          */
+         void prevalidate_block( const full_block& block_data );
+
 
          /**
           *  Evaluate the transaction and return the results.
@@ -104,3 +104,29 @@
 
 #define BTS_BLOCKCHAIN_MAX_NAME_SIZE                (63)
 #define BTS_BLOCKCHAIN_MAX_NAME_DATA_SIZE           (1024*4)
+
+/**
+ *  The maximum number of blocks that may be queued for signature recovery
+ *  ahead of the block currently being applied.
+ */
+#define BTS_BLOCKCHAIN_MAX_PREVALIDATED_BLOCKS      (512)
+
+/**
+ *  The number of blocks behind the head block for which block data and undo
+ *  states are kept in memory so that short forks can be switched without
+ *  reading from the database.
+ */
+#define BTS_BLOCKCHAIN_FORK_CACHE_DEPTH             (BTS_BLOCKCHAIN_NUM_DELEGATES*4)
+
+/**
+ *  The maximum number of competing blocks at the same height kept in the
+ *  recent block cache, the first ones received are kept.
+ */
+#define BTS_BLOCKCHAIN_MAX_CACHED_BLOCKS_PER_HEIGHT (4)
+
+/**
+ *  The number of blocks behind the head block that are tracked in the in-memory
+ *  fork graph, blocks on the current chain older than this are looked up in the
+ *  block database when needed.
+ */
+#define BTS_BLOCKCHAIN_FORK_GRAPH_DEPTH             (BTS_BLOCKCHAIN_BLOCKS_PER_DAY)
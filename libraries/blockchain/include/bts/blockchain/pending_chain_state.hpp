@@ -1,5 +1,6 @@
 #pragma  once
 #include <bts/blockchain/chain_interface.hpp>
+#include <bts/blockchain/undo_log.hpp>
 
 namespace bts { namespace blockchain {
 
@@ -67,6 +68,11 @@ namespace bts { namespace blockchain {
           */
          virtual void                       get_undo_state( const chain_interface_ptr& undo_state )const;
 
+         /** record the previous value of everything this pending state changes in a
+          * compact form that can be stored and later applied directly to the database.
+          */
+         virtual void                       get_undo_log( undo_log& log )const;
+
          /** load the state from a variant */
          virtual void                       from_variant( const fc::variant& v );
          /** convert the state to a variant */
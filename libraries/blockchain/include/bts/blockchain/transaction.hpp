@@ -147,7 +147,7 @@ namespace bts { namespace blockchain {
    {
       public:
          transaction_evaluation_state( const chain_interface_ptr& blockchain, digest_type chain_id );
-         transaction_evaluation_state(){};
+         transaction_evaluation_state():_skip_signature_check(false){};
 
          virtual ~transaction_evaluation_state();
          virtual share_type get_fees( asset_id_type id = 0)const;
@@ -189,6 +189,22 @@ namespace bts { namespace blockchain {
          
          bool check_signature( const address& a )const;
          void add_required_signature( const address& a );
+
+         /**
+          *  When set, signatures are not recovered and every signature check
+          *  is assumed to pass.  Only used for blocks at or below a trusted
+          *  checkpoint where the block id already commits to the signatures.
+          */
+         void set_skip_signature_check( bool skip ) { _skip_signature_check = skip; }
+
+         /**
+          *  Provides the keys recovered from the transaction signatures ahead of
+          *  time (see recover_signed_keys) so evaluate() does not repeat the work.
+          */
+         void set_precomputed_signed_keys( const std::unordered_set<address>& keys ) { _precomputed_signed_keys = keys; }
+
+         /** recovers every address that may have signed trx, does not depend upon chain state */
+         static std::unordered_set<address> recover_signed_keys( const signed_transaction& trx, const digest_type& chain_id );
          
          // steps performed as the transaction is validated
          
@@ -259,6 +275,8 @@ namespace bts { namespace blockchain {
       protected:
          chain_interface_ptr                              _current_state;
          digest_type                                      _chain_id;
+         bool                                             _skip_signature_check;
+         fc::optional<std::unordered_set<address> >      _precomputed_signed_keys;
    };
 
    typedef std::shared_ptr<transaction_evaluation_state> transaction_evaluation_state_ptr;
@@ -0,0 +1,56 @@
+#pragma once
+#include <bts/blockchain/chain_interface.hpp>
+
+namespace bts { namespace blockchain {
+
+   enum undo_table_type
+   {
+      property_table      = 0,
+      asset_table         = 1,
+      name_table          = 2,
+      balance_table       = 3,
+      proposal_table      = 4,
+      proposal_vote_table = 5,
+      bid_table           = 6,
+      ask_table           = 7,
+      short_table         = 8,
+      collateral_table    = 9
+   };
+
+   /**
+    *  @class undo_log
+    *  @brief the minimal data required to revert the changes made by a block
+    *
+    *  Each entry is stored column-wise as (tables[i], keys[i], values[i]) where
+    *  the key and value are the packed key and previous record.  An empty value
+    *  is a tombstone meaning the record did not exist before the block and must
+    *  be removed when the block is popped.
+    */
+   class undo_log
+   {
+      public:
+         void record_property( chain_property_enum property_id, const fc::variant& previous_value );
+         void record_asset( asset_id_type id, const oasset_record& previous_record );
+         void record_name( name_id_type id, const oname_record& previous_record );
+         void record_balance( const balance_id_type& id, const obalance_record& previous_record );
+         void record_proposal( proposal_id_type id, const oproposal_record& previous_record );
+         void record_proposal_vote( const proposal_vote_id_type& id, const oproposal_vote& previous_record );
+         void record_order( undo_table_type table, const market_index_key& key, const oorder_record& previous_record );
+         void record_collateral( const market_index_key& key, const ocollateral_record& previous_record );
+
+         /** restores every recorded value in state, newest entry first */
+         void apply( const chain_interface_ptr& state )const;
+
+         size_t size()const { return tables.size(); }
+
+         std::vector<uint8_t>             tables;
+         std::vector< std::vector<char> > keys;
+         std::vector< std::vector<char> > values;
+   };
+
+} } // bts::blockchain
+
+FC_REFLECT_ENUM( bts::blockchain::undo_table_type,
+                 (property_table)(asset_table)(name_table)(balance_table)(proposal_table)
+                 (proposal_vote_table)(bid_table)(ask_table)(short_table)(collateral_table) )
+FC_REFLECT( bts::blockchain::undo_log, (tables)(keys)(values) )
@@ -124,6 +124,31 @@ namespace bts { namespace blockchain {
       }
    }
 
+   void  pending_chain_state::get_undo_log( undo_log& log )const
+   {
+      FC_ASSERT( _prev_state );
+      for( const auto& item : properties )
+         log.record_property( (chain_property_enum)item.first, _prev_state->get_property( (chain_property_enum)item.first ) );
+      for( const auto& record : assets )
+         log.record_asset( record.first, _prev_state->get_asset_record( record.first ) );
+      for( const auto& record : names )
+         log.record_name( record.first, _prev_state->get_name_record( record.first ) );
+      for( const auto& record : proposals )
+         log.record_proposal( record.first, _prev_state->get_proposal_record( record.first ) );
+      for( const auto& record : proposal_votes )
+         log.record_proposal_vote( record.first, _prev_state->get_proposal_vote( record.first ) );
+      for( const auto& record : balances )
+         log.record_balance( record.first, _prev_state->get_balance_record( record.first ) );
+      for( const auto& record : bids )
+         log.record_order( bid_table, record.first, _prev_state->get_bid_record( record.first ) );
+      for( const auto& record : asks )
+         log.record_order( ask_table, record.first, _prev_state->get_ask_record( record.first ) );
+      for( const auto& record : shorts )
+         log.record_order( short_table, record.first, _prev_state->get_short_record( record.first ) );
+      for( const auto& record : collateral )
+         log.record_collateral( record.first, _prev_state->get_collateral_record( record.first ) );
+   }
+
    /** load the state from a variant */
    void                    pending_chain_state::from_variant( const fc::variant& v )
    {
@@ -281,28 +306,28 @@ namespace bts { namespace blockchain {
    oorder_record         pending_chain_state::get_bid_record( const market_index_key& key )const
    {
       auto rec_itr = bids.find( key );
-      if( rec_itr == bids.end() ) return rec_itr->second;
+      if( rec_itr != bids.end() ) return rec_itr->second;
       else if( _prev_state ) return _prev_state->get_bid_record( key );
       return oorder_record();
    }
    oorder_record         pending_chain_state::get_ask_record( const market_index_key& key )const
    {
       auto rec_itr = asks.find( key );
-      if( rec_itr == asks.end() ) return rec_itr->second;
+      if( rec_itr != asks.end() ) return rec_itr->second;
       else if( _prev_state ) return _prev_state->get_ask_record( key );
       return oorder_record();
    }
    oorder_record         pending_chain_state::get_short_record( const market_index_key& key )const
    {
       auto rec_itr = shorts.find( key );
-      if( rec_itr == shorts.end() ) return rec_itr->second;
+      if( rec_itr != shorts.end() ) return rec_itr->second;
       else if( _prev_state ) return _prev_state->get_short_record( key );
       return oorder_record();
    }
    ocollateral_record    pending_chain_state::get_collateral_record( const market_index_key& key )const
    {
       auto rec_itr = collateral.find( key );
-      if( rec_itr == collateral.end() ) return rec_itr->second;
+      if( rec_itr != collateral.end() ) return rec_itr->second;
       else if( _prev_state ) return _prev_state->get_collateral_record( key );
       return ocollateral_record();
    }
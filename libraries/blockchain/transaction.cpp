@@ -40,7 +40,7 @@ namespace bts { namespace blockchain {
    }
 
    transaction_evaluation_state::transaction_evaluation_state( const chain_interface_ptr& current_state, digest_type chain_id )
-   :_current_state( current_state ),_chain_id(chain_id)
+   :_current_state( current_state ),_chain_id(chain_id),_skip_signature_check(false)
    {
    }
 
@@ -69,16 +69,10 @@ namespace bts { namespace blockchain {
          fail( BTS_DUPLICATE_TRANSACTION, "transaction has already been processed" );
 
       trx = trx_arg;
-      auto digest = trx_arg.digest( _chain_id );
-      for( auto sig : trx.signatures )
-      {
-         auto key = fc::ecc::public_key( sig, digest ).serialize();
-         signed_keys.insert( address(key) );
-         signed_keys.insert( address(pts_address(key,false,56) ) );
-         signed_keys.insert( address(pts_address(key,true,56) )  );
-         signed_keys.insert( address(pts_address(key,false,0) )  );
-         signed_keys.insert( address(pts_address(key,true,0) )   );
-      }
+      if( !!_precomputed_signed_keys )
+         signed_keys = *_precomputed_signed_keys;
+      else if( !_skip_signature_check )
+         signed_keys = recover_signed_keys( trx_arg, _chain_id );
       for( auto op : trx.operations )
       {
          evaluate_operation( op );
@@ -88,6 +82,23 @@ namespace bts { namespace blockchain {
       update_delegate_votes();
    } FC_RETHROW_EXCEPTIONS( warn, "", ("trx",trx_arg) ) }
 
+   std::unordered_set<address> transaction_evaluation_state::recover_signed_keys( const signed_transaction& trx, 
+                                                                                   const digest_type& chain_id )
+   { try {
+      std::unordered_set<address> keys;
+      auto digest = trx.digest( chain_id );
+      for( auto sig : trx.signatures )
+      {
+         auto key = fc::ecc::public_key( sig, digest ).serialize();
+         keys.insert( address(key) );
+         keys.insert( address(pts_address(key,false,56) ) );
+         keys.insert( address(pts_address(key,true,56) )  );
+         keys.insert( address(pts_address(key,false,0) )  );
+         keys.insert( address(pts_address(key,true,0) )   );
+      }
+      return keys;
+   } FC_RETHROW_EXCEPTIONS( warn, "", ("trx",trx) ) }
+
    /**
     *  Process all fees and update the asset records.
     */
@@ -111,10 +122,13 @@ namespace bts { namespace blockchain {
             fail( BTS_MISSING_REQUIRED_DEPOSIT, fc::variant(req_deposit) );
       }
 
-      for( auto sig : required_keys )
+      if( !_skip_signature_check )
       {
-         if( signed_keys.find( sig ) == signed_keys.end() )
-            fail( BTS_MISSING_SIGNATURE, fc::variant(sig) );
+         for( auto sig : required_keys )
+         {
+            if( signed_keys.find( sig ) == signed_keys.end() )
+               fail( BTS_MISSING_SIGNATURE, fc::variant(sig) );
+         }
       }
 
    } FC_RETHROW_EXCEPTIONS( warn, "" ) }
@@ -282,7 +296,7 @@ namespace bts { namespace blockchain {
    }
    bool transaction_evaluation_state::check_signature( const address& a )const
    {
-      return  signed_keys.find( a ) != signed_keys.end();
+      return _skip_signature_check || signed_keys.find( a ) != signed_keys.end();
    }
 
    void transaction_evaluation_state::add_required_signature( const address& a )
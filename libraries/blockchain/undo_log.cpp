@@ -0,0 +1,145 @@
+#include <bts/blockchain/undo_log.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/raw_variant.hpp>
+#include <fc/reflect/variant.hpp>
+
+namespace bts { namespace blockchain {
+
+   namespace detail
+   {
+      template<typename KeyType, typename RecordType>
+      void record_entry( undo_log& log, undo_table_type table, const KeyType& key, 
+                         const fc::optional<RecordType>& previous_record )
+      {
+         log.tables.push_back( table );
+         log.keys.push_back( fc::raw::pack( key ) );
+         if( previous_record.valid() )
+            log.values.push_back( fc::raw::pack( *previous_record ) );
+         else
+            log.values.push_back( std::vector<char>() );
+      }
+   } // namespace detail
+
+   void undo_log::record_property( chain_property_enum property_id, const fc::variant& previous_value )
+   {
+      fc::optional<fc::variant> previous;
+      if( !previous_value.is_null() ) previous = previous_value;
+      detail::record_entry( *this, property_table, chain_property_type(property_id), previous );
+   }
+
+   void undo_log::record_asset( asset_id_type id, const oasset_record& previous_record )
+   {
+      detail::record_entry( *this, asset_table, id, previous_record );
+   }
+
+   void undo_log::record_name( name_id_type id, const oname_record& previous_record )
+   {
+      detail::record_entry( *this, name_table, id, previous_record );
+   }
+
+   void undo_log::record_balance( const balance_id_type& id, const obalance_record& previous_record )
+   {
+      detail::record_entry( *this, balance_table, id, previous_record );
+   }
+
+   void undo_log::record_proposal( proposal_id_type id, const oproposal_record& previous_record )
+   {
+      detail::record_entry( *this, proposal_table, id, previous_record );
+   }
+
+   void undo_log::record_proposal_vote( const proposal_vote_id_type& id, const oproposal_vote& previous_record )
+   {
+      detail::record_entry( *this, proposal_vote_table, id, previous_record );
+   }
+
+   void undo_log::record_order( undo_table_type table, const market_index_key& key, const oorder_record& previous_record )
+   {
+      FC_ASSERT( table == bid_table || table == ask_table || table == short_table );
+      detail::record_entry( *this, table, key, previous_record );
+   }
+
+   void undo_log::record_collateral( const market_index_key& key, const ocollateral_record& previous_record )
+   {
+      detail::record_entry( *this, collateral_table, key, previous_record );
+   }
+
+   /**
+    *  Tombstones are applied by storing the null form of the record that currently
+    *  exists in state, that way any secondary indexes (names, symbols) are removed
+    *  along with the record itself.
+    */
+   void undo_log::apply( const chain_interface_ptr& state )const
+   { try {
+      FC_ASSERT( tables.size() == keys.size() && tables.size() == values.size() );
+      for( auto i = tables.size(); i > 0; --i )
+      {
+         const auto& key   = keys[i-1];
+         const auto& value = values[i-1];
+         bool tombstone    = value.empty();
+
+         switch( (undo_table_type)tables[i-1] )
+         {
+            case property_table:
+            {
+               auto property_id = (chain_property_enum)fc::raw::unpack<chain_property_type>( key );
+               state->set_property( property_id, tombstone ? fc::variant() : fc::raw::unpack<fc::variant>( value ) );
+               break;
+            }
+            case asset_table:
+            {
+               if( !tombstone ) { state->store_asset_record( fc::raw::unpack<asset_record>( value ) ); break; }
+               auto current = state->get_asset_record( fc::raw::unpack<asset_id_type>( key ) );
+               if( current.valid() ) state->store_asset_record( current->make_null() );
+               break;
+            }
+            case name_table:
+            {
+               if( !tombstone ) { state->store_name_record( fc::raw::unpack<name_record>( value ) ); break; }
+               auto current = state->get_name_record( fc::raw::unpack<name_id_type>( key ) );
+               if( current.valid() ) state->store_name_record( current->make_null() );
+               break;
+            }
+            case balance_table:
+            {
+               if( !tombstone ) { state->store_balance_record( fc::raw::unpack<balance_record>( value ) ); break; }
+               auto current = state->get_balance_record( fc::raw::unpack<balance_id_type>( key ) );
+               if( current.valid() ) state->store_balance_record( current->make_null() );
+               break;
+            }
+            case proposal_table:
+            {
+               if( !tombstone ) { state->store_proposal_record( fc::raw::unpack<proposal_record>( value ) ); break; }
+               auto current = state->get_proposal_record( fc::raw::unpack<proposal_id_type>( key ) );
+               if( current.valid() ) state->store_proposal_record( current->make_null() );
+               break;
+            }
+            case proposal_vote_table:
+            {
+               if( !tombstone ) { state->store_proposal_vote( fc::raw::unpack<proposal_vote>( value ) ); break; }
+               auto current = state->get_proposal_vote( fc::raw::unpack<proposal_vote_id_type>( key ) );
+               if( current.valid() ) state->store_proposal_vote( current->make_null() );
+               break;
+            }
+            case bid_table:
+               state->store_bid_record( fc::raw::unpack<market_index_key>( key ),
+                                        tombstone ? order_record() : fc::raw::unpack<order_record>( value ) );
+               break;
+            case ask_table:
+               state->store_ask_record( fc::raw::unpack<market_index_key>( key ),
+                                        tombstone ? order_record() : fc::raw::unpack<order_record>( value ) );
+               break;
+            case short_table:
+               state->store_short_record( fc::raw::unpack<market_index_key>( key ),
+                                          tombstone ? order_record() : fc::raw::unpack<order_record>( value ) );
+               break;
+            case collateral_table:
+               state->store_collateral_record( fc::raw::unpack<market_index_key>( key ),
+                                               tombstone ? collateral_record() : fc::raw::unpack<collateral_record>( value ) );
+               break;
+            default:
+               FC_ASSERT( false, "unknown undo table ${t}", ("t",tables[i-1]) );
+         }
+      }
+   } FC_RETHROW_EXCEPTIONS( warn, "" ) }
+
+} } // bts::blockchain
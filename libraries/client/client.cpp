@@ -27,7 +27,23 @@ namespace bts { namespace client {
                 _p2p_node->set_delegate(this);
             }
 
-            virtual ~client_impl()override {}
+            virtual ~client_impl()override
+            {
+               // the node calls back into us from its own thread, make sure it has stopped
+               // before _chain_db, _pending_trxs and _wallet are destroyed
+               if( _p2p_node )
+               {
+                  try
+                  {
+                     _p2p_node->close();
+                     _p2p_node->set_delegate( nullptr );
+                  }
+                  catch( const fc::exception& e )
+                  {
+                     wlog( "unexpected exception closing the p2p node: ${e}", ("e",e.to_detail_string()) );
+                  }
+               }
+            }
 
             void delegate_loop();
             signed_transactions get_pending_transactions() const;
@@ -42,6 +58,8 @@ namespace bts { namespace client {
             // @{
             virtual bool has_item(const bts::net::item_id& id) override;
             virtual void handle_message(const bts::net::message&) override;
+            virtual void prevalidate_message(const bts::net::message&) override;
+            virtual std::vector<osigned_transaction> get_unconfirmed_transactions( const std::vector<uint64_t>& short_transaction_ids ) override;
             virtual std::vector<bts::net::item_hash_t> get_item_ids(const bts::net::item_id& from_id,
                                                                     uint32_t& remaining_item_count,
                                                                     uint32_t limit = 2000) override;
@@ -168,20 +186,45 @@ namespace bts { namespace client {
             case block_message_type:
               {
                 block_message block_message_to_handle(message_to_handle.as<block_message>());
-                ilog("CLIENT: just received block ${id}", ("id", block_message_to_handle.block.id()));
+                FC_ASSERT(block_message_to_handle.header_matches_block(), "block message header doesn't match its block");
+                ilog("CLIENT: just received block ${id}", ("id", block_message_to_handle.block_id));
                 on_new_block(block_message_to_handle.block);
                 break;
               }
             case trx_message_type:
               {
                 trx_message trx_message_to_handle(message_to_handle.as<trx_message>());
-                ilog("CLIENT: just received transaction ${id}", ("id", trx_message_to_handle.trx.id()));
+                FC_ASSERT(trx_message_to_handle.header_matches_transaction(), "transaction message header doesn't match its transaction");
+                ilog("CLIENT: just received transaction ${id}", ("id", trx_message_to_handle.trx_id));
                 on_new_transaction(trx_message_to_handle.trx);
                 break;
               }
          }
        }
 
+       void client_impl::prevalidate_message(const bts::net::message& message_to_prevalidate)
+       {
+         if (message_to_prevalidate.msg_type == block_message_type)
+         {
+           block_message block_message_to_prevalidate(message_to_prevalidate.as<block_message>());
+           FC_ASSERT(block_message_to_prevalidate.header_matches_block(), "block message header doesn't match its block");
+           _chain_db->prevalidate_block(block_message_to_prevalidate.block);
+         }
+       }
+
+       std::vector<osigned_transaction> client_impl::get_unconfirmed_transactions(const std::vector<uint64_t>& short_transaction_ids)
+       {
+         std::vector<osigned_transaction> unconfirmed_transactions;
+         unconfirmed_transactions.reserve(short_transaction_ids.size());
+         for (uint64_t short_id : short_transaction_ids)
+         {
+           transaction_id_type id_prefix;
+           memcpy(id_prefix.data(), (const char*)&short_id, sizeof(short_id));
+           unconfirmed_transactions.push_back(_chain_db->get_pending_transaction_by_id_prefix(id_prefix, sizeof(short_id)));
+         }
+         return unconfirmed_transactions;
+       }
+
        /**
         *  Get the hash of all blocks after from_id
         */
@@ -192,41 +235,30 @@ namespace bts { namespace client {
          FC_ASSERT(from_id.item_type == bts::client::block_message_type);
          ilog("head_block is ${head_block_num}", ("head_block_num", _chain_db->get_head_block_num()));
 
-         uint32_t last_seen_block_num;
-         try
+         // find_block_num also knows blocks on forks we aren't on, only count the block as
+         // seen if it's the one our current chain has at that height (a null id is block 0)
+         uint32_t head_block_num = _chain_db->get_head_block_num();
+         fc::optional<uint32_t> last_seen_block_num = _chain_db->find_block_num(from_id.item_hash);
+         bool last_seen_block_is_in_our_chain = false;
+         if (last_seen_block_num && *last_seen_block_num <= head_block_num)
          {
-           last_seen_block_num = _chain_db->get_block_num(from_id.item_hash);
-         }
-         catch (fc::key_not_found_exception&)
-         {
-           if (from_id.item_hash == bts::net::item_hash_t())
-             last_seen_block_num = 0;
+           if (*last_seen_block_num == 0)
+             last_seen_block_is_in_our_chain = true;
            else
            {
-             remaining_item_count = 0;
-             return std::vector<bts::net::item_hash_t>();
+             fc::optional<block_id_type> block_id_in_our_chain = _chain_db->find_block_id(*last_seen_block_num);
+             last_seen_block_is_in_our_chain = block_id_in_our_chain && *block_id_in_our_chain == from_id.item_hash;
            }
          }
-         remaining_item_count = _chain_db->get_head_block_num() - last_seen_block_num;
-         uint32_t items_to_get_this_iteration = std::min(limit, remaining_item_count);
-         std::vector<bts::net::item_hash_t> hashes_to_return;
-         hashes_to_return.reserve(items_to_get_this_iteration);
-         for (uint32_t i = 0; i < items_to_get_this_iteration; ++i)
+         if (!last_seen_block_is_in_our_chain)
          {
-           ++last_seen_block_num;
-           signed_block_header header;
-           try
-           {
-             header = _chain_db->get_block(last_seen_block_num);
-           }
-           catch (fc::key_not_found_exception&)
-           {
-             ilog( "attempting to fetch last_seen ${i}", ("i",last_seen_block_num) );
-             assert( !"I assume this can never happen");
-           }
-           hashes_to_return.push_back(header.id());
+           remaining_item_count = 0;
+           return std::vector<bts::net::item_hash_t>();
          }
-         remaining_item_count -= items_to_get_this_iteration;
+         remaining_item_count = head_block_num - *last_seen_block_num;
+         uint32_t items_to_get_this_iteration = std::min(limit, remaining_item_count);
+         std::vector<bts::net::item_hash_t> hashes_to_return = _chain_db->get_block_ids(*last_seen_block_num + 1, items_to_get_this_iteration);
+         remaining_item_count -= std::min<uint32_t>(remaining_item_count, hashes_to_return.size());
          return hashes_to_return;
        }
 
@@ -237,7 +269,10 @@ namespace bts { namespace client {
         uint32_t low_block_num = 1;
         do
         {
-          synopsis.push_back(_chain_db->get_block(low_block_num).id());
+          fc::optional<block_id_type> block_id = _chain_db->find_block_id(low_block_num);
+          if (!block_id)
+            break;
+          synopsis.push_back(*block_id);
           low_block_num += ((high_block_num - low_block_num + 2) / 2);
         }
         while (low_block_num <= high_block_num);
@@ -249,11 +284,11 @@ namespace bts { namespace client {
        {
          if (id.item_type == block_message_type)
          {
-        //   uint32_t block_number = _chain_db->get_block_num(id.item_hash);
-           bts::client::block_message block_message_to_send(_chain_db->get_block(id.item_hash));
-           FC_ASSERT(id.item_hash == block_message_to_send.block_id); //.id());
-        //   block_message_to_send.signature = block_message_to_send.block.delegate_signature;
-           return block_message_to_send;
+           // send the block as it is stored instead of decoding it and packing it again,
+           // the block_id_to_block database is keyed by id so it can't hand us the wrong block
+           std::vector<char> packed_block_message(block_message_header::packed_size);
+           _chain_db->get_packed_block(id.item_hash, packed_block_message);
+           return block_message_header::frame_packed_block(id.item_hash, std::move(packed_block_message));
          }
 
          if (id.item_type == trx_message_type)
@@ -261,7 +296,7 @@ namespace bts { namespace client {
            trx_message trx_message_to_send;
            auto iter = _pending_trxs.find(id.item_hash);
            if (iter != _pending_trxs.end())
-             trx_message_to_send.trx = iter->second;
+             trx_message_to_send = trx_message(iter->second);
          }
 
          FC_THROW_EXCEPTION(key_not_found_exception, "I don't have the item you're looking for");
@@ -754,6 +789,11 @@ namespace bts { namespace client {
       FC_THROW_EXCEPTION(invalid_operation_exception, "get_block_propagation_data only valid in p2p mode");
     }
 
+    fc::variant_object client::network_get_propagation_statistics()
+    {
+      return my->_p2p_node->get_propagation_statistics();
+    }
+
 
     //JSON-RPC Method Implementations END
 
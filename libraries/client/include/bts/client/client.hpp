@@ -155,6 +155,7 @@ namespace bts { namespace client {
 
          bts::net::message_propagation_data network_get_transaction_propagation_data(const transaction_id_type& transaction_id) override;
          bts::net::message_propagation_data network_get_block_propagation_data(const block_id_type& block_id) override;
+         fc::variant_object network_get_propagation_statistics() override;
 
          fc::path                            get_data_dir() const;
 
@@ -6,11 +6,25 @@ namespace bts { namespace client {
 
    enum message_type_enum
    {
-      trx_message_type          = 1000,
-      block_message_type        = 1001
+      trx_message_type                              = 1000,
+      block_message_type                            = 1001,
+      compact_block_message_type                    = 1002,
+      fetch_compact_block_transactions_message_type = 1003,
+      compact_block_transactions_message_type       = 1004
    };
 
-   struct trx_message
+   /**
+    *  The fixed-size fields packed at the front of a trx_message, the p2p code reads
+    *  them with peek() instead of unpacking the transaction.
+    */
+   struct trx_message_header
+   {
+      bts::blockchain::transaction_id_type trx_id;
+
+      static trx_message_header peek(const bts::net::message& packed_trx_message);
+   };
+
+   struct trx_message : public trx_message_header
    {
       static const message_type_enum type;
 
@@ -18,24 +32,109 @@ namespace bts { namespace client {
       trx_message() {}
       trx_message(bts::blockchain::signed_transaction transaction) :
         trx(std::move(transaction))
-      {}
+      {
+        trx_id = trx.id();
+      }
+
+      /** the header is supplied by the sender, this checks it against the transaction */
+      bool header_matches_transaction()const;
    };
 
-   struct block_message
+   /**
+    *  The fixed-size fields packed at the front of a block_message, the p2p code reads
+    *  them with peek() to route blocks instead of unpacking every transaction in the block.
+    */
+   struct block_message_header
+   {
+      bts::blockchain::block_id_type block_id;
+      uint32_t                       block_num;
+      bts::blockchain::block_id_type previous;
+
+      block_message_header():block_num(0){}
+
+      static block_message_header peek(const bts::net::message& packed_block_message);
+
+      /** the number of bytes the header occupies at the front of a packed block_message */
+      static const size_t packed_size;
+
+      /**
+       *  Builds a block_message from packed_size bytes of space followed by a packed full_block,
+       *  as returned by chain_database::get_packed_block().  The header is filled in from the
+       *  front of the packed block, so the block itself is never decoded.
+       */
+      static bts::net::message frame_packed_block(const bts::blockchain::block_id_type& block_id, std::vector<char>&& data);
+   };
+
+   struct block_message : public block_message_header
    {
       static const message_type_enum type;
 
       block_message(){}
       block_message(const bts::blockchain::full_block& blk )
-      :block(blk),block_id(blk.id()){}
+      :block(blk)
+      {
+         block_id  = blk.id();
+         block_num = blk.block_num;
+         previous  = blk.previous;
+      }
 
       bts::blockchain::full_block    block;
-      bts::blockchain::block_id_type block_id;
 
+      /** the header is supplied by the sender, this checks it against the block */
+      bool header_matches_block()const;
+   };
+
+   /** the first 8 bytes of a transaction id, enough to find it among our pending transactions */
+   typedef uint64_t short_transaction_id_type;
+
+   /**
+    *  Sent instead of a block_message to peers that advertise "compact_blocks" in
+    *  their user_agent.  The peer rebuilds the block from the transactions it 
+    *  already has and asks for the rest with fetch_compact_block_transactions_message.
+    */
+   struct compact_block_message
+   {
+      static const message_type_enum type;
+
+      compact_block_message(){}
+      compact_block_message(const bts::net::item_hash_t& block_message_hash, const block_message& full_block_message);
+
+      static short_transaction_id_type short_transaction_id(const bts::blockchain::transaction_id_type& id);
+
+      bts::net::item_hash_t                  block_message_hash; ///< id of the block_message this replaces
+      bts::blockchain::signed_block_header   block_header;
+      bts::blockchain::block_id_type         block_id;
+      std::vector<short_transaction_id_type> short_transaction_ids;
+   };
+
+   struct fetch_compact_block_transactions_message
+   {
+      static const message_type_enum type;
+
+      fetch_compact_block_transactions_message(){}
+      fetch_compact_block_transactions_message(const bts::net::item_hash_t& block_message_hash, std::vector<uint32_t> indices)
+      :block_message_hash(block_message_hash),indices(std::move(indices)){}
+
+      bts::net::item_hash_t block_message_hash;
+      std::vector<uint32_t> indices; ///< positions in the block's transaction list
+   };
+
+   struct compact_block_transactions_message
+   {
+      static const message_type_enum type;
+
+      bts::net::item_hash_t                        block_message_hash;
+      std::vector<uint32_t>                        indices;
+      bts::blockchain::signed_transactions         transactions;
    };
 
 } } // bts::client
 
-FC_REFLECT_ENUM( bts::client::message_type_enum, (trx_message_type)(block_message_type) )
-FC_REFLECT( bts::client::trx_message, (trx) )
-FC_REFLECT( bts::client::block_message, (block)(block_id) )
+FC_REFLECT_ENUM( bts::client::message_type_enum, (trx_message_type)(block_message_type)(compact_block_message_type)(fetch_compact_block_transactions_message_type)(compact_block_transactions_message_type) )
+FC_REFLECT( bts::client::trx_message_header, (trx_id) )
+FC_REFLECT_DERIVED( bts::client::trx_message, (bts::client::trx_message_header), (trx) )
+FC_REFLECT( bts::client::block_message_header, (block_id)(block_num)(previous) )
+FC_REFLECT_DERIVED( bts::client::block_message, (bts::client::block_message_header), (block) )
+FC_REFLECT( bts::client::compact_block_message, (block_message_hash)(block_header)(block_id)(short_transaction_ids) )
+FC_REFLECT( bts::client::fetch_compact_block_transactions_message, (block_message_hash)(indices) )
+FC_REFLECT( bts::client::compact_block_transactions_message, (block_message_hash)(indices)(transactions) )
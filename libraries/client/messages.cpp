@@ -3,5 +3,74 @@ namespace bts { namespace client {
 
    const message_type_enum trx_message::type                 = message_type_enum::trx_message_type;
    const message_type_enum block_message::type               = message_type_enum::block_message_type;
+   const message_type_enum compact_block_message::type       = message_type_enum::compact_block_message_type;
+   const message_type_enum fetch_compact_block_transactions_message::type = message_type_enum::fetch_compact_block_transactions_message_type;
+   const message_type_enum compact_block_transactions_message::type       = message_type_enum::compact_block_transactions_message_type;
+
+   trx_message_header trx_message_header::peek(const bts::net::message& packed_trx_message)
+   { try {
+      FC_ASSERT( packed_trx_message.msg_type == trx_message::type );
+      fc::datastream<const char*> ds( packed_trx_message.data.data(), packed_trx_message.data.size() );
+      trx_message_header header;
+      fc::raw::unpack( ds, header );
+      return header;
+   } FC_RETHROW_EXCEPTIONS( warn, "unable to read transaction message header" ) }
+
+   bool trx_message::header_matches_transaction()const
+   {
+      return trx_id == trx.id();
+   }
+
+   block_message_header block_message_header::peek(const bts::net::message& packed_block_message)
+   { try {
+      FC_ASSERT( packed_block_message.msg_type == block_message::type );
+      fc::datastream<const char*> ds( packed_block_message.data.data(), packed_block_message.data.size() );
+      block_message_header header;
+      fc::raw::unpack( ds, header );
+      return header;
+   } FC_RETHROW_EXCEPTIONS( warn, "unable to read block message header" ) }
+
+   const size_t block_message_header::packed_size = fc::raw::pack_size( block_message_header() );
+
+   bts::net::message block_message_header::frame_packed_block(const bts::blockchain::block_id_type& block_id, std::vector<char>&& data)
+   { try {
+      FC_ASSERT( data.size() > packed_size );
+      block_message_header header;
+      header.block_id = block_id;
+      // a packed full_block starts with the block_header fields previous and block_num
+      fc::datastream<const char*> block_ds( data.data() + packed_size, data.size() - packed_size );
+      fc::raw::unpack( block_ds, header.previous );
+      fc::raw::unpack( block_ds, header.block_num );
+      fc::datastream<char*> header_ds( data.data(), packed_size );
+      fc::raw::pack( header_ds, header );
+
+      bts::net::message packed_block_message;
+      packed_block_message.msg_type = block_message::type;
+      packed_block_message.data     = std::move(data);
+      packed_block_message.size     = packed_block_message.data.size();
+      return packed_block_message;
+   } FC_RETHROW_EXCEPTIONS( warn, "unable to frame packed block ${id}", ("id",block_id) ) }
+
+   bool block_message::header_matches_block()const
+   {
+      return block_id == block.id() && block_num == block.block_num && previous == block.previous;
+   }
+
+   compact_block_message::compact_block_message(const bts::net::item_hash_t& block_message_hash, const block_message& full_block_message)
+   :block_message_hash(block_message_hash),
+    block_header(full_block_message.block),
+    block_id(full_block_message.block_id)
+   {
+      short_transaction_ids.reserve(full_block_message.block.user_transactions.size());
+      for( const bts::blockchain::signed_transaction& trx : full_block_message.block.user_transactions )
+         short_transaction_ids.push_back(short_transaction_id(trx.id()));
+   }
+
+   short_transaction_id_type compact_block_message::short_transaction_id(const bts::blockchain::transaction_id_type& id)
+   {
+      short_transaction_id_type short_id;
+      memcpy((char*)&short_id, id.data(), sizeof(short_id));
+      return short_id;
+   }
 
 } } // bts::client
@@ -82,6 +82,31 @@ namespace bts { namespace db {
           } FC_RETHROW_EXCEPTIONS( warn, "error fetching key ${key}", ("key",k) );
         }
 
+        /**
+         *  Like fetch(), but appends the value to packed_value exactly as it is stored
+         *  instead of unpacking it.  The value is copied once, straight from the slice
+         *  leveldb's iterator points at (Get() would copy it into a std::string first).
+         */
+        void fetch_raw( const Key& k, std::vector<char>& packed_value )
+        {
+          try {
+             std::vector<char> kslice = fc::raw::pack( k );
+             ldb::Slice ks( kslice.data(), kslice.size() );
+             std::unique_ptr<ldb::Iterator> it( _db->NewIterator( ldb::ReadOptions() ) );
+             it->Seek( ks );
+             if( !it->status().ok() )
+             {
+                 FC_THROW_EXCEPTION( exception, "database error: ${msg}", ("msg", it->status().ToString() ) );
+             }
+             if( !it->Valid() || it->key() != ks )
+             {
+               FC_THROW_EXCEPTION( key_not_found_exception, "unable to find key ${key}", ("key",k) );
+             }
+             ldb::Slice value = it->value();
+             packed_value.insert( packed_value.end(), value.data(), value.data() + value.size() );
+          } FC_RETHROW_EXCEPTIONS( warn, "error fetching key ${key}", ("key",k) );
+        }
+
         class iterator
         {
            public:
@@ -0,0 +1,86 @@
+#include <algorithm>
+
+#include <bts/net/bandwidth.hpp>
+
+namespace bts { namespace net {
+
+static int64_t second_containing(fc::time_point time)
+{
+  return time.time_since_epoch().count() / fc::seconds(1).count();
+}
+
+transfer_rate_meter::transfer_rate_meter() :
+  _total_bytes(0)
+{
+  _bytes_in_second.fill(0);
+  _second.fill(-1);
+}
+
+void transfer_rate_meter::record(uint64_t bytes, fc::time_point now)
+{
+  int64_t current_second = second_containing(now);
+  size_t index = current_second % BANDWIDTH_MEASUREMENT_WINDOW;
+  if (_second[index] != current_second)
+  {
+    _second[index] = current_second;
+    _bytes_in_second[index] = 0;
+  }
+  _bytes_in_second[index] += bytes;
+  _total_bytes += bytes;
+}
+
+uint64_t transfer_rate_meter::get_rate(fc::time_point now) const
+{
+  int64_t current_second = second_containing(now);
+  uint64_t bytes_in_window = 0;
+  for (size_t i = 0; i < BANDWIDTH_MEASUREMENT_WINDOW; ++i)
+    if (_second[i] > current_second - BANDWIDTH_MEASUREMENT_WINDOW && _second[i] <= current_second)
+      bytes_in_window += _bytes_in_second[i];
+  return bytes_in_window / BANDWIDTH_MEASUREMENT_WINDOW;
+}
+
+token_bucket::token_bucket(uint64_t bytes_per_second) :
+  _bytes_per_second(bytes_per_second),
+  _tokens(bytes_per_second),
+  _last_refill_time(fc::time_point::now())
+{
+}
+
+void token_bucket::set_rate(uint64_t bytes_per_second)
+{
+  refill(fc::time_point::now());
+  _bytes_per_second = bytes_per_second;
+  _tokens = std::min<int64_t>(_tokens, bytes_per_second);
+}
+
+void token_bucket::refill(fc::time_point now)
+{
+  if (now <= _last_refill_time)
+    return;
+  // the bucket never holds more than a second's worth, so there's no point counting further back
+  int64_t elapsed_microseconds = std::min<int64_t>((now - _last_refill_time).count(), fc::seconds(1).count());
+  _tokens = std::min<int64_t>(_tokens + (int64_t)(_bytes_per_second * elapsed_microseconds / fc::seconds(1).count()), 
+                              _bytes_per_second);
+  _last_refill_time = now;
+}
+
+fc::microseconds token_bucket::time_until_available(fc::time_point now)
+{
+  if (_bytes_per_second == 0)
+    return fc::microseconds();
+  refill(now);
+  if (_tokens > 0)
+    return fc::microseconds();
+  // one extra microsecond so we don't wake up just short of the first token
+  return fc::microseconds(-_tokens * fc::seconds(1).count() / (int64_t)_bytes_per_second + 1);
+}
+
+void token_bucket::consume(uint64_t bytes, fc::time_point now)
+{
+  if (_bytes_per_second == 0)
+    return;
+  refill(now);
+  _tokens -= bytes;
+}
+
+} } // bts::net
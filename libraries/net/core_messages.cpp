@@ -1,4 +1,8 @@
 #include <bts/net/core_messages.hpp>
+#include <fc/exception/exception.hpp>
+#ifdef BTS_NET_HAVE_ZLIB
+# include <zlib.h>
+#endif
 
 namespace bts { namespace net {
 
@@ -12,5 +16,52 @@ namespace bts { namespace net {
   const core_message_type_enum connection_rejected_message::type           = core_message_type_enum::connection_rejected_message_type;
   const core_message_type_enum address_request_message::type               = core_message_type_enum::address_request_message_type;
   const core_message_type_enum address_message::type                       = core_message_type_enum::address_message_type;
+  const core_message_type_enum compressed_message::type                    = core_message_type_enum::compressed_message_type;
+  const core_message_type_enum fetch_items_message::type                   = core_message_type_enum::fetch_items_message_type;
+  const core_message_type_enum items_message::type                         = core_message_type_enum::items_message_type;
+
+  fc::optional<message> compress_message(const message& message_to_compress)
+  {
+#ifdef BTS_NET_HAVE_ZLIB
+    compressed_message compressed;
+    compressed.original_msg_type = message_to_compress.msg_type;
+    compressed.original_size = message_to_compress.data.size();
+
+    uLongf compressed_size = compressBound(message_to_compress.data.size());
+    compressed.compressed_data.resize(compressed_size);
+    if (compress2((Bytef*)compressed.compressed_data.data(), &compressed_size,
+                  (const Bytef*)message_to_compress.data.data(), message_to_compress.data.size(),
+                  MESSAGE_COMPRESSION_LEVEL) != Z_OK)
+      return fc::optional<message>();
+    // leave room for the fields of compressed_message
+    if (compressed_size + 16 >= message_to_compress.data.size())
+      return fc::optional<message>();
+    compressed.compressed_data.resize(compressed_size);
+    return message(compressed);
+#else
+    return fc::optional<message>();
+#endif
+  }
+
+  message decompress_message(const compressed_message& message_to_decompress)
+  { try {
+    FC_ASSERT(message_to_decompress.original_size <= MAX_MESSAGE_SIZE);
+    FC_ASSERT(message_to_decompress.original_msg_type != compressed_message::type);
+#ifndef BTS_NET_HAVE_ZLIB
+    FC_THROW_EXCEPTION(fc::assert_exception, "this node was built without zlib and doesn't advertise compression");
+#else
+    message decompressed;
+    decompressed.msg_type = message_to_decompress.original_msg_type;
+    decompressed.data.resize(message_to_decompress.original_size);
+    uLongf decompressed_size = decompressed.data.size();
+    int result = uncompress((Bytef*)decompressed.data.data(), &decompressed_size,
+                            (const Bytef*)message_to_decompress.compressed_data.data(), 
+                            message_to_decompress.compressed_data.size());
+    FC_ASSERT(result == Z_OK && decompressed_size == message_to_decompress.original_size, 
+              "unable to decompress message", ("result", result));
+    decompressed.size = decompressed.data.size();
+    return decompressed;
+#endif
+  } FC_RETHROW_EXCEPTIONS(warn, "", ("original_msg_type", message_to_decompress.original_msg_type)) }
 
 } } // bts::client
@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <stdint.h>
+#include <fc/time.hpp>
+#include <bts/net/config.hpp>
+
+namespace bts { namespace net {
+
+/**
+ *  Counts the bytes transferred in each of the last BANDWIDTH_MEASUREMENT_WINDOW 
+ *  seconds, so we can report a rate that follows the traffic without being thrown 
+ *  off by a single burst.
+ */
+class transfer_rate_meter
+{
+  public:
+    transfer_rate_meter();
+
+    void     record(uint64_t bytes, fc::time_point now = fc::time_point::now());
+    /** average bytes per second over the measurement window */
+    uint64_t get_rate(fc::time_point now = fc::time_point::now()) const;
+    uint64_t get_total_bytes() const { return _total_bytes; }
+
+  private:
+    std::array<uint64_t, BANDWIDTH_MEASUREMENT_WINDOW> _bytes_in_second;
+    std::array<int64_t, BANDWIDTH_MEASUREMENT_WINDOW>  _second; /// which second each entry in _bytes_in_second counts
+    uint64_t                                           _total_bytes;
+};
+
+/**
+ *  Limits a transfer rate.  Tokens (bytes) accumulate at the configured rate, up to 
+ *  one second's worth.  A write may overdraw the bucket, the next one then waits for
+ *  it to refill, so the rate holds on average without having to split up writes.
+ *  A rate of zero means no limit.
+ */
+class token_bucket
+{
+  public:
+    token_bucket(uint64_t bytes_per_second = 0);
+
+    void             set_rate(uint64_t bytes_per_second);
+    uint64_t         get_rate() const { return _bytes_per_second; }
+
+    /** how long to wait before writing, zero if we can write now */
+    fc::microseconds time_until_available(fc::time_point now = fc::time_point::now());
+    void             consume(uint64_t bytes, fc::time_point now = fc::time_point::now());
+
+  private:
+    void             refill(fc::time_point now);
+
+    uint64_t         _bytes_per_second;
+    int64_t          _tokens;
+    fc::time_point   _last_refill_time;
+};
+
+} } // bts::net
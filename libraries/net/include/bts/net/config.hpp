@@ -1,6 +1,13 @@
 #pragma once
 
-#define BTS_NET_PROTOCOL_VERSION 100
+#define BTS_NET_PROTOCOL_VERSION 101
+
+/**
+ * Peers running an older protocol than this are rejected during the hello
+ * handshake.  Version 101 changed the layout of block and transaction
+ * messages, older peers can't read ours and we can't read theirs
+ */
+#define BTS_NET_MINIMUM_PROTOCOL_VERSION 101
 
 /** 
  * Define this to enable debugging code in the p2p network interface.
@@ -10,7 +17,140 @@
  */
 #define ENABLE_P2P_DEBUGGING_API 1
 
+// ENABLE_P2P_NETWORK_SIMULATION is defined when the build is configured with
+// BTS_ENABLE_NETWORK_SIMULATION (it's off by default).  It compiles in the simulated
+// latency and packet loss that tests/p2p_loopback_benchmark uses, which no production node
+// should let anyone set through set_advanced_node_parameters
+
 /**
  * 512 kb
  */
 #define MAX_MESSAGE_SIZE (524288)  
+
+/**
+ * Messages at least this large are zlib-compressed before being sent to
+ * peers that support it (mostly blocks and long inventory lists)
+ */
+#define MESSAGE_COMPRESSION_THRESHOLD (1024)
+#define MESSAGE_COMPRESSION_LEVEL 6
+
+/**
+ * Size of the buffer each connection decrypts incoming data into, several
+ * small messages can be read with a single socket read.  Grows as needed 
+ * to hold a full MAX_MESSAGE_SIZE message.
+ */
+#define MESSAGE_RECEIVE_BUFFER_SIZE (64*1024)
+
+/**
+ * A connection's writer task combines queued messages into writes of
+ * about this many bytes, each followed by a single flush.
+ */
+#define MESSAGE_SEND_BATCH_SIZE (64*1024)
+
+/**
+ * If more than this many bytes are waiting to be sent to a peer, the
+ * peer isn't keeping up with us and will be disconnected.  Bytes our own
+ * upload limits are holding back don't count, up to what the limits let
+ * through in MAX_SELF_THROTTLED_SEND_SECONDS (and at most another
+ * MAX_SEND_QUEUE_SIZE)
+ */
+#define MAX_SEND_QUEUE_SIZE (8*1024*1024)
+#define MAX_SELF_THROTTLED_SEND_SECONDS 60
+
+/**
+ * Urgent messages are sent without waiting on the upload limits.  After
+ * this many urgent writes in a row, the next write takes from the ordinary
+ * queue, so control messages still get out while we're relaying a lot
+ */
+#define MAX_URGENT_BATCHES_BEFORE_ORDINARY 4
+
+/**
+ * When we close a connection, the last few queued messages get this
+ * long to reach the peer before the socket is closed without them.
+ */
+#define CLOSE_CONNECTION_FLUSH_TIMEOUT_SECONDS 10
+
+/**
+ * During sync, the number of blocks we'll request from a single peer without
+ * waiting for replies.  This is the window given to the fastest peer, slower
+ * ones get a smaller window.  Can be changed with set_advanced_node_parameters()
+ */
+#define MAX_SYNC_ITEMS_IN_FLIGHT_PER_PEER 16
+
+/**
+ * Seconds to wait for a peer to send a sync block we requested before
+ * requesting it from another peer
+ */
+#define SYNC_ITEM_REQUEST_TIMEOUT 30
+
+/**
+ * We remember which items we've advertised to each peer and which it has
+ * advertised to us, so we don't advertise them back.  Items are forgotten 
+ * after this many seconds, or sooner if more than MAX_INVENTORY_ITEMS_TRACKED_PER_PEER
+ * are being tracked.
+ */
+#define INVENTORY_TRACKING_EXPIRATION (60*5)
+#define MAX_INVENTORY_ITEMS_TRACKED_PER_PEER 20000
+
+/**
+ * Seconds to wait for a peer to send an item (transaction or block) we
+ * requested during normal operation before asking another peer for it
+ */
+#define ITEM_REQUEST_TIMEOUT 15
+
+/**
+ * The most compact blocks we'll rebuild from one peer at a time.  Past this,
+ * and for any compact block whose missing transactions don't arrive within
+ * ITEM_REQUEST_TIMEOUT, we fetch the full block instead
+ */
+#define MAX_COMPACT_BLOCKS_BEING_RECONSTRUCTED_PER_PEER 8
+
+/**
+ * The most items we ask a peer for in one fetch_items_message.  Blocks
+ * are always requested one at a time
+ */
+#define MAX_ITEMS_PER_FETCH_REQUEST 64
+
+/**
+ * When the sync blocks we've received but can't process yet (because an
+ * earlier block hasn't arrived) take up this many bytes, we stop requesting
+ * anything but the blocks we need next
+ */
+#define MAX_SYNC_BACKLOG_SIZE (64*1024*1024)
+
+/**
+ * The most bytes of messages (counting compressed copies) the node keeps 
+ * in its cache of items it is relaying.  Messages are normally dropped a 
+ * couple of blocks after they arrive; if a flood of transactions exceeds 
+ * this between blocks, the least recently used ones are dropped early
+ */
+#define MAX_MESSAGE_CACHE_SIZE_IN_BYTES (32*1024*1024)
+
+/**
+ * When choosing which peers to connect to, peers we've never measured are
+ * assumed to answer requests in this many milliseconds.  Peers we've seen
+ * answer faster are tried first
+ */
+#define UNMEASURED_PEER_LATENCY_MS 1000
+
+/**
+ * Upload and download rates are averaged over this many seconds.  Shorter
+ * windows follow changes in traffic faster, longer ones smooth out bursts
+ */
+#define BANDWIDTH_MEASUREMENT_WINDOW 10
+
+/**
+ * Default caps, in bytes per second, on what we upload to all peers combined
+ * and to any one peer.  Zero means no limit.  Blocks and transactions we're
+ * relaying aren't held back by these limits, so they mainly throttle the 
+ * blocks we serve to peers that are syncing from us
+ */
+#define DEFAULT_MAXIMUM_UPLOAD_RATE 0
+#define DEFAULT_MAXIMUM_UPLOAD_RATE_PER_PEER 0
+
+/**
+ * When simulating packet loss (see message_oriented_connection::set_simulated_network_conditions),
+ * a lost write holds up the connection for this many milliseconds plus a round trip, about
+ * what a TCP retransmission costs
+ */
+#define SIMULATED_RETRANSMISSION_TIMEOUT_MS 200
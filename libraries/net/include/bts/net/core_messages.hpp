@@ -1,8 +1,10 @@
 #pragma once
 
 #include <bts/net/config.hpp>
+#include <bts/net/message.hpp>
 
 #include <fc/crypto/ripemd160.hpp>
+#include <fc/optional.hpp>
 #include <fc/crypto/sha256.hpp>
 #include <fc/network/ip.hpp>
 #include <fc/reflect/reflect.hpp>
@@ -42,6 +44,9 @@ namespace bts { namespace net {
     connection_rejected_message_type           = 5008,
     address_request_message_type               = 5009,
     address_message_type                       = 5010,
+    compressed_message_type                    = 5011,
+    fetch_items_message_type                   = 5012,
+    items_message_type                         = 5013
   };
 
   const uint32_t core_protocol_version = BTS_NET_PROTOCOL_VERSION;
@@ -204,6 +209,60 @@ namespace bts { namespace net {
     std::vector<address_info> addresses;
   };
 
+  /**
+   *  Wraps another message whose data has been zlib-compressed.  Only sent to peers
+   *  that list "zlib" in the "compression" property of their user_agent.
+   */
+  struct compressed_message
+  {
+    static const core_message_type_enum type;
+
+    uint32_t          original_msg_type;
+    uint32_t          original_size;
+    std::vector<char> compressed_data;
+  };
+
+  /**
+   *  Requests several items of the same type in one round trip.  Only sent to peers
+   *  that set "batched_fetch" in their user_agent, they reply with items_messages
+   *  (and an item_not_available_message for each item they don't have).
+   */
+  struct fetch_items_message
+  {
+    static const core_message_type_enum type;
+
+    uint32_t                 item_type;
+    std::vector<item_hash_t> items_to_fetch;
+
+    fetch_items_message() {}
+    fetch_items_message(uint32_t item_type, const std::vector<item_hash_t>& items_to_fetch) :
+      item_type(item_type),
+      items_to_fetch(items_to_fetch)
+    {}
+  };
+
+  /**
+   *  Carries the data of several messages of type item_type, each is handled as if 
+   *  it had arrived in its own message.
+   */
+  struct items_message
+  {
+    static const core_message_type_enum type;
+
+    uint32_t                        item_type;
+    std::vector<std::vector<char> > items;
+
+    items_message() {}
+    items_message(uint32_t item_type) :
+      item_type(item_type)
+    {}
+  };
+
+  /** returns a compressed_message, or an invalid optional if compression wouldn't make it smaller
+   *  or bts_net was built without zlib (in which case the node doesn't advertise compression) */
+  fc::optional<message> compress_message(const message& message_to_compress);
+  message decompress_message(const compressed_message& message_to_decompress);
+
 } } // bts::client
 
 FC_REFLECT_ENUM( bts::net::core_message_type_enum, (item_ids_inventory_message_type)(blockchain_item_ids_inventory_message_type)(fetch_blockchain_item_ids_message_type)(fetch_item_message_type)(hello_message_type)(address_request_message_type))
@@ -219,6 +278,9 @@ FC_REFLECT( bts::net::connection_rejected_message, (user_agent)(core_protocol_ve
 FC_REFLECT_EMPTY( bts::net::address_request_message )
 FC_REFLECT( bts::net::address_info, (remote_endpoint)(last_seen_time) )
 FC_REFLECT( bts::net::address_message, (addresses) )
+FC_REFLECT( bts::net::compressed_message, (original_msg_type)(original_size)(compressed_data) )
+FC_REFLECT( bts::net::fetch_items_message, (item_type)(items_to_fetch) )
+FC_REFLECT( bts::net::items_message, (item_type)(items) )
 
 #include <unordered_map>
 #include <fc/crypto/city.hpp>
@@ -5,6 +5,7 @@
 #include <fc/io/raw.hpp>
 #include <fc/crypto/ripemd160.hpp>
 #include <fc/reflect/variant.hpp>
+#include <memory>
 
 namespace bts { namespace net {
 
@@ -87,6 +88,12 @@ namespace bts { namespace net {
      }
   };
 
+  /**
+   *  Messages aren't modified once they're built, so the node shares one copy of 
+   *  each body between the message cache and the send queues of every peer.
+   */
+  typedef std::shared_ptr<const message> message_ptr;
+
 } } // bts::net
 
 
@@ -1,6 +1,9 @@
 #pragma once
 #include <fc/network/tcp_socket.hpp>
+#include <fc/variant_object.hpp>
 #include <bts/net/message.hpp>
+#include <bts/net/bandwidth.hpp>
+#include <bts/net/config.hpp>
 
 namespace bts { namespace net {
 
@@ -12,7 +15,7 @@ namespace bts { namespace net {
   class message_oriented_connection_delegate 
   {
   public:
-    virtual void on_message(message_oriented_connection* originating_connection, const message& received_message) = 0;
+    virtual void on_message(message_oriented_connection* originating_connection, const message_ptr& received_message) = 0;
     virtual void on_connection_closed(message_oriented_connection* originating_connection) = 0;
   };
 
@@ -27,13 +30,39 @@ namespace bts { namespace net {
     void connect_to(const fc::ip::endpoint& remote_endpoint);
     void connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint);
 
+    /** queues the message, it is written to the socket by a separate task */
     void send_message(const message& message_to_send);
+    /** queues the message without copying its body */
+    void send_message(const message_ptr& message_to_send);
+    /** queues the message ahead of ordinary messages, it isn't held back by the upload rate limits */
+    void send_urgent_message(const message_ptr& message_to_send);
     void close_connection();
+    /** number of bytes queued by send_message() that haven't been written yet */
+    size_t get_send_queue_size() const;
+    /** true once the connection is being closed, anything sent after that is dropped */
+    bool is_closing() const;
 
     uint64_t get_total_bytes_sent() const;
     uint64_t get_total_bytes_received() const;
     fc::time_point get_last_message_sent_time() const;
     fc::time_point get_last_message_received_time() const;
+
+    /** caps what this connection uploads, in bytes per second.  zero means no limit */
+    void set_upload_rate_limit(uint64_t bytes_per_second);
+    /** a cap this connection shares with others, e.g., on everything the node uploads */
+    void set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit);
+    /** recent upload and download rates in bytes per second, overall and by message type */
+    fc::variant_object get_bandwidth_statistics() const;
+
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+    /** 
+     *  For testing over the loopback interface: holds each message back for `latency` after
+     *  it's queued, and treats `loss_rate` of our writes as lost packets that stall the 
+     *  connection for a retransmission timeout.  Which writes are lost is drawn from a
+     *  generator seeded with `loss_seed`, so a run can be repeated connection by connection.
+     */
+    void set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed);
+#endif // ENABLE_P2P_NETWORK_SIMULATION
   private:
     std::unique_ptr<detail::message_oriented_connection_impl> my;
   };
@@ -43,6 +43,24 @@ namespace bts { namespace net {
           */
          virtual void handle_message( const message& ) = 0;
 
+         /**
+          *  Called when a sync item arrives, possibly well before the items it depends on
+          *  have been passed to handle_message().  Lets the client start any validation
+          *  that doesn't depend on those items so it overlaps with processing them.
+          *  Must not change any state that handle_message() would have to undo.
+          */
+         virtual void prevalidate_message( const message& ) {}
+
+         /**
+          *  For each short id (the first 8 bytes of a transaction id), returns the transaction
+          *  we've accepted but not yet seen in a block whose id starts with it, if any.  Used to
+          *  rebuild blocks that peers send as a header plus short transaction ids.
+          */
+         virtual std::vector<bts::blockchain::osigned_transaction> get_unconfirmed_transactions( const std::vector<uint64_t>& short_transaction_ids )
+         {
+            return std::vector<bts::blockchain::osigned_transaction>( short_transaction_ids.size() );
+         }
+
          /**
           *  Assuming all data elements are ordered in some way, this method should
           *  return up to limit ids that occur *after* from_id.
@@ -123,6 +141,13 @@ namespace bts { namespace net {
 
         void      set_delegate( node_delegate* del );
 
+        /**
+         *  Stops accepting connections, disconnects from all peers and stops the
+         *  node's background tasks.  Call this, then set_delegate( nullptr ), before 
+         *  destroying the delegate.
+         */
+        void      close();
+
         void      load_configuration( const fc::path& configuration_directory );
 
         void      connect_to_p2p_network();
@@ -150,6 +175,13 @@ namespace bts { namespace net {
          */
         void      listen_on_port(uint16_t port);
 
+        /**
+         *  The endpoint we're accepting connections on, once connect_to_p2p_network() has
+         *  started listening.  If we were asked to listen on port 0, this has the port the
+         *  operating system chose.
+         */
+        fc::ip::endpoint get_actual_listening_endpoint() const;
+
         /**
          *  @return a list of peers that are currently connected.
          */
@@ -174,6 +206,14 @@ namespace bts { namespace net {
 
         void set_advanced_node_parameters(const fc::variant_object& params);
         fc::variant_object get_advanced_node_parameters();
+        /** size, evictions and misses of the cache of messages we're relaying to our peers */
+        fc::variant_object get_message_cache_statistics() const;
+        /**
+         *  Histograms, by message type, of how long items we relay spend waiting to be requested 
+         *  after they're first advertised to us, waiting for the peer to send them, and waiting 
+         *  for the client to validate them, plus how many items each peer was first to deliver.
+         */
+        fc::variant_object get_propagation_statistics() const;
         message_propagation_data get_transaction_propagation_data(const bts::blockchain::transaction_id_type& transaction_id);
         message_propagation_data get_block_propagation_data(const bts::blockchain::block_id_type& block_id);
         node_id_t get_node_id() const;
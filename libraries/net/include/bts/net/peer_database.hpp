@@ -26,14 +26,25 @@ namespace bts { namespace net {
     fc::time_point_sec                last_connection_attempt_time;
     uint32_t                          number_of_successful_connection_attempts;
     uint32_t                          number_of_failed_connection_attempts;
+    uint32_t                          average_item_latency_ms; /// how long this peer took to answer our requests, zero if we never measured it
+    uint32_t                          average_item_throughput; /// bytes per second this peer delivered answering our requests, zero if we never measured it
 
-    potential_peer_record() {}
+    potential_peer_record() :
+      number_of_successful_connection_attempts(0),
+      number_of_failed_connection_attempts(0),
+      average_item_latency_ms(0),
+      average_item_throughput(0)
+    {}
     potential_peer_record(fc::ip::endpoint endpoint,
                           fc::time_point_sec last_seen_time = fc::time_point_sec(),
                           potential_peer_last_connection_disposition last_connection_disposition = never_attempted_to_connect) :
       endpoint(endpoint),
       last_seen_time(last_seen_time),
-      last_connection_disposition(last_connection_disposition)
+      last_connection_disposition(last_connection_disposition),
+      number_of_successful_connection_attempts(0),
+      number_of_failed_connection_attempts(0),
+      average_item_latency_ms(0),
+      average_item_throughput(0)
     {}  
   };
 
@@ -85,4 +96,4 @@ namespace bts { namespace net {
 } } // end namespace bts::net
 
 FC_REFLECT_ENUM(bts::net::potential_peer_last_connection_disposition, (never_attempted_to_connect)(last_connection_failed)(last_connection_rejected)(last_connection_handshaking_failed)(last_connection_succeeded))
-FC_REFLECT(bts::net::potential_peer_record, (endpoint)(last_seen_time)(last_connection_disposition)(last_connection_attempt_time)(number_of_successful_connection_attempts)(number_of_failed_connection_attempts))
+FC_REFLECT(bts::net::potential_peer_record, (endpoint)(last_seen_time)(last_connection_disposition)(last_connection_attempt_time)(number_of_successful_connection_attempts)(number_of_failed_connection_attempts)(average_item_latency_ms)(average_item_throughput))
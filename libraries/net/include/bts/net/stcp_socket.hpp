@@ -1,4 +1,5 @@
 #pragma once
+#include <vector>
 #include <fc/network/tcp_socket.hpp>
 #include <fc/crypto/aes.hpp>
 #include <fc/crypto/elliptic.hpp>
@@ -33,8 +34,7 @@ class stcp_socket : public virtual fc::iostream
     void do_key_exchange();
 
     fc::ecc::private_key _priv_key;
-    fc::array<char,8>    _buf;
-    uint32_t             _buf_len;
+    std::vector<char>    _send_buffer; ///< holds the ciphertext for writesome()
     fc::tcp_socket       _sock;
     fc::aes_encoder      _send_aes;
     fc::aes_decoder      _recv_aes;
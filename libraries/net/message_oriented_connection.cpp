@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+
 #include <fc/thread/thread.hpp>
-#include <fc/thread/mutex.hpp>
-#include <fc/thread/scoped_lock.hpp>
 #include <fc/thread/future.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/io/enum_type.hpp>
@@ -12,6 +16,16 @@
 namespace bts { namespace net {
   namespace detail
   {
+    struct queued_message
+    {
+      message_ptr    message_to_send;
+      fc::time_point time_queued;
+      queued_message(const message_ptr& message_to_send) :
+        message_to_send(message_to_send),
+        time_queued(fc::time_point::now())
+      {}
+    };
+
     class message_oriented_connection_impl
     {
     private:
@@ -23,12 +37,50 @@ namespace bts { namespace net {
       uint64_t _bytes_sent;
       fc::time_point _last_message_received_time;
       fc::time_point _last_message_sent_time;
-      fc::mutex _send_mutex;
-
-
 
+      /** messages waiting for the writer task, which is the only thing that writes to _sock */
+      std::deque<queued_message> _send_queue;
+      std::deque<queued_message> _urgent_send_queue; /// sent before _send_queue, without waiting on the upload limits
+      size_t _send_queue_size_in_bytes;
+      size_t _ordinary_send_queue_size_in_bytes; /// the part of _send_queue_size_in_bytes that's in _send_queue
+      unsigned _urgent_batches_sent_in_a_row;
+      bool _ordinary_messages_held_by_upload_limits; /// the writer last found the ordinary queue waiting on the token buckets, not on the socket
+      std::vector<char> _send_buffer;
+      bool _closing;
+      fc::future<void> _send_queue_loop_done;
+      fc::promise<void>::ptr _send_queue_ready_promise;
+      fc::future<void> _close_deadline_done; /// closes the socket if close_connection() can't flush in time
+
+      /** decrypted bytes read from the socket, [_receive_begin, _receive_end) not yet consumed */
+      std::vector<char> _receive_buffer;
+      size_t _receive_begin;
+      size_t _receive_end;
+
+      token_bucket _upload_limit;
+      std::shared_ptr<token_bucket> _shared_upload_limit;
+      transfer_rate_meter _upload_meter;
+      transfer_rate_meter _download_meter;
+      std::map<uint32_t, transfer_rate_meter> _upload_meter_by_message_type;
+      std::map<uint32_t, transfer_rate_meter> _download_meter_by_message_type;
+
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      /** network conditions to simulate on this connection, see set_simulated_network_conditions() */
+      fc::microseconds _simulated_latency;
+      double _simulated_loss_rate;
+      std::minstd_rand _simulated_loss_generator; /// each connection has its own, a shared generator would be a data race between node threads
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
+      void fill_receive_buffer(size_t bytes_needed);
       void read_loop();
       void start_read_loop();
+      void send_queue_loop();
+      void trigger_send_queue_loop();
+      void clear_send_queues();
+      void enforce_send_queue_limit();
+      size_t get_self_throttled_bytes() const;
+      fc::microseconds get_upload_delay();
+      fc::time_point get_earliest_send_time(const queued_message& message_to_send) const;
+      void wait_for_send_queue_until(const fc::time_point& deadline);
     public:
       fc::tcp_socket& get_socket();
       void accept();
@@ -36,22 +88,75 @@ namespace bts { namespace net {
       void connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint);
 
       message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate = nullptr);
-      void send_message(const message& message_to_send);
+      ~message_oriented_connection_impl();
+      void send_message(const message_ptr& message_to_send);
+      void send_urgent_message(const message_ptr& message_to_send);
+      size_t get_send_queue_size() const;
+      bool is_closing() const { return _closing; }
       void close_connection();
       uint64_t get_total_bytes_sent() const;
       uint64_t get_total_bytes_received() const;
       fc::time_point get_last_message_sent_time() const;
       fc::time_point get_last_message_received_time() const;
+
+      void set_upload_rate_limit(uint64_t bytes_per_second);
+      void set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit);
+      fc::variant_object get_bandwidth_statistics() const;
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      void set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed);
+#endif // ENABLE_P2P_NETWORK_SIMULATION
     };
 
     message_oriented_connection_impl::message_oriented_connection_impl(message_oriented_connection* self, message_oriented_connection_delegate* delegate) : 
       _self(self),
       _delegate(delegate),
       _bytes_received(0),
-      _bytes_sent(0)
+      _bytes_sent(0),
+      _receive_buffer(MESSAGE_RECEIVE_BUFFER_SIZE),
+      _receive_begin(0),
+      _receive_end(0),
+      _send_queue_size_in_bytes(0),
+      _ordinary_send_queue_size_in_bytes(0),
+      _urgent_batches_sent_in_a_row(0),
+      _ordinary_messages_held_by_upload_limits(false),
+      _closing(false),
+      _upload_limit(DEFAULT_MAXIMUM_UPLOAD_RATE_PER_PEER)
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      ,_simulated_loss_rate(0)
+#endif // ENABLE_P2P_NETWORK_SIMULATION
     {
     }
 
+    message_oriented_connection_impl::~message_oriented_connection_impl()
+    {
+      if (_close_deadline_done.valid() && !_close_deadline_done.ready())
+      {
+        _close_deadline_done.cancel();
+        try
+        {
+          _close_deadline_done.wait();
+        }
+        catch (const fc::exception&)
+        {
+        }
+      }
+      if (_send_queue_loop_done.valid() && !_send_queue_loop_done.ready())
+      {
+        _closing = true;
+        clear_send_queues();
+        trigger_send_queue_loop();
+        try
+        {
+          _sock.close();
+          _send_queue_loop_done.wait();
+        }
+        catch (const fc::exception& e)
+        {
+          wlog("error shutting down send queue: ${e}", ("e", e.to_detail_string()));
+        }
+      }
+    }
+
     fc::tcp_socket& message_oriented_connection_impl::get_socket()
     {
       return _sock.get_socket();
@@ -61,50 +166,82 @@ namespace bts { namespace net {
     {
       _sock.accept();
       _read_loop_done = fc::async([=](){ read_loop(); });
+      _send_queue_loop_done = fc::async([=](){ send_queue_loop(); });
     }
 
     void message_oriented_connection_impl::connect_to(const fc::ip::endpoint& remote_endpoint)
     {
       _sock.connect_to(remote_endpoint);
       _read_loop_done = fc::async([=](){ read_loop(); });
+      _send_queue_loop_done = fc::async([=](){ send_queue_loop(); });
     }
 
     void message_oriented_connection_impl::connect_to(const fc::ip::endpoint& remote_endpoint, const fc::ip::endpoint& local_endpoint)
     {
       _sock.connect_to(remote_endpoint, local_endpoint);
       _read_loop_done = fc::async([=](){ read_loop(); });
+      _send_queue_loop_done = fc::async([=](){ send_queue_loop(); });
     }
 
 
+    /**
+     *  Makes sure at least bytes_needed unconsumed bytes are in _receive_buffer, reading
+     *  as much as the buffer will hold from the socket each time so that a burst of 
+     *  small messages costs a single read and a single decrypt.
+     */
+    void message_oriented_connection_impl::fill_receive_buffer(size_t bytes_needed)
+    {
+      assert(bytes_needed % 16 == 0);
+      if (_receive_end - _receive_begin >= bytes_needed)
+        return;
+
+      // move the partial message to the front so the rest of it is contiguous
+      if (_receive_begin + bytes_needed > _receive_buffer.size())
+      {
+        std::copy(_receive_buffer.begin() + _receive_begin, _receive_buffer.begin() + _receive_end, _receive_buffer.begin());
+        _receive_end -= _receive_begin;
+        _receive_begin = 0;
+        if (bytes_needed > _receive_buffer.size())
+          _receive_buffer.resize(bytes_needed);
+      }
+
+      while (_receive_end - _receive_begin < bytes_needed)
+      {
+        // stcp_socket only works in whole 16 byte blocks, all offsets here stay multiples of 16
+        size_t bytes_to_read = (_receive_buffer.size() - _receive_end) & ~size_t(15);
+        size_t bytes_read = _sock.readsome(&_receive_buffer[_receive_end], bytes_to_read);
+        _receive_end += bytes_read;
+        _bytes_received += bytes_read;
+        _download_meter.record(bytes_read);
+      }
+    }
+
     void message_oriented_connection_impl::read_loop()
     {
-      const int BUFFER_SIZE = 16;
-      const int LEFTOVER = BUFFER_SIZE - sizeof(message_header);
-      assert(BUFFER_SIZE >= sizeof(message_header));
+      const size_t BUFFER_SIZE = 16;
+      static_assert(BUFFER_SIZE >= sizeof(message_header), "header must fit in the first block");
 
       try 
       {
-        message m;
         while( true )
         {
-          char buffer[BUFFER_SIZE];
-          _sock.read(buffer, BUFFER_SIZE);
-          _bytes_received += BUFFER_SIZE;
-          memcpy((char*)&m, buffer, sizeof(message_header));
+          fill_receive_buffer(BUFFER_SIZE);
+          // each message gets its own buffer, the delegate may hold on to it (e.g., in the message cache)
+          std::shared_ptr<message> m = std::make_shared<message>();
+          memcpy((char*)static_cast<message_header*>(m.get()), &_receive_buffer[_receive_begin], sizeof(message_header));
 
-          assert( m.size <= MAX_MESSAGE_SIZE );
+          FC_ASSERT( m->size <= MAX_MESSAGE_SIZE, "message size ${size} exceeds the maximum", ("size", m->size) );
 
-          size_t remaining_bytes_with_padding = 16 * ((m.size - LEFTOVER + 15) / 16);
-          m.data.resize(LEFTOVER + remaining_bytes_with_padding); //give extra 16 bytes to allow for padding added in send call
-          std::copy(buffer + sizeof(message_header), buffer + sizeof(buffer), m.data.begin());
-          if (remaining_bytes_with_padding)
-          {
-            _sock.read(&m.data[LEFTOVER], remaining_bytes_with_padding);
-            _bytes_received += remaining_bytes_with_padding;
-          }
-          m.data.resize(m.size); // truncate off the padding bytes
+          size_t size_with_padding = 16 * ((sizeof(message_header) + m->size + 15) / 16);
+          fill_receive_buffer(size_with_padding);
+          const char* message_data = &_receive_buffer[_receive_begin + sizeof(message_header)];
+          m->data.assign(message_data, message_data + m->size); // drops the padding
+          _receive_begin += size_with_padding;
+          if (_receive_begin == _receive_end)
+            _receive_begin = _receive_end = 0;
 
           _last_message_received_time = fc::time_point::now();
+          _download_meter_by_message_type[m->msg_type].record(sizeof(message_header) + m->size, _last_message_received_time);
 
           try 
           {
@@ -145,27 +282,262 @@ namespace bts { namespace net {
       }
     }
 
-    void message_oriented_connection_impl::send_message(const message& message_to_send)
+    /**
+     *  Queues the message and returns without waiting for the socket, the writer task
+     *  sends it.  If the peer isn't reading what we send it and more than 
+     *  MAX_SEND_QUEUE_SIZE bytes pile up, the connection is closed.
+     */
+    void message_oriented_connection_impl::send_message(const message_ptr& message_to_send)
     {
-      try 
+      if (_closing)
+        return;
+      _send_queue.push_back(queued_message(message_to_send));
+      _send_queue_size_in_bytes += sizeof(message_header) + message_to_send->size;
+      _ordinary_send_queue_size_in_bytes += sizeof(message_header) + message_to_send->size;
+      enforce_send_queue_limit();
+      trigger_send_queue_loop();
+    }
+
+    void message_oriented_connection_impl::send_urgent_message(const message_ptr& message_to_send)
+    {
+      if (_closing)
+        return;
+      _urgent_send_queue.push_back(queued_message(message_to_send));
+      _send_queue_size_in_bytes += sizeof(message_header) + message_to_send->size;
+      enforce_send_queue_limit();
+      trigger_send_queue_loop();
+    }
+
+    /** the read loop notices the closed socket and reports the connection closed to the delegate */
+    void message_oriented_connection_impl::enforce_send_queue_limit()
+    {
+      if (_send_queue_size_in_bytes - get_self_throttled_bytes() <= MAX_SEND_QUEUE_SIZE)
+        return;
+      wlog("closing connection because it has ${size} bytes of unsent data queued", ("size", _send_queue_size_in_bytes));
+      _closing = true;
+      clear_send_queues();
+      try
+      {
+        _sock.close();
+      }
+      catch (const fc::exception&)
+      {
+      }
+    }
+
+    /**
+     *  The ordinary messages that are waiting on our own upload limits rather than on the peer, 
+     *  estimated as what the limits would let through in MAX_SELF_THROTTLED_SEND_SECONDS and 
+     *  never more than MAX_SEND_QUEUE_SIZE.  Nothing is exempt unless the writer is actually 
+     *  being held back by the limits; a peer that stops reading blocks the writer in the 
+     *  socket instead and gets no allowance.
+     */
+    size_t message_oriented_connection_impl::get_self_throttled_bytes() const
+    {
+      if (!_ordinary_messages_held_by_upload_limits)
+        return 0;
+      uint64_t upload_rate = _upload_limit.get_rate();
+      if (_shared_upload_limit && _shared_upload_limit->get_rate() &&
+          (!upload_rate || _shared_upload_limit->get_rate() < upload_rate))
+        upload_rate = _shared_upload_limit->get_rate();
+      if (!upload_rate)
+        return 0;
+      return (size_t)std::min<uint64_t>(std::min<uint64_t>(_ordinary_send_queue_size_in_bytes, upload_rate * MAX_SELF_THROTTLED_SEND_SECONDS), 
+                                        MAX_SEND_QUEUE_SIZE);
+    }
+
+    size_t message_oriented_connection_impl::get_send_queue_size() const
+    {
+      return _send_queue_size_in_bytes;
+    }
+
+    void message_oriented_connection_impl::trigger_send_queue_loop()
+    {
+      if (_send_queue_ready_promise)
+        _send_queue_ready_promise->set_value();
+    }
+
+    void message_oriented_connection_impl::clear_send_queues()
+    {
+      _send_queue.clear();
+      _urgent_send_queue.clear();
+      _send_queue_size_in_bytes = 0;
+      _ordinary_send_queue_size_in_bytes = 0;
+      _ordinary_messages_held_by_upload_limits = false;
+    }
+
+    /** how long ordinary messages have to wait for both our own and the shared upload limit */
+    fc::microseconds message_oriented_connection_impl::get_upload_delay()
+    {
+      fc::microseconds delay = _upload_limit.time_until_available();
+      if (_shared_upload_limit)
+        delay = std::max(delay, _shared_upload_limit->time_until_available());
+      return delay;
+    }
+
+    /** normally right away, later if we're simulating a slow network */
+    fc::time_point message_oriented_connection_impl::get_earliest_send_time(const queued_message& message_to_send) const
+    {
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      return message_to_send.time_queued + _simulated_latency;
+#else
+      return message_to_send.time_queued;
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+    }
+
+    /** sleeps until the deadline, or until a message is queued or the connection is closed */
+    void message_oriented_connection_impl::wait_for_send_queue_until(const fc::time_point& deadline)
+    {
+      _send_queue_ready_promise = fc::promise<void>::ptr(new fc::promise<void>());
+      try
+      {
+        _send_queue_ready_promise->wait_until(deadline);
+      }
+      catch (fc::timeout_exception&)
+      {
+      }
+      _send_queue_ready_promise.reset();
+    }
+
+    /**
+     *  Drains the send queues, packing as many messages as fit in MESSAGE_SEND_BATCH_SIZE
+     *  into a single padded write followed by one flush.  Urgent messages go out as soon 
+     *  as we can write; ordinary ones wait until the upload limits allow it (queueing an 
+     *  urgent message cuts that wait short).  Both count against the limits, so to keep 
+     *  a steady stream of urgent messages from starving the ordinary ones, every 
+     *  MAX_URGENT_BATCHES_BEFORE_ORDINARY urgent writes are followed by an ordinary one.
+     */
+    void message_oriented_connection_impl::send_queue_loop()
+    {
+      try
       {
-        size_t size_of_message_and_header = sizeof(message_header) + message_to_send.size;
-        //pad the message we send to a multiple of 16 bytes
-        size_t size_with_padding = 16 * ((size_of_message_and_header + 15) / 16);
-        std::unique_ptr<char[]> padded_message(new char[size_with_padding]);
-        memcpy(padded_message.get(), (char*)&message_to_send, sizeof(message_header));
-        memcpy(padded_message.get() + sizeof(message_header), message_to_send.data.data(), message_to_send.size );
-        fc::scoped_lock<fc::mutex> lock(_send_mutex);
-        _sock.write(padded_message.get(), size_with_padding);
-        _sock.flush();
-        _bytes_sent += size_with_padding;
-        _last_message_sent_time = fc::time_point::now();
-      } FC_RETHROW_EXCEPTIONS( warn, "unable to send message" );    
+        while (true)
+        {
+          if (_urgent_send_queue.empty() && _send_queue.empty())
+          {
+            if (_closing)
+              break;
+            _send_queue_ready_promise = fc::promise<void>::ptr(new fc::promise<void>());
+            _send_queue_ready_promise->wait();
+            _send_queue_ready_promise.reset();
+            continue;
+          }
+
+          std::deque<queued_message>* queue_to_send = &_urgent_send_queue;
+          if (_urgent_send_queue.empty())
+          {
+            fc::microseconds upload_delay = get_upload_delay();
+            if (upload_delay.count() > 0 && !_closing)
+            {
+              _ordinary_messages_held_by_upload_limits = true;
+              wait_for_send_queue_until(fc::time_point::now() + upload_delay);
+              continue;
+            }
+            queue_to_send = &_send_queue;
+          }
+          else if (!_send_queue.empty() && _urgent_batches_sent_in_a_row >= MAX_URGENT_BATCHES_BEFORE_ORDINARY)
+            queue_to_send = &_send_queue;
+
+          fc::time_point now = fc::time_point::now();
+          fc::time_point earliest_send_time = get_earliest_send_time(queue_to_send->front());
+          if (earliest_send_time > now && !_closing)
+          {
+            wait_for_send_queue_until(earliest_send_time);
+            continue;
+          }
+
+          _send_buffer.clear();
+          while (!queue_to_send->empty() && get_earliest_send_time(queue_to_send->front()) <= now)
+          {
+            const message& message_to_send = *queue_to_send->front().message_to_send;
+            size_t size_of_message_and_header = sizeof(message_header) + message_to_send.size;
+            //pad the message we send to a multiple of 16 bytes
+            size_t size_with_padding = 16 * ((size_of_message_and_header + 15) / 16);
+            if (!_send_buffer.empty() && _send_buffer.size() + size_with_padding > MESSAGE_SEND_BATCH_SIZE)
+              break;
+
+            size_t offset = _send_buffer.size();
+            _send_buffer.resize(offset + size_with_padding);
+            memcpy(&_send_buffer[offset], (char*)&message_to_send, sizeof(message_header));
+            memcpy(&_send_buffer[offset + sizeof(message_header)], message_to_send.data.data(), message_to_send.size);
+            _upload_meter_by_message_type[message_to_send.msg_type].record(size_of_message_and_header);
+            _send_queue_size_in_bytes -= size_of_message_and_header;
+            if (queue_to_send == &_send_queue)
+              _ordinary_send_queue_size_in_bytes -= size_of_message_and_header;
+            queue_to_send->pop_front();
+          }
+          if (queue_to_send == &_urgent_send_queue)
+            ++_urgent_batches_sent_in_a_row;
+          else
+          {
+            // from here on the ordinary messages wait on the socket (i.e., the peer) until this write finishes
+            _urgent_batches_sent_in_a_row = 0;
+            _ordinary_messages_held_by_upload_limits = false;
+          }
+
+          _upload_limit.consume(_send_buffer.size());
+          if (_shared_upload_limit)
+            _shared_upload_limit->consume(_send_buffer.size());
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+          // TCP hides a lost packet from us, all we'd see is everything behind it on the
+          // connection waiting for the retransmission
+          if (_simulated_loss_rate > 0 && std::uniform_real_distribution<double>(0, 1)(_simulated_loss_generator) < _simulated_loss_rate)
+            fc::usleep(fc::milliseconds(SIMULATED_RETRANSMISSION_TIMEOUT_MS) + fc::microseconds(_simulated_latency.count() * 2));
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+          _sock.write(_send_buffer.data(), _send_buffer.size());
+          _sock.flush();
+          _bytes_sent += _send_buffer.size();
+          _last_message_sent_time = fc::time_point::now();
+          _upload_meter.record(_send_buffer.size(), _last_message_sent_time);
+        }
+        // we were asked to close once everything queued had been sent
+        _sock.close();
+      }
+      catch (const fc::exception& e)
+      {
+        if (!_closing)
+          wlog("unable to send message, closing connection: ${e}", ("e", e.to_detail_string()));
+        clear_send_queues();
+        try
+        {
+          _sock.close(); // the read loop will notice and report the closed connection
+        }
+        catch (const fc::exception&)
+        {
+        }
+      }
     }
 
+    /**
+     *  Small amounts of queued data (e.g., a connection_rejected message) are sent before 
+     *  the socket is closed, anything larger is dropped so a slow peer can't delay the close.
+     *  A peer that isn't reading gets CLOSE_CONNECTION_FLUSH_TIMEOUT_SECONDS to take the 
+     *  rest before the socket is closed anyway.
+     */
     void message_oriented_connection_impl::close_connection()
     {
-      _sock.close();
+      if (_closing && _close_deadline_done.valid())
+        return;
+      _closing = true;
+      if (_send_queue_size_in_bytes > MESSAGE_SEND_BATCH_SIZE ||
+          !_send_queue_loop_done.valid() || _send_queue_loop_done.ready())
+      {
+        clear_send_queues();
+        _sock.close();
+      }
+      else
+      {
+        _close_deadline_done = fc::async([=](){
+          fc::usleep(fc::seconds(CLOSE_CONNECTION_FLUSH_TIMEOUT_SECONDS));
+          if (!_send_queue_loop_done.ready())
+          {
+            wlog("peer didn't accept our last messages in time, closing the connection without them");
+            clear_send_queues();
+            _sock.close();
+          }
+        });
+      }
+      trigger_send_queue_loop();
     }
 
     uint64_t message_oriented_connection_impl::get_total_bytes_sent() const
@@ -188,6 +560,49 @@ namespace bts { namespace net {
       return _last_message_received_time;
     }
 
+    void message_oriented_connection_impl::set_upload_rate_limit(uint64_t bytes_per_second)
+    {
+      _upload_limit.set_rate(bytes_per_second);
+      trigger_send_queue_loop(); // the new limit may let us send sooner
+    }
+
+    void message_oriented_connection_impl::set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit)
+    {
+      _shared_upload_limit = shared_upload_limit;
+      trigger_send_queue_loop();
+    }
+
+    static fc::variant_object get_rates_by_message_type(const std::map<uint32_t, transfer_rate_meter>& meters, fc::time_point now)
+    {
+      fc::mutable_variant_object result;
+      for (const auto& type_and_meter : meters)
+        result[std::to_string(type_and_meter.first)] = fc::mutable_variant_object("rate", type_and_meter.second.get_rate(now))
+                                                                                 ("total_bytes", type_and_meter.second.get_total_bytes());
+      return result;
+    }
+
+    fc::variant_object message_oriented_connection_impl::get_bandwidth_statistics() const
+    {
+      fc::time_point now = fc::time_point::now();
+      fc::mutable_variant_object result;
+      result["upload_rate"] = _upload_meter.get_rate(now);
+      result["download_rate"] = _download_meter.get_rate(now);
+      result["upload_rate_limit"] = _upload_limit.get_rate();
+      result["upload_by_message_type"] = get_rates_by_message_type(_upload_meter_by_message_type, now);
+      result["download_by_message_type"] = get_rates_by_message_type(_download_meter_by_message_type, now);
+      return result;
+    }
+
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+    void message_oriented_connection_impl::set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed)
+    {
+      _simulated_latency = latency;
+      _simulated_loss_rate = loss_rate;
+      _simulated_loss_generator.seed(loss_seed);
+      trigger_send_queue_loop();
+    }
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
   } // end namespace bts::net::detail
 
 
@@ -221,15 +636,35 @@ namespace bts { namespace net {
   }
   
   void message_oriented_connection::send_message(const message& message_to_send)
+  {
+    my->send_message(std::make_shared<const message>(message_to_send));
+  }
+
+  void message_oriented_connection::send_message(const message_ptr& message_to_send)
   {
     my->send_message(message_to_send);
   }
 
+  void message_oriented_connection::send_urgent_message(const message_ptr& message_to_send)
+  {
+    my->send_urgent_message(message_to_send);
+  }
+
   void message_oriented_connection::close_connection()
   {
     my->close_connection();
   }
 
+  size_t message_oriented_connection::get_send_queue_size() const
+  {
+    return my->get_send_queue_size();
+  }
+
+  bool message_oriented_connection::is_closing() const
+  {
+    return my->is_closing();
+  }
+
   uint64_t message_oriented_connection::get_total_bytes_sent() const
   {
     return my->get_total_bytes_sent();
@@ -250,4 +685,26 @@ namespace bts { namespace net {
     return my->get_last_message_received_time();
   }
 
+  void message_oriented_connection::set_upload_rate_limit(uint64_t bytes_per_second)
+  {
+    my->set_upload_rate_limit(bytes_per_second);
+  }
+
+  void message_oriented_connection::set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit)
+  {
+    my->set_shared_upload_rate_limit(shared_upload_limit);
+  }
+
+  fc::variant_object message_oriented_connection::get_bandwidth_statistics() const
+  {
+    return my->get_bandwidth_statistics();
+  }
+
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+  void message_oriented_connection::set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed)
+  {
+    my->set_simulated_network_conditions(latency, loss_rate, loss_seed);
+  }
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
 } } // end namespace bts::net
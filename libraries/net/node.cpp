@@ -3,7 +3,12 @@
 #include <deque>
 #include <unordered_set>
 #include <list>
+#include <algorithm>
+#include <limits>
+#include <array>
+#include <map>
 #include <iostream>
+#include <atomic>
 #include <boost/tuple/tuple.hpp>
 #include <boost/circular_buffer.hpp>
 
@@ -39,6 +44,83 @@ namespace bts { namespace net {
   {
     enum peer_connection_direction { unknown, inbound, outbound };
 
+    /**
+     *  A set of item ids that forgets items once they're older than max_age, and forgets the
+     *  oldest items once it holds max_size of them.  Used to remember what inventory we've 
+     *  exchanged with a peer without growing for the life of the connection.
+     */
+    class timestamped_item_set
+    {
+    private:
+      struct item_index{};
+      struct timestamp_index{};
+      struct timestamped_item
+      {
+        item_id        item;
+        fc::time_point timestamp;
+        timestamped_item(const item_id& item, fc::time_point timestamp) :
+          item(item),
+          timestamp(timestamp)
+        {}
+      };
+      // items are only added with the current time, so insertion order is timestamp order
+      typedef boost::multi_index_container<timestamped_item,
+                                           boost::multi_index::indexed_by<boost::multi_index::hashed_unique<boost::multi_index::tag<item_index>,
+                                                                                                            boost::multi_index::member<timestamped_item, item_id, &timestamped_item::item>,
+                                                                                                            std::hash<item_id> >,
+                                                                          boost::multi_index::sequenced<boost::multi_index::tag<timestamp_index> > > > item_container;
+      item_container   _items;
+      size_t           _max_size;
+      fc::microseconds _max_age;
+    public:
+      timestamped_item_set(size_t max_size, fc::microseconds max_age) :
+        _max_size(max_size),
+        _max_age(max_age)
+      {}
+
+      bool contains(const item_id& item) const
+      {
+        auto iter = _items.get<item_index>().find(item);
+        return iter != _items.get<item_index>().end() && iter->timestamp >= fc::time_point::now() - _max_age;
+      }
+      void insert(const item_id& item)
+      {
+        expire_old_items();
+        auto iter = _items.get<item_index>().find(item);
+        if (iter != _items.get<item_index>().end())
+          _items.get<item_index>().erase(iter); // re-add it at the end with the current time
+        else if (_items.size() >= _max_size)
+          _items.get<timestamp_index>().pop_front();
+        _items.get<timestamp_index>().push_back(timestamped_item(item, fc::time_point::now()));
+      }
+      void erase(const item_id& item)
+      {
+        _items.get<item_index>().erase(item);
+      }
+      void expire_old_items()
+      {
+        fc::time_point expiration_threshold = fc::time_point::now() - _max_age;
+        auto& items_by_timestamp = _items.get<timestamp_index>();
+        while (!items_by_timestamp.empty() && items_by_timestamp.front().timestamp < expiration_threshold)
+          items_by_timestamp.pop_front();
+      }
+      size_t size() const { return _items.size(); }
+      /** rough number of bytes used, counting the hash bucket and list pointers for each item */
+      size_t get_memory_usage() const
+      {
+        return _items.size() * (sizeof(timestamped_item) + 4 * sizeof(void*)) + _items.get<item_index>().bucket_count() * sizeof(void*);
+      }
+    };
+
+    /** a compact block we're filling in with transactions before handing it to the client */
+    struct partially_reconstructed_block
+    {
+      bts::client::compact_block_message                               compact_block;
+      std::vector<fc::optional<bts::blockchain::signed_transaction> > transactions;
+      bool                                                             all_transactions_requested;
+      fc::time_point                                                   last_request_time; /// when we last asked the peer for missing transactions
+    };
+
     class peer_connection : public message_oriented_connection_delegate,
                             public std::enable_shared_from_this<peer_connection>
     {
@@ -75,6 +157,15 @@ namespace bts { namespace net {
       fc::optional<fc::time_point_sec> fc_git_revision_unix_timestamp;
       fc::optional<std::string> platform;
       fc::ip::endpoint inbound_endpoint;
+      bool             peer_supports_compression; /// peer can decompress compressed_messages, from its user_agent
+      bool             peer_supports_compact_blocks; /// peer can rebuild blocks from compact_block_messages, from its user_agent
+      bool             peer_supports_batched_fetch; /// peer understands fetch_items_message, from its user_agent
+      /// @}
+
+      /// bytes we didn't have to send or receive because the message was compressed
+      /// @{
+      uint64_t         bytes_saved_by_compression_sending;
+      uint64_t         bytes_saved_by_compression_receiving;
       /// @}
 
       typedef std::unordered_map<item_id, fc::time_point> item_to_time_map_type;
@@ -87,14 +178,28 @@ namespace bts { namespace net {
       bool we_need_sync_items_from_peer;
       fc::optional<boost::tuple<item_id, fc::time_point> > item_ids_requested_from_peer; /// we check this to detect a timed-out request and in busy()
       item_to_time_map_type sync_items_requested_from_peer; /// ids of blocks we've requested from this peer during sync.  fetch from another peer if this peer disconnects
+      item_to_time_map_type sync_items_timed_out_from_peer; /// sync requests we gave up on and sent to another peer.  they don't count against this peer's window, but a late reply is still accepted
+      /// @}
+
+      /// how quickly this peer answers our requests, seeded from the peer database when we connect
+      /// and saved back to it when we disconnect.  zero until we've measured it
+      /// @{
+      fc::microseconds average_item_latency; /// moving average of the time this peer takes to answer a request
+      uint64_t         average_item_throughput; /// moving average of the bytes per second this peer delivers answering a request
       /// @}
 
+      uint64_t         number_of_first_deliveries; /// how many items this peer was first to deliver to us, see get_propagation_statistics()
+
       /// non-synchronization state data
       /// @{
-      std::unordered_set<item_id> inventory_peer_advertised_to_us;
-      std::unordered_set<item_id> inventory_advertised_to_peer; /// TODO: make this a map to the time/block# we advertised it so we can expire items off of the list
+      timestamped_item_set inventory_peer_advertised_to_us;
+      timestamped_item_set inventory_advertised_to_peer;
 
+      std::deque<item_id> items_to_fetch_from_peer; /// items this peer advertised that we want, oldest first.  may hold items we've since requested elsewhere, those are skipped.  at most MAX_INVENTORY_ITEMS_TRACKED_PER_PEER long
       item_to_time_map_type items_requested_from_peer;  /// items we've requested from this peer during normal operation.  fetch from another peer if this peer disconnects
+      timestamped_item_set items_timed_out_from_peer; /// requests we gave up on and sent to another peer, if the reply shows up late we still accept it
+      std::unordered_map<item_hash_t, partially_reconstructed_block> compact_blocks_being_reconstructed; /// compact blocks this peer sent us, waiting on transactions we've asked it for
+      timestamped_item_set compact_blocks_sent_to_peer; /// if the peer asks for one of these again, it couldn't rebuild it and gets the full block
       /// @}
     public:
       peer_connection(node_impl& n) : 
@@ -102,9 +207,20 @@ namespace bts { namespace net {
         _message_connection(this),
         direction(unknown),
         state(disconnected),
+        peer_supports_compression(false),
+        peer_supports_compact_blocks(false),
+        peer_supports_batched_fetch(false),
+        bytes_saved_by_compression_sending(0),
+        bytes_saved_by_compression_receiving(0),
         number_of_unfetched_item_ids(0),
         peer_needs_sync_items_from_us(true),
-        we_need_sync_items_from_peer(true)
+        we_need_sync_items_from_peer(true),
+        average_item_throughput(0),
+        number_of_first_deliveries(0),
+        inventory_peer_advertised_to_us(MAX_INVENTORY_ITEMS_TRACKED_PER_PEER, fc::seconds(INVENTORY_TRACKING_EXPIRATION)),
+        inventory_advertised_to_peer(MAX_INVENTORY_ITEMS_TRACKED_PER_PEER, fc::seconds(INVENTORY_TRACKING_EXPIRATION)),
+        items_timed_out_from_peer(MAX_INVENTORY_ITEMS_TRACKED_PER_PEER, fc::seconds(INVENTORY_TRACKING_EXPIRATION)),
+        compact_blocks_sent_to_peer(MAX_INVENTORY_ITEMS_TRACKED_PER_PEER, fc::seconds(INVENTORY_TRACKING_EXPIRATION))
       {}
       ~peer_connection() {}
 
@@ -112,25 +228,41 @@ namespace bts { namespace net {
       void accept_connection();
       void connect_to(const fc::ip::endpoint& remote_endpoint, fc::optional<fc::ip::endpoint> local_endpoint = fc::optional<fc::ip::endpoint>());
 
-      void on_message(message_oriented_connection* originating_connection, const message& received_message) override;
+      void on_message(message_oriented_connection* originating_connection, const message_ptr& received_message) override;
       void on_connection_closed(message_oriented_connection* originating_connection) override;
 
       void send_message(const message& message_to_send);
+      void send_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send = message_ptr());
+      /** for items we're relaying; sent ahead of other messages and not held back by the upload rate limits */
+      void send_urgent_message(const message& message_to_send);
+      void send_urgent_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send = message_ptr());
       void close_connection();
 
       uint64_t get_total_bytes_sent() const;
       uint64_t get_total_bytes_received() const;
+      size_t get_send_queue_size() const;
+      bool is_closing() const;
 
       fc::time_point get_last_message_sent_time() const;
       fc::time_point get_last_message_received_time() const;
 
+      void set_upload_rate_limit(uint64_t bytes_per_second);
+      void set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit);
+      fc::variant_object get_bandwidth_statistics() const;
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      void set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed);
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
       fc::optional<fc::ip::endpoint> get_remote_endpoint();
       fc::ip::endpoint get_local_endpoint();
       void set_remote_endpoint(fc::optional<fc::ip::endpoint> new_remote_endpoint);
 
       bool busy();
       bool idle();
+
+      void record_item_received(fc::microseconds latency, size_t size_in_bytes);
     private:
+      void queue_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send, bool urgent);
       void accept_connection_task();
       void connect_to_task(const fc::ip::endpoint& remote_endpoint);
     };
@@ -166,10 +298,13 @@ namespace bts { namespace net {
       struct message_hash_index{};
       struct message_contents_hash_index{};
       struct block_clock_index{};
+      struct usage_order_index{};
       struct message_info
       {
         message_hash_type message_hash;
-        message           message_body;
+        message_ptr       message_body;
+        message_ptr       compressed_message_body; // null if the message is too small to be worth compressing
+        message_ptr       compact_message_body; // for blocks with transactions, the compact_block_message peers can rebuild it from
         uint32_t          block_clock_when_received;
 
         // for network performance stats
@@ -177,16 +312,30 @@ namespace bts { namespace net {
         fc::uint160_t     message_contents_hash; // hash of whatever the message contains (if it's a transaction, this is the transaction id, if it's a block, it's the block_id)
 
         message_info(const message_hash_type& message_hash,
-                     const message&           message_body,
+                     const message_ptr&       message_body,
+                     const message_ptr&       compressed_message_body,
+                     const message_ptr&       compact_message_body,
                      uint32_t                 block_clock_when_received,
                      const message_propagation_data& propagation_data,
                      fc::uint160_t            message_contents_hash) :
           message_hash(message_hash),
           message_body(message_body),
+          compressed_message_body(compressed_message_body),
+          compact_message_body(compact_message_body),
           block_clock_when_received(block_clock_when_received),
           propagation_data(propagation_data),
           message_contents_hash(message_contents_hash)
         {}
+
+        size_t size_in_bytes() const
+        {
+          size_t size = sizeof(message_header) + message_body->size;
+          if (compressed_message_body)
+            size += sizeof(message_header) + compressed_message_body->size;
+          if (compact_message_body)
+            size += sizeof(message_header) + compact_message_body->size;
+          return size;
+        }
       };
       typedef boost::multi_index_container<message_info, 
                                           boost::multi_index::indexed_by<boost::multi_index::ordered_unique<boost::multi_index::tag<message_hash_index>, 
@@ -194,42 +343,136 @@ namespace bts { namespace net {
                                                                          boost::multi_index::ordered_non_unique<boost::multi_index::tag<message_contents_hash_index>, 
                                                                                                                 boost::multi_index::member<message_info, fc::uint160_t, &message_info::message_contents_hash> >,
                                                                          boost::multi_index::ordered_non_unique<boost::multi_index::tag<block_clock_index>, 
-                                                                                                                boost::multi_index::member<message_info, uint32_t, &message_info::block_clock_when_received> > > > message_cache_container;
+                                                                                                                boost::multi_index::member<message_info, uint32_t, &message_info::block_clock_when_received> >,
+                                                                         boost::multi_index::sequenced<boost::multi_index::tag<usage_order_index> > > > message_cache_container;
       message_cache_container _message_cache;
 
       uint32_t block_clock;
+
+      size_t   _size_in_bytes;
+      size_t   _max_size_in_bytes;
+      uint64_t _total_evictions; // messages dropped to stay under _max_size_in_bytes
+      uint64_t _total_misses;
+
+      void evict_least_recently_used();
     public:
       blockchain_tied_message_cache() :
-        block_clock(0)
+        block_clock(0),
+        _size_in_bytes(0),
+        _max_size_in_bytes(MAX_MESSAGE_CACHE_SIZE_IN_BYTES),
+        _total_evictions(0),
+        _total_misses(0)
       {}
       void block_accepted();
-      void cache_message(const message& message_to_cache, const message_hash_type& hash_of_message_to_cache, 
+      void cache_message(const message_ptr& message_to_cache, const message_hash_type& hash_of_message_to_cache, 
                          const message_propagation_data& propagation_data, const fc::uint160_t& message_content_hash);
-      message get_message(const message_hash_type& hash_of_message_to_lookup);
+      message_ptr get_message(const message_hash_type& hash_of_message_to_lookup);
+      /** the compressed form of a cached message, or a null pointer if it doesn't have one */
+      message_ptr get_compressed_message(const message_hash_type& hash_of_message_to_lookup);
+      /** the compact_block_message for a cached block, or a null pointer if it isn't a block with transactions */
+      message_ptr get_compact_message(const message_hash_type& hash_of_message_to_lookup);
       message_propagation_data get_message_propagation_data(const fc::uint160_t& hash_of_message_contents_to_lookup) const;
       size_t size() const { return _message_cache.size(); }
+
+      void set_max_size_in_bytes(size_t max_size_in_bytes);
+      size_t get_max_size_in_bytes() const { return _max_size_in_bytes; }
+      size_t get_size_in_bytes() const { return _size_in_bytes; }
+      uint64_t get_total_evictions() const { return _total_evictions; }
+      uint64_t get_total_misses() const { return _total_misses; }
     };
 
     void blockchain_tied_message_cache::block_accepted()
     {
       ++block_clock;
       if (block_clock > cache_duration_in_blocks)
-        _message_cache.get<block_clock_index>().erase(_message_cache.get<block_clock_index>().begin(), 
-                                                      _message_cache.get<block_clock_index>().lower_bound(block_clock - cache_duration_in_blocks));
+      {
+        auto& block_clock_idx = _message_cache.get<block_clock_index>();
+        auto end_of_expired_messages = block_clock_idx.lower_bound(block_clock - cache_duration_in_blocks);
+        for (auto iter = block_clock_idx.begin(); iter != end_of_expired_messages; ++iter)
+          _size_in_bytes -= iter->size_in_bytes();
+        block_clock_idx.erase(block_clock_idx.begin(), end_of_expired_messages);
+      }
+    }
+
+    /**
+     *  Drops the least recently used messages until the cache fits in its budget.  The most
+     *  recently used message is always kept, even if it's bigger than the budget by itself.
+     */
+    void blockchain_tied_message_cache::evict_least_recently_used()
+    {
+      auto& usage_idx = _message_cache.get<usage_order_index>();
+      while (_size_in_bytes > _max_size_in_bytes && usage_idx.size() > 1)
+      {
+        _size_in_bytes -= usage_idx.front().size_in_bytes();
+        usage_idx.pop_front();
+        ++_total_evictions;
+      }
+    }
+
+    void blockchain_tied_message_cache::set_max_size_in_bytes(size_t max_size_in_bytes)
+    {
+      _max_size_in_bytes = max_size_in_bytes;
+      evict_least_recently_used();
     }
 
-    void blockchain_tied_message_cache::cache_message(const message& message_to_cache, const message_hash_type& hash_of_message_to_cache, const message_propagation_data& propagation_data, const fc::uint160_t& message_content_hash)
+    /**
+     *  Cached messages are the ones we're relaying, so most peers will ask for them.  They're 
+     *  compressed, and blocks turned into compact blocks, once here instead of once per peer 
+     *  that requests them.
+     */
+    void blockchain_tied_message_cache::cache_message(const message_ptr& message_to_cache, const message_hash_type& hash_of_message_to_cache, const message_propagation_data& propagation_data, const fc::uint160_t& message_content_hash)
     {
-      _message_cache.insert(message_info(hash_of_message_to_cache, message_to_cache, block_clock, propagation_data, message_content_hash));
+      message_ptr compressed_message_to_cache;
+      if (message_to_cache->size >= MESSAGE_COMPRESSION_THRESHOLD)
+      {
+        fc::optional<message> compressed = compress_message(*message_to_cache);
+        if (compressed)
+          compressed_message_to_cache = std::make_shared<message>(std::move(*compressed));
+      }
+      message_ptr compact_message_to_cache;
+      if (message_to_cache->msg_type == bts::client::block_message_type)
+      {
+        bts::client::block_message block_message_to_cache = message_to_cache->as<bts::client::block_message>();
+        if (!block_message_to_cache.block.user_transactions.empty())
+          compact_message_to_cache = std::make_shared<message>(bts::client::compact_block_message(hash_of_message_to_cache, block_message_to_cache));
+      }
+      auto insert_result = _message_cache.insert(message_info(hash_of_message_to_cache, message_to_cache, compressed_message_to_cache, compact_message_to_cache, 
+                                                              block_clock, propagation_data, message_content_hash));
+      if (insert_result.second)
+      {
+        _size_in_bytes += insert_result.first->size_in_bytes();
+        evict_least_recently_used();
+      }
     }
 
-    message blockchain_tied_message_cache::get_message(const message_hash_type& hash_of_message_to_lookup)
+    message_ptr blockchain_tied_message_cache::get_message(const message_hash_type& hash_of_message_to_lookup)
     {
       message_cache_container::index<message_hash_index>::type::const_iterator iter = _message_cache.get<message_hash_index>().find(hash_of_message_to_lookup);
       if (iter != _message_cache.get<message_hash_index>().end())
+      {
+        auto& usage_idx = _message_cache.get<usage_order_index>();
+        usage_idx.relocate(usage_idx.end(), _message_cache.project<usage_order_index>(iter));
         return iter->message_body;
+      }
+      ++_total_misses;
       FC_THROW_EXCEPTION(key_not_found_exception, "Requested message not in cache");
     }
+
+    message_ptr blockchain_tied_message_cache::get_compressed_message(const message_hash_type& hash_of_message_to_lookup)
+    {
+      message_cache_container::index<message_hash_index>::type::const_iterator iter = _message_cache.get<message_hash_index>().find(hash_of_message_to_lookup);
+      if (iter != _message_cache.get<message_hash_index>().end())
+        return iter->compressed_message_body;
+      return message_ptr();
+    }
+
+    message_ptr blockchain_tied_message_cache::get_compact_message(const message_hash_type& hash_of_message_to_lookup)
+    {
+      message_cache_container::index<message_hash_index>::type::const_iterator iter = _message_cache.get<message_hash_index>().find(hash_of_message_to_lookup);
+      if (iter != _message_cache.get<message_hash_index>().end())
+        return iter->compact_message_body;
+      return message_ptr();
+    }
     message_propagation_data blockchain_tied_message_cache::get_message_propagation_data(const fc::uint160_t& hash_of_message_contents_to_lookup) const
     {
       if (hash_of_message_contents_to_lookup != fc::uint160_t())
@@ -241,13 +484,197 @@ namespace bts { namespace net {
       FC_THROW_EXCEPTION(key_not_found_exception, "Requested message not in cache");
     }
 
+    /**
+     *  Counts durations in power-of-two millisecond buckets (under 1ms, under 2ms, under 4ms, ...),
+     *  enough to see where the time goes without keeping every sample.  The last bucket also
+     *  counts anything longer.
+     */
+    class latency_histogram
+    {
+    public:
+      latency_histogram() :
+        _sample_count(0),
+        _total_microseconds(0),
+        _max_microseconds(0)
+      {
+        _bucket_counts.fill(0);
+      }
+
+      void record(fc::microseconds duration);
+      fc::variant_object get_statistics() const;
+
+    private:
+      static const size_t number_of_buckets = 24;
+      std::array<uint64_t, number_of_buckets> _bucket_counts;
+      uint64_t _sample_count;
+      uint64_t _total_microseconds;
+      int64_t  _max_microseconds;
+
+      static uint64_t get_bucket_upper_bound_ms(size_t bucket) { return uint64_t(1) << bucket; }
+      uint64_t get_percentile_ms(double percentile) const;
+    };
+
+    void latency_histogram::record(fc::microseconds duration)
+    {
+      int64_t microseconds = std::max<int64_t>(duration.count(), 0);
+      size_t bucket = 0;
+      while (bucket < number_of_buckets - 1 && (uint64_t)microseconds >= get_bucket_upper_bound_ms(bucket) * 1000)
+        ++bucket;
+      ++_bucket_counts[bucket];
+      ++_sample_count;
+      _total_microseconds += microseconds;
+      _max_microseconds = std::max(_max_microseconds, microseconds);
+    }
+
+    /** the upper bound of the bucket holding the given percentile, so it errs on the high side */
+    uint64_t latency_histogram::get_percentile_ms(double percentile) const
+    {
+      uint64_t samples_needed = (uint64_t)(_sample_count * percentile / 100);
+      uint64_t samples_seen = 0;
+      for (size_t bucket = 0; bucket < number_of_buckets; ++bucket)
+      {
+        samples_seen += _bucket_counts[bucket];
+        if (samples_seen > samples_needed)
+          return std::min<uint64_t>(get_bucket_upper_bound_ms(bucket), _max_microseconds / 1000 + 1);
+      }
+      return _max_microseconds / 1000 + 1;
+    }
+
+    fc::variant_object latency_histogram::get_statistics() const
+    {
+      fc::mutable_variant_object result;
+      result["count"] = _sample_count;
+      result["mean_ms"] = _sample_count ? _total_microseconds / _sample_count / 1000 : 0;
+      result["max_ms"] = _max_microseconds / 1000;
+      result["p50_ms"] = get_percentile_ms(50);
+      result["p90_ms"] = get_percentile_ms(90);
+      result["p99_ms"] = get_percentile_ms(99);
+      fc::variants buckets;
+      for (size_t bucket = 0; bucket < number_of_buckets; ++bucket)
+        if (_bucket_counts[bucket])
+          buckets.push_back(fc::mutable_variant_object("under_ms", get_bucket_upper_bound_ms(bucket))("count", _bucket_counts[bucket]));
+      result["buckets"] = buckets;
+      return result;
+    }
+
+    /** a block received during sync that we can't process until the blocks before it arrive */
+    struct received_sync_item
+    {
+      message_ptr                    block_message; // still packed, only the client unpacks the block
+      bts::blockchain::block_id_type block_id;
+      bts::blockchain::block_id_type previous_block_id;
+      size_t                         size_in_bytes;
+
+      received_sync_item(const message_ptr& block_message, const bts::client::block_message_header& block_header) :
+        block_message(block_message),
+        block_id(block_header.block_id),
+        previous_block_id(block_header.previous),
+        size_in_bytes(block_message->size)
+      {}
+    };
+    struct received_sync_item_block_id_index{};
+    struct received_sync_item_previous_id_index{};
+    typedef boost::multi_index_container<received_sync_item,
+                                         boost::multi_index::indexed_by<boost::multi_index::hashed_unique<boost::multi_index::tag<received_sync_item_block_id_index>,
+                                                                                                          boost::multi_index::member<received_sync_item, bts::blockchain::block_id_type, &received_sync_item::block_id>,
+                                                                                                          std::hash<bts::blockchain::block_id_type> >,
+                                                                        boost::multi_index::hashed_non_unique<boost::multi_index::tag<received_sync_item_previous_id_index>,
+                                                                                                              boost::multi_index::member<received_sync_item, bts::blockchain::block_id_type, &received_sync_item::previous_block_id>,
+                                                                                                              std::hash<bts::blockchain::block_id_type> > > > received_sync_items_container;
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+    /**
+     *  The node runs on its own thread so that a slow call into the client (e.g., applying 
+     *  a block) doesn't stall reading from and writing to our peers.  This forwards the 
+     *  node_delegate calls to the thread the delegate was installed from, which owns the 
+     *  blockchain.  The fiber making the call waits for the result, while the other fibers
+     *  on the p2p thread keep running.  Each peer's read loop waits on at most one call at 
+     *  a time, so the work queued for the client is bounded by the number of connections.
+     *
+     *  Once detach() is called, calls that haven't reached the delegate yet throw instead,
+     *  so the delegate can be destroyed while fibers are still waiting on it.
+     */
+    class threaded_node_delegate_wrapper : public node_delegate, 
+                                           public std::enable_shared_from_this<threaded_node_delegate_wrapper>
+    {
+    private:
+      std::atomic<node_delegate*> _node_delegate;
+      fc::thread*                 _delegate_thread;
+
+      template <typename Functor>
+      auto invoke(Functor f) const -> decltype(f(nullptr))
+      {
+        // keep this wrapper alive until the call returns, even if the node replaces it meanwhile
+        std::shared_ptr<const threaded_node_delegate_wrapper> self = shared_from_this();
+        auto call_delegate = [&]() -> decltype(f(nullptr)) {
+          node_delegate* delegate = _node_delegate.load();
+          if (!delegate)
+            FC_THROW_EXCEPTION(fc::canceled_exception, "the node's delegate has been removed");
+          return f(delegate);
+        };
+        if (&fc::thread::current() == _delegate_thread)
+          return call_delegate();
+        return _delegate_thread->async(call_delegate).wait();
+      }
+    public:
+      threaded_node_delegate_wrapper(node_delegate* node_delegate, fc::thread* delegate_thread) :
+        _node_delegate(node_delegate),
+        _delegate_thread(delegate_thread)
+      {}
+
+      void detach()
+      {
+        _node_delegate.store(nullptr);
+      }
+
+      bool has_item(const net::item_id& id) override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->has_item(id); });
+      }
+      void handle_message(const message& message_to_handle) override
+      {
+        invoke([&](node_delegate* delegate){ delegate->handle_message(message_to_handle); });
+      }
+      void prevalidate_message(const message& message_to_prevalidate) override
+      {
+        invoke([&](node_delegate* delegate){ delegate->prevalidate_message(message_to_prevalidate); });
+      }
+      std::vector<bts::blockchain::osigned_transaction> get_unconfirmed_transactions(const std::vector<uint64_t>& short_transaction_ids) override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->get_unconfirmed_transactions(short_transaction_ids); });
+      }
+      std::vector<item_hash_t> get_item_ids(const item_id& from_id, uint32_t& remaining_item_count, uint32_t limit) override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->get_item_ids(from_id, remaining_item_count, limit); });
+      }
+      message get_item(const item_id& id) override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->get_item(id); });
+      }
+      fc::sha256 get_chain_id() const override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->get_chain_id(); });
+      }
+      std::vector<item_hash_t> get_blockchain_synopsis() override
+      {
+        return invoke([&](node_delegate* delegate){ return delegate->get_blockchain_synopsis(); });
+      }
+      void sync_status(uint32_t item_type, uint32_t item_count) override
+      {
+        invoke([&](node_delegate* delegate){ delegate->sync_status(item_type, item_count); });
+      }
+      void connection_count_changed(uint32_t c) override
+      {
+        invoke([&](node_delegate* delegate){ delegate->connection_count_changed(c); });
+      }
+    };
 
     class node_impl
     {
     public:
-      node_delegate*       _delegate;
+      std::shared_ptr<fc::thread> _thread; /// everything in node_impl runs on this thread, see node's public methods
+      std::shared_ptr<threaded_node_delegate_wrapper> _delegate;
       fc::sha256           _chain_id;
 
 #define NODE_CONFIGURATION_FILENAME      "node_config.json"
@@ -271,7 +698,10 @@ namespace bts { namespace net {
       fc::future<void>       _fetch_sync_items_loop_done;
       typedef std::unordered_map<bts::blockchain::block_id_type, fc::time_point> active_sync_requests_map;
       active_sync_requests_map              _active_sync_requests; /// list of sync blocks we've asked for from peers but have not yet received
-      std::list<bts::client::block_message> _received_sync_items; /// list of sync blocks we've received, but can't yet process because we are still missing blocks that come earlier in the chain
+      std::unordered_set<item_hash_t> _sync_items_outstanding; /// sync blocks we've requested from any peer and haven't received yet, including requests that timed out
+      received_sync_items_container _received_sync_items; /// sync blocks we've received, but can't yet process because we are still missing blocks that come earlier in the chain
+      size_t                        _received_sync_items_size_in_bytes; /// total size of the blocks in _received_sync_items
+      size_t                        _average_sync_block_size; /// moving average of the size of the sync blocks we receive, used to estimate the size of the ones still in flight
       // @}
 
       /// used by the task that fetches items during normal operation
@@ -284,7 +714,16 @@ namespace bts { namespace net {
                                            boost::multi_index::indexed_by<boost::multi_index::sequenced<>,
                                                                           boost::multi_index::hashed_unique<boost::multi_index::identity<item_id>, std::hash<item_id> > >
                                            > items_to_fetch_set_type;
-      items_to_fetch_set_type _items_to_fetch; /// list of items we know another peer has and we want
+      items_to_fetch_set_type _items_to_fetch; /// items we know another peer has and we want, but haven't requested yet.  each peer's items_to_fetch_from_peer says which peers have them
+      std::unordered_map<item_id, fc::time_point> _first_advertised_times; /// when each item in _items_to_fetch was first advertised to us
+      // @}
+
+      /// where the time goes between an item being advertised to us and us relaying it, by message type.
+      /// see get_propagation_statistics()
+      // @{
+      std::map<uint32_t, latency_histogram> _advertise_to_request_latency; /// waiting for an idle peer to request it from
+      std::map<uint32_t, latency_histogram> _request_to_receive_latency;   /// waiting for the peer to send it
+      std::map<uint32_t, latency_histogram> _receive_to_validate_latency;  /// waiting for the client to accept it
       // @}
 
       /// used by the task that advertises inventory during normal operation
@@ -307,9 +746,17 @@ namespace bts { namespace net {
       uint32_t              _peer_connection_retry_timeout;
       /** how many seconds of inactivity are permitted before disconnecting a peer */
       uint32_t              _peer_inactivity_timeout;
+      /** the most sync blocks we'll have requested from the fastest peer at any one time, slower peers get proportionally fewer */
+      uint32_t              _maximum_sync_items_in_flight_per_peer;
+      /** sync requests that go unanswered this long (in seconds) are sent to another peer */
+      uint32_t              _sync_item_request_timeout;
+      /** caps on our upload rate, in bytes per second (zero for no limit).  items we're relaying aren't held back by them */
+      std::shared_ptr<token_bucket> _total_upload_limit;
+      uint64_t              _maximum_upload_rate_per_peer;
 
       fc::tcp_server       _tcp_server;
       fc::future<void>     _accept_loop_complete;
+      fc::ip::endpoint     _actual_listening_endpoint; /// the configured listen_endpoint, with the port we actually got if it was 0
 
       /** Stores all connections which have not yet finished key exchange or are still sending initial handshaking messages
        * back and forth (not yet ready to initiate syncing) */
@@ -327,6 +774,13 @@ namespace bts { namespace net {
 #ifdef ENABLE_P2P_DEBUGGING_API
       std::set<node_id_t> _allowed_peers;
 #endif // ENABLE_P2P_DEBUGGING_API
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      /** network conditions to simulate on all of our connections (for testing many nodes on one machine) */
+      fc::microseconds _simulated_latency;
+      double _simulated_loss_rate;
+      uint32_t _simulated_loss_seed; /// the nth connection we configure seeds its packet loss with this plus n
+      uint32_t _simulated_connections_configured;
+#endif // ENABLE_P2P_NETWORK_SIMULATION
 
       node_impl();
       ~node_impl();
@@ -339,10 +793,15 @@ namespace bts { namespace net {
       bool have_already_received_sync_item(const item_hash_t& item_hash);
       void request_sync_item_from_peer(const peer_connection_ptr& peer, const item_hash_t& item_to_request);
       void fetch_sync_items_loop();
+      uint32_t get_sync_window_for_peer(const peer_connection_ptr& peer, fc::microseconds best_latency);
+      void expire_sync_item_requests();
       void trigger_fetch_sync_items_loop();
 
       void fetch_items_loop();
       void trigger_fetch_items_loop();
+      void expire_item_requests();
+      void reschedule_item_fetch(const item_id& item_to_fetch, peer_connection* peer_to_skip);
+      void prune_items_to_fetch_from_peer(peer_connection* peer);
 
       void advertise_inventory_loop();
       void trigger_advertise_inventory_loop();
@@ -361,7 +820,7 @@ namespace bts { namespace net {
 
       void parse_user_agent_string_for_peer(peer_connection* originating_peer, const std::string& user_agent);
 
-      void on_message(peer_connection* originating_peer, const message& received_message);
+      void on_message(peer_connection* originating_peer, const message_ptr& received_message);
       void on_hello_message(peer_connection* originating_peer, const hello_message& hello_message_received);
       void on_hello_reply_message(peer_connection* originating_peer, const hello_reply_message& hello_reply_message_received);
       void on_connection_rejected_message(peer_connection* originating_peer, const connection_rejected_message& connection_rejected_message_received);
@@ -370,20 +829,33 @@ namespace bts { namespace net {
       void on_fetch_blockchain_item_ids_message(peer_connection* originating_peer, const fetch_blockchain_item_ids_message& fetch_blockchain_item_ids_message_received);
       void on_blockchain_item_ids_inventory_message(peer_connection* originating_peer, const blockchain_item_ids_inventory_message& blockchain_item_ids_inventory_message_received);
       void on_fetch_item_message(peer_connection* originating_peer, const fetch_item_message& fetch_item_message_received);
+      void on_fetch_items_message(peer_connection* originating_peer, const fetch_items_message& fetch_items_message_received);
+      void on_items_message(peer_connection* originating_peer, items_message& items_message_received);
+      message_ptr pack_items_message(uint32_t item_type, const std::vector<message_ptr>& items);
       void on_item_not_available_message(peer_connection* originating_peer, const item_not_available_message& item_not_available_message_received);
       void on_item_ids_inventory_message(peer_connection* originating_peer, const item_ids_inventory_message& item_ids_inventory_message_received);
+      void on_compact_block_message(peer_connection* originating_peer, const bts::client::compact_block_message& compact_block_message_received);
+      void on_fetch_compact_block_transactions_message(peer_connection* originating_peer, const bts::client::fetch_compact_block_transactions_message& fetch_compact_block_transactions_message_received);
+      void on_compact_block_transactions_message(peer_connection* originating_peer, const bts::client::compact_block_transactions_message& compact_block_transactions_message_received);
+      bool try_to_finish_compact_block(peer_connection* originating_peer, const partially_reconstructed_block& block_to_finish);
+      void request_missing_compact_block_transactions(peer_connection* originating_peer, partially_reconstructed_block& incomplete_block);
+      void fetch_full_block_instead(peer_connection* originating_peer, const item_hash_t& block_message_hash);
       void on_connection_closed(peer_connection* originating_peer);
 
+      received_sync_items_container::iterator find_next_sync_block_in_backlog(const fc::optional<bts::blockchain::block_id_type>& last_block_accepted);
+      void purge_descendants_from_sync_backlog(const bts::blockchain::block_id_type& rejected_block_id);
       void process_backlog_of_sync_blocks();
-      void process_block_during_sync(peer_connection* originating_peer, const message& block_message, const message_hash_type& message_hash);
-      void process_block_during_normal_operation(peer_connection* originating_peer, const message& block_message, const message_hash_type& message_hash);
+      void process_block_during_sync(peer_connection* originating_peer, const message_ptr& block_message, const message_hash_type& message_hash);
+      void process_block_during_normal_operation(peer_connection* originating_peer, const message_ptr& block_message, const message_hash_type& message_hash);
   
-      void process_ordinary_message(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash);
+      void process_ordinary_message(peer_connection* originating_peer, const message_ptr& message_to_process, const message_hash_type& message_hash);
 
       void start_synchronizing();
       void start_synchronizing_with_peer(const peer_connection_ptr& peer);
 
       void new_peer_just_added(const peer_connection_ptr& peer); /// called after a peer finishes handshaking, kicks off syncing
+      void configure_peer_connection(const peer_connection_ptr& peer); /// applies our rate limits (and simulated network conditions) to the connection
+      fc::optional<fc::ip::endpoint> get_peer_database_endpoint(peer_connection* peer); /// the endpoint we'd connect to to reach this peer
 
       void close();
 
@@ -398,21 +870,25 @@ namespace bts { namespace net {
       void disconnect_from_peer(peer_connection* originating_peer);
 
       // methods implementing node's public interface
-      void set_delegate(node_delegate* del);
+      void set_delegate(node_delegate* del, fc::thread* delegate_thread);
       void load_configuration(const fc::path& configuration_directory);
       void connect_to_p2p_network();
       void add_node(const fc::ip::endpoint& ep);
       void connect_to(const fc::ip::endpoint& ep);
       void listen_on_endpoint(const fc::ip::endpoint& ep);
+      fc::ip::endpoint get_actual_listening_endpoint() const;
       void listen_on_port(uint16_t port);
       std::vector<peer_status> get_connected_peers() const;
       uint32_t get_connection_count() const;
-      void broadcast(const message& item_to_broadcast, const message_propagation_data& propagation_data);
-      void broadcast(const message& item_to_broadcast);
+      void broadcast(const message_ptr& item_to_broadcast, const message_propagation_data& propagation_data);
+      void broadcast(const message_ptr& item_to_broadcast);
       void sync_from(const item_id&);
       bool is_connected() const;
       void set_advanced_node_parameters(const fc::variant_object& params);
       fc::variant_object get_advanced_node_parameters();
+      fc::variant_object get_message_cache_statistics() const;
+      void record_item_propagation(peer_connection* originating_peer, uint32_t item_type, const message_propagation_data& propagation_data);
+      fc::variant_object get_propagation_statistics() const;
       message_propagation_data get_transaction_propagation_data(const bts::blockchain::transaction_id_type& transaction_id);
       message_propagation_data get_block_propagation_data(const bts::blockchain::block_id_type& block_id);
       node_id_t get_node_id() const;
@@ -466,9 +942,17 @@ namespace bts { namespace net {
       }
     } // connect_to()
 
-    void peer_connection::on_message(message_oriented_connection* originating_connection, const message& received_message)
+    void peer_connection::on_message(message_oriented_connection* originating_connection, const message_ptr& received_message)
     {
-      _node.on_message(this, received_message);
+      if (received_message->msg_type == core_message_type_enum::compressed_message_type)
+      {
+        std::shared_ptr<message> decompressed_message = std::make_shared<message>(decompress_message(received_message->as<compressed_message>()));
+        if (decompressed_message->size > received_message->size)
+          bytes_saved_by_compression_receiving += decompressed_message->size - received_message->size;
+        _node.on_message(this, decompressed_message);
+      }
+      else
+        _node.on_message(this, received_message);
     }
 
     void peer_connection::on_connection_closed(message_oriented_connection* originating_connection)
@@ -478,7 +962,51 @@ namespace bts { namespace net {
 
     void peer_connection::send_message(const message& message_to_send)
     {
-      _message_connection.send_message(message_to_send);
+      queue_message(std::make_shared<const message>(message_to_send), message_ptr(), false);
+    }
+
+    void peer_connection::send_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send)
+    {
+      queue_message(message_to_send, compressed_message_to_send, false);
+    }
+
+    void peer_connection::send_urgent_message(const message& message_to_send)
+    {
+      queue_message(std::make_shared<const message>(message_to_send), message_ptr(), true);
+    }
+
+    void peer_connection::send_urgent_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send)
+    {
+      queue_message(message_to_send, compressed_message_to_send, true);
+    }
+
+    /**
+     *  The message body is shared with the send queue, not copied.  If the caller already
+     *  has a compressed version of the message (see blockchain_tied_message_cache), that is 
+     *  sent to peers that support compression instead of compressing it again.
+     */
+    void peer_connection::queue_message(const message_ptr& message_to_send, const message_ptr& compressed_message_to_send, bool urgent)
+    {
+      message_ptr message_to_queue = message_to_send;
+      if (peer_supports_compression && message_to_send->size >= MESSAGE_COMPRESSION_THRESHOLD)
+      {
+        message_ptr compressed = compressed_message_to_send;
+        if (!compressed)
+        {
+          fc::optional<message> newly_compressed = compress_message(*message_to_send);
+          if (newly_compressed)
+            compressed = std::make_shared<message>(std::move(*newly_compressed));
+        }
+        if (compressed)
+        {
+          bytes_saved_by_compression_sending += message_to_send->size - compressed->size;
+          message_to_queue = compressed;
+        }
+      }
+      if (urgent)
+        _message_connection.send_urgent_message(message_to_queue);
+      else
+        _message_connection.send_message(message_to_queue);
     }
 
     void peer_connection::close_connection()
@@ -496,6 +1024,16 @@ namespace bts { namespace net {
       return _message_connection.get_total_bytes_received();
     }
 
+    size_t peer_connection::get_send_queue_size() const
+    {
+      return _message_connection.get_send_queue_size();
+    }
+
+    bool peer_connection::is_closing() const
+    {
+      return _message_connection.is_closing();
+    }
+
     fc::time_point peer_connection::get_last_message_sent_time() const
     {
       return _message_connection.get_last_message_sent_time();
@@ -506,6 +1044,28 @@ namespace bts { namespace net {
       return _message_connection.get_last_message_received_time();
     }
 
+    void peer_connection::set_upload_rate_limit(uint64_t bytes_per_second)
+    {
+      _message_connection.set_upload_rate_limit(bytes_per_second);
+    }
+
+    void peer_connection::set_shared_upload_rate_limit(const std::shared_ptr<token_bucket>& shared_upload_limit)
+    {
+      _message_connection.set_shared_upload_rate_limit(shared_upload_limit);
+    }
+
+    fc::variant_object peer_connection::get_bandwidth_statistics() const
+    {
+      return _message_connection.get_bandwidth_statistics();
+    }
+
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+    void peer_connection::set_simulated_network_conditions(fc::microseconds latency, double loss_rate, uint32_t loss_seed)
+    {
+      _message_connection.set_simulated_network_conditions(latency, loss_rate, loss_seed);
+    }
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
     fc::optional<fc::ip::endpoint> peer_connection::get_remote_endpoint()
     {
       return _remote_endpoint;
@@ -530,19 +1090,69 @@ namespace bts { namespace net {
       return !busy();
     }
 
+    // folds one answered request into the moving averages, each new sample counts for 1/8
+    void peer_connection::record_item_received(fc::microseconds latency, size_t size_in_bytes)
+    {
+      if (latency.count() <= 0)
+        latency = fc::microseconds(1);
+      uint64_t throughput = (uint64_t)size_in_bytes * fc::seconds(1).count() / latency.count();
+      if (average_item_latency.count() == 0)
+      {
+        average_item_latency = latency;
+        average_item_throughput = throughput;
+      }
+      else
+      {
+        average_item_latency = fc::microseconds((average_item_latency.count() * 7 + latency.count()) / 8);
+        average_item_throughput = (average_item_throughput * 7 + throughput) / 8;
+      }
+    }
+
+    /** orders peers fastest first, peers we haven't measured yet go after the ones we have */
+    static bool is_faster_peer(const peer_connection_ptr& a, const peer_connection_ptr& b)
+    {
+      if (a->average_item_latency.count() == 0 || b->average_item_latency.count() == 0)
+        return a->average_item_latency.count() != 0 && b->average_item_latency.count() == 0;
+      return a->average_item_latency < b->average_item_latency;
+    }
+
+    /**
+     *  How much we'd like to connect to a peer, higher is better.  This is the fraction of our 
+     *  connection attempts that succeeded (counting one success and one failure up front so
+     *  unknown peers start at 1/2) divided by how long the peer took to answer our requests.
+     */
+    static double get_connection_preference(const potential_peer_record& record)
+    {
+      double reliability = double(record.number_of_successful_connection_attempts + 1) / 
+                           double(record.number_of_successful_connection_attempts + record.number_of_failed_connection_attempts + 2);
+      uint32_t latency_ms = record.average_item_latency_ms ? record.average_item_latency_ms : UNMEASURED_PEER_LATENCY_MS;
+      return reliability / latency_ms;
+    }
+
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     node_impl::node_impl() : 
-      _delegate(nullptr),
+      _thread(std::make_shared<fc::thread>("p2p")),
       _desired_number_of_connections(8),
       _maximum_number_of_connections(12),
       _peer_connection_retry_timeout(60 * 5),
       _peer_inactivity_timeout(45),
+      _maximum_sync_items_in_flight_per_peer(MAX_SYNC_ITEMS_IN_FLIGHT_PER_PEER),
+      _sync_item_request_timeout(SYNC_ITEM_REQUEST_TIMEOUT),
+      _total_upload_limit(std::make_shared<token_bucket>(DEFAULT_MAXIMUM_UPLOAD_RATE)),
+      _maximum_upload_rate_per_peer(DEFAULT_MAXIMUM_UPLOAD_RATE_PER_PEER),
       _most_recent_blocks_accepted(_maximum_number_of_connections),
-      _total_number_of_unfetched_items(0)
-    {
+      _total_number_of_unfetched_items(0),
+      _received_sync_items_size_in_bytes(0),
+      _average_sync_block_size(0)
+    {
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      _simulated_loss_rate = 0;
+      _simulated_loss_seed = 0;
+      _simulated_connections_configured = 0;
+#endif // ENABLE_P2P_NETWORK_SIMULATION
       fc::rand_pseudo_bytes(_node_id.data(), 20);
 
       // for the time being, shoehorn a bunch of properties into the user_agent string
@@ -564,6 +1174,11 @@ namespace bts { namespace net {
 #else 
       user_agent_properties["platform"] = "other";
 #endif
+#ifdef BTS_NET_HAVE_ZLIB
+      user_agent_properties["compression"] = std::vector<std::string>{"zlib"};
+#endif
+      user_agent_properties["compact_blocks"] = true;
+      user_agent_properties["batched_fetch"] = true;
       _user_agent_string = fc::json::to_string(user_agent_properties);
     }
 
@@ -634,8 +1249,10 @@ namespace bts { namespace net {
           bool initiated_connection_this_pass = false;
           _potential_peer_database_updated = false;
 
+          // gather the peers we could connect to, then try the most reliable, fastest ones first
+          std::vector<potential_peer_record> candidate_peers;
           for ( peer_database::iterator iter = _potential_peer_db.begin();
-               iter != _potential_peer_db.end() && is_wanting_new_connections();
+               iter != _potential_peer_db.end();
                ++iter)
           {
             ilog("Last attempt was ${time_distance} seconds ago (disposition: ${disposition})", ("time_distance", (fc::time_point::now() - iter->last_connection_attempt_time).count() / fc::seconds(1).count())("disposition", iter->last_connection_disposition));
@@ -644,10 +1261,17 @@ namespace bts { namespace net {
                   iter->last_connection_disposition != last_connection_rejected &&
                   iter->last_connection_disposition != last_connection_handshaking_failed) ||
                  iter->last_connection_attempt_time < fc::time_point::now() - fc::seconds(_peer_connection_retry_timeout)))
-            {
-              connect_to(iter->endpoint);
-              initiated_connection_this_pass = true;
-            }
+              candidate_peers.push_back(*iter);
+          }
+          std::stable_sort(candidate_peers.begin(), candidate_peers.end(), 
+                           [](const potential_peer_record& a, const potential_peer_record& b) { return get_connection_preference(a) > get_connection_preference(b); });
+
+          for (const potential_peer_record& candidate_peer : candidate_peers)
+          {
+            if (!is_wanting_new_connections())
+              break;
+            connect_to(candidate_peer.endpoint);
+            initiated_connection_this_pass = true;
           }
 
           if (!initiated_connection_this_pass && !_potential_peer_database_updated)
@@ -695,8 +1319,7 @@ namespace bts { namespace net {
 
     bool node_impl::have_already_received_sync_item(const item_hash_t& item_hash)
     {
-      return std::find_if(_received_sync_items.begin(), _received_sync_items.end(), 
-                          [&item_hash](const bts::client::block_message& message) { return message.block_id == item_hash; }) != _received_sync_items.end();
+      return _received_sync_items.get<received_sync_item_block_id_index>().find(item_hash) != _received_sync_items.get<received_sync_item_block_id_index>().end();
     }
 
     void node_impl::request_sync_item_from_peer(const peer_connection_ptr& peer, const item_hash_t& item_to_request)
@@ -704,10 +1327,44 @@ namespace bts { namespace net {
       ilog("requesting item ${item_hash} from peer ${endpoint}", ("item_hash", item_to_request)("endpoint", peer->get_remote_endpoint()));
       item_id item_id_to_request(bts::client::block_message_type, item_to_request);
       _active_sync_requests.insert(active_sync_requests_map::value_type(item_to_request, fc::time_point::now()));
+      _sync_items_outstanding.insert(item_to_request);
       peer->sync_items_requested_from_peer.insert(peer_connection::item_to_time_map_type::value_type(item_id_to_request, fc::time_point::now()));
       peer->send_message(fetch_item_message(item_id_to_request));
     }
 
+    /**
+     *  The number of sync requests we let a peer have outstanding.  Peers that answer as fast as
+     *  our fastest peer get the full window, slower peers get a share proportional to their speed
+     *  (but always at least one), so one slow peer can't hold up the blocks we need next.
+     */
+    uint32_t node_impl::get_sync_window_for_peer(const peer_connection_ptr& peer, fc::microseconds best_latency)
+    {
+      if (peer->average_item_latency.count() == 0 || best_latency.count() == 0)
+        return _maximum_sync_items_in_flight_per_peer;
+      uint64_t window = (uint64_t)_maximum_sync_items_in_flight_per_peer * best_latency.count() / peer->average_item_latency.count();
+      return (uint32_t)std::max<uint64_t>(window, 1);
+    }
+
+    // requests that have been outstanding too long are made available to be requested from another peer.
+    // they move to the original peer's timed-out list, freeing its window slot while still accepting
+    // its reply if it arrives
+    void node_impl::expire_sync_item_requests()
+    {
+      fc::time_point expiration_threshold = fc::time_point::now() - fc::seconds(_sync_item_request_timeout);
+      for (const peer_connection_ptr& peer : _active_connections)
+        for (auto iter = peer->sync_items_requested_from_peer.begin(); iter != peer->sync_items_requested_from_peer.end(); )
+          if (iter->second < expiration_threshold)
+          {
+            wlog("sync request for item ${item_hash} from peer ${endpoint} timed out, will request it from another peer", 
+                 ("item_hash", iter->first.item_hash)("endpoint", peer->get_remote_endpoint()));
+            _active_sync_requests.erase(iter->first.item_hash);
+            peer->sync_items_timed_out_from_peer.insert(*iter);
+            iter = peer->sync_items_requested_from_peer.erase(iter);
+          }
+          else
+            ++iter;
+    }
+
     void node_impl::fetch_sync_items_loop()
     {
       for (;;)
@@ -715,30 +1372,57 @@ namespace bts { namespace net {
         _sync_items_to_fetch_updated = false;
         ilog("beginning another iteration of the sync items loop");
 
-        std::map<peer_connection_ptr, item_hash_t> sync_item_requests_to_send;
-        std::set<item_hash_t> sync_items_to_request;
+        expire_sync_item_requests();
 
-        // for each idle peer that we're syncing with
+        // find the peers we're syncing with, fastest first so they are given the earliest blocks
+        std::vector<peer_connection_ptr> syncing_peers;
+        fc::microseconds best_latency;
         for (const peer_connection_ptr& peer : _active_connections)
+          if (peer->we_need_sync_items_from_peer)
+          {
+            syncing_peers.push_back(peer);
+            if (peer->average_item_latency.count() != 0 &&
+                (best_latency.count() == 0 || peer->average_item_latency < best_latency))
+              best_latency = peer->average_item_latency;
+          }
+        std::sort(syncing_peers.begin(), syncing_peers.end(), is_faster_peer);
+        // once we aren't syncing with anyone, no more sync blocks will be delivered
+        if (syncing_peers.empty())
+          _sync_items_outstanding.clear();
+
+        std::list<std::pair<peer_connection_ptr, item_hash_t> > sync_item_requests_to_send;
+        std::set<item_hash_t> sync_items_to_request;
+
+        // if the blocks we can't process yet, plus the ones we're still waiting on, would take up 
+        // too much memory, only request the blocks that would let us start processing them
+        size_t projected_backlog_size = _received_sync_items_size_in_bytes + _sync_items_outstanding.size() * _average_sync_block_size;
+        if (projected_backlog_size >= MAX_SYNC_BACKLOG_SIZE)
+          wlog("sync backlog is using ${bytes} bytes with ${count} more blocks in flight, only requesting the next block from each peer", 
+               ("bytes", _received_sync_items_size_in_bytes)("count", _sync_items_outstanding.size()));
+
+        for (const peer_connection_ptr& peer : syncing_peers)
         {
-          if (peer->we_need_sync_items_from_peer && 
-              sync_item_requests_to_send.find(peer) == sync_item_requests_to_send.end() && // if we've already scheduled a request for this peer, don't consider scheduling another
-              peer->idle())
+          uint32_t window = get_sync_window_for_peer(peer, best_latency);
+          uint32_t requests_in_flight = peer->sync_items_requested_from_peer.size();
+          // loop through the items it has that we don't yet have on our blockchain
+          for (unsigned i = 0; 
+               i < peer->ids_of_items_to_get.size() && requests_in_flight < window && 
+                 (i == 0 || projected_backlog_size < MAX_SYNC_BACKLOG_SIZE); 
+               ++i)
           {
-            // loop through the items it has that we don't yet have on our blockchain
-            for (unsigned i = 0; i < peer->ids_of_items_to_get.size(); ++i)
+            item_hash_t item_to_potentially_request = peer->ids_of_items_to_get[i];
+            // if we don't already have this item in our temporary storage and we haven't requested from another syncing peer
+            if (!have_already_received_sync_item(item_to_potentially_request) && // already got it, but for some reson it's still in our list of items to fetch
+                sync_items_to_request.find(item_to_potentially_request) == sync_items_to_request.end() &&  // we have already decided to request it from another peer during this iteration
+                _active_sync_requests.find(item_to_potentially_request) == _active_sync_requests.end() && // we've requested it in a previous iteration and we're still waiting for it to arrive
+                peer->sync_items_timed_out_from_peer.find(item_id(bts::client::block_message_type, item_to_potentially_request)) == 
+                  peer->sync_items_timed_out_from_peer.end()) // this peer already timed out on it, let another peer have it
             {
-              item_hash_t item_to_potentially_request = peer->ids_of_items_to_get[i];
-              // if we don't already have this item in our temporary storage and we haven't requested from another syncing peer
-              if (!have_already_received_sync_item(item_to_potentially_request) && // already got it, but for some reson it's still in our list of items to fetch
-                  sync_items_to_request.find(item_to_potentially_request) == sync_items_to_request.end() &&  // we have already decided to request it from another peer during this iteration
-                  _active_sync_requests.find(item_to_potentially_request) == _active_sync_requests.end()) // we've requested it in a previous iteration and we're still waiting for it to arrive
-              {
-                // then schedule a request from this peer
-                sync_item_requests_to_send[peer] = item_to_potentially_request;
-                sync_items_to_request.insert(item_to_potentially_request);
-                break;
-              }
+              // then schedule a request from this peer
+              sync_item_requests_to_send.push_back(std::make_pair(peer, item_to_potentially_request));
+              sync_items_to_request.insert(item_to_potentially_request);
+              ++requests_in_flight;
+              projected_backlog_size += _average_sync_block_size;
             }
           }
         }
@@ -751,7 +1435,17 @@ namespace bts { namespace net {
         {
           ilog("no sync items to fetch right now, going to sleep");
           _retrigger_fetch_sync_items_loop_promise = fc::promise<void>::ptr(new fc::promise<void>());
-          _retrigger_fetch_sync_items_loop_promise->wait();
+          try
+          {
+            // if we're waiting on any requests, wake up in time to notice if they time out
+            if (!_active_sync_requests.empty())
+              _retrigger_fetch_sync_items_loop_promise->wait_until(fc::time_point::now() + fc::seconds(_sync_item_request_timeout));
+            else
+              _retrigger_fetch_sync_items_loop_promise->wait();
+          }
+          catch (fc::timeout_exception&)
+          {
+          }
           _retrigger_fetch_sync_items_loop_promise.reset();
         }
       }
@@ -765,6 +1459,11 @@ namespace bts { namespace net {
         _retrigger_fetch_sync_items_loop_promise->set_value();
     }
 
+    /**
+     *  Each idle peer takes the oldest item off its own queue of advertised items that we still
+     *  want, so an iteration costs time proportional to the number of peers rather than the 
+     *  number of items waiting to be fetched.
+     */
     void node_impl::fetch_items_loop()
     {
       for (;;)
@@ -772,42 +1471,148 @@ namespace bts { namespace net {
         _items_to_fetch_updated = false;
         ilog("beginning an iteration of fetch items (${count} items to fetch)", ("count", _items_to_fetch.size()));
 
-        for (auto iter = _items_to_fetch.begin(); iter != _items_to_fetch.end(); )
+        expire_item_requests();
+
+        // let the fastest peers claim the items several peers have advertised
+        std::vector<peer_connection_ptr> peers_fastest_first(_active_connections.begin(), _active_connections.end());
+        std::sort(peers_fastest_first.begin(), peers_fastest_first.end(), is_faster_peer);
+
+        auto& items_to_fetch_by_id = _items_to_fetch.get<1>();
+        for (const peer_connection_ptr& peer : peers_fastest_first)
         {
-          bool item_fetched = false;
-          for (const peer_connection_ptr& peer : _active_connections)
+          while (peer->idle() && !peer->items_to_fetch_from_peer.empty())
           {
-            if (peer->idle() &&
-                peer->inventory_peer_advertised_to_us.find(*iter) != peer->inventory_peer_advertised_to_us.end())
+            // take a run of items of the same type from the front of the peer's queue and
+            // request them all at once.  Blocks, and everything for peers that can't take
+            // a batch, are requested one at a time
+            uint32_t item_type = peer->items_to_fetch_from_peer.front().item_type;
+            size_t max_items_to_request = 1;
+            if (peer->peer_supports_batched_fetch && item_type != bts::client::block_message_type)
+              max_items_to_request = MAX_ITEMS_PER_FETCH_REQUEST;
+
+            std::vector<item_hash_t> items_to_request;
+            while (!peer->items_to_fetch_from_peer.empty() && 
+                   peer->items_to_fetch_from_peer.front().item_type == item_type &&
+                   items_to_request.size() < max_items_to_request)
             {
-              ilog("requesting item ${hash} from peer ${endpoint}", ("hash", iter->item_hash)("endpoint", peer->get_remote_endpoint()));
-              peer->items_requested_from_peer.insert(peer_connection::item_to_time_map_type::value_type(*iter, fc::time_point::now()));
-              item_id item_id_to_fetch = *iter;
-              iter = _items_to_fetch.erase(iter);
-              item_fetched = true;
-              peer->send_message(fetch_item_message(item_id_to_fetch));
-              break;
+              item_id item_id_to_fetch = peer->items_to_fetch_from_peer.front();
+              peer->items_to_fetch_from_peer.pop_front();
+              auto iter = items_to_fetch_by_id.find(item_id_to_fetch);
+              if (iter == items_to_fetch_by_id.end())
+                continue; // we've already requested it from another peer
+              items_to_fetch_by_id.erase(iter);
+              auto advertised_time_iter = _first_advertised_times.find(item_id_to_fetch);
+              if (advertised_time_iter != _first_advertised_times.end())
+              {
+                _advertise_to_request_latency[item_type].record(fc::time_point::now() - advertised_time_iter->second);
+                _first_advertised_times.erase(advertised_time_iter);
+              }
+              peer->items_requested_from_peer.insert(peer_connection::item_to_time_map_type::value_type(item_id_to_fetch, fc::time_point::now()));
+              items_to_request.push_back(item_id_to_fetch.item_hash);
             }
-#ifndef NDEBUG
-            else if (peer->inventory_peer_advertised_to_us.find(*iter) != peer->inventory_peer_advertised_to_us.end())
+
+            if (items_to_request.size() == 1)
             {
-              ilog("would request item ${hash} from peer ${endpoint}, but it is busy", ("hash", iter->item_hash)("endpoint", peer->get_remote_endpoint()));
+              ilog("requesting item ${hash} from peer ${endpoint}", ("hash", items_to_request.front())("endpoint", peer->get_remote_endpoint()));
+              peer->send_message(fetch_item_message(item_id(item_type, items_to_request.front())));
+            }
+            else if (!items_to_request.empty())
+            {
+              ilog("requesting ${count} items from peer ${endpoint}", ("count", items_to_request.size())("endpoint", peer->get_remote_endpoint()));
+              peer->send_message(fetch_items_message(item_type, items_to_request));
             }
-#endif
           }
-          if (!item_fetched)
-            ++iter;
         }
 
         if (!_items_to_fetch_updated)
         {
           _retrigger_fetch_item_loop_promise = fc::promise<void>::ptr(new fc::promise<void>());
-          _retrigger_fetch_item_loop_promise->wait();
+          try
+          {
+            // if we're waiting on any requests, wake up in time to notice if they time out
+            bool requests_outstanding = false;
+            for (const peer_connection_ptr& peer : _active_connections)
+              if (!peer->items_requested_from_peer.empty())
+              {
+                requests_outstanding = true;
+                break;
+              }
+            if (requests_outstanding)
+              _retrigger_fetch_item_loop_promise->wait_until(fc::time_point::now() + fc::seconds(ITEM_REQUEST_TIMEOUT));
+            else
+              _retrigger_fetch_item_loop_promise->wait();
+          }
+          catch (fc::timeout_exception&)
+          {
+          }
           _retrigger_fetch_item_loop_promise.reset();
         }
       }
     }
 
+    void node_impl::expire_item_requests()
+    {
+      fc::time_point expiration_threshold = fc::time_point::now() - fc::seconds(ITEM_REQUEST_TIMEOUT);
+      for (const peer_connection_ptr& peer : _active_connections)
+      {
+        // the peer answered these with a compact block, they time out below if it
+        // doesn't send the transactions we're missing
+        std::vector<item_hash_t> stalled_compact_blocks;
+        for (const auto& hash_and_block : peer->compact_blocks_being_reconstructed)
+          if (hash_and_block.second.last_request_time < expiration_threshold)
+            stalled_compact_blocks.push_back(hash_and_block.first);
+        for (const item_hash_t& block_message_hash : stalled_compact_blocks)
+        {
+          wlog("peer ${endpoint} didn't send the transactions for compact block ${hash}, fetching the full block", 
+               ("endpoint", peer->get_remote_endpoint())("hash", block_message_hash));
+          fetch_full_block_instead(peer.get(), block_message_hash);
+        }
+
+        for (auto iter = peer->items_requested_from_peer.begin(); iter != peer->items_requested_from_peer.end(); )
+          if (iter->second < expiration_threshold &&
+              (iter->first.item_type != bts::client::block_message_type ||
+               peer->compact_blocks_being_reconstructed.find(iter->first.item_hash) == peer->compact_blocks_being_reconstructed.end()))
+          {
+            item_id timed_out_item = iter->first;
+            wlog("request for item ${hash} from peer ${endpoint} timed out", ("hash", timed_out_item.item_hash)("endpoint", peer->get_remote_endpoint()));
+            iter = peer->items_requested_from_peer.erase(iter);
+            peer->items_timed_out_from_peer.insert(timed_out_item);
+            reschedule_item_fetch(timed_out_item, peer.get());
+          }
+          else
+            ++iter;
+      }
+    }
+
+    /** queues a request that failed to be sent to the other peers that advertised the item */
+    void node_impl::reschedule_item_fetch(const item_id& item_to_fetch, peer_connection* peer_to_skip)
+    {
+      bool item_rescheduled = false;
+      for (const peer_connection_ptr& peer : _active_connections)
+        if (peer.get() != peer_to_skip && peer->inventory_peer_advertised_to_us.contains(item_to_fetch) &&
+            peer->items_to_fetch_from_peer.size() < MAX_INVENTORY_ITEMS_TRACKED_PER_PEER)
+        {
+          peer->items_to_fetch_from_peer.push_front(item_to_fetch);
+          item_rescheduled = true;
+        }
+      if (item_rescheduled)
+      {
+        _items_to_fetch.push_back(item_to_fetch);
+        trigger_fetch_items_loop();
+      }
+      else
+        ilog("no other peer has item ${hash}, giving up on it", ("hash", item_to_fetch.item_hash));
+    }
+
+    /** drops the items in the peer's fetch queue that we've already requested from another peer */
+    void node_impl::prune_items_to_fetch_from_peer(peer_connection* peer)
+    {
+      auto& items_to_fetch_by_id = _items_to_fetch.get<1>();
+      peer->items_to_fetch_from_peer.erase(std::remove_if(peer->items_to_fetch_from_peer.begin(), peer->items_to_fetch_from_peer.end(),
+                                                          [&](const item_id& queued_item) { return items_to_fetch_by_id.find(queued_item) == items_to_fetch_by_id.end(); }),
+                                           peer->items_to_fetch_from_peer.end());
+    }
+
     void node_impl::trigger_fetch_items_loop()
     {
       _items_to_fetch_updated = true;
@@ -840,8 +1645,8 @@ namespace bts { namespace net {
             // group the items we need to send by type, because we'll need to send one inventory message per type
             unsigned total_items_to_send_to_this_peer = 0;
             for (const item_id& item_to_advertise : inventory_to_advertise)
-              if (peer->inventory_advertised_to_peer.find(item_to_advertise) == peer->inventory_advertised_to_peer.end() &&
-                  peer->inventory_peer_advertised_to_us.find(item_to_advertise) == peer->inventory_peer_advertised_to_us.end())
+              if (!peer->inventory_advertised_to_peer.contains(item_to_advertise) &&
+                  !peer->inventory_peer_advertised_to_us.contains(item_to_advertise))
               {
                 items_to_advertise_by_type[item_to_advertise.item_type].push_back(item_to_advertise.item_hash);
                 peer->inventory_advertised_to_peer.insert(item_to_advertise);
@@ -856,7 +1661,7 @@ namespace bts { namespace net {
         }
 
         for (auto iter = inventory_messages_to_send.begin(); iter != inventory_messages_to_send.end(); ++iter)
-          iter->first->send_message(iter->second);
+          iter->first->send_urgent_message(iter->second);
 
         if (_new_inventory.empty())
         {
@@ -910,8 +1715,19 @@ namespace bts { namespace net {
             peers_to_disconnect.push_back(peer);
           }
 
+        // peers that aren't reading the data we send them fast enough are disconnected by
+        // their message_oriented_connection as soon as their send queue is over MAX_SEND_QUEUE_SIZE,
+        // not counting what our own upload limits are holding back
+
         for (const peer_connection_ptr& peer : peers_to_disconnect)
           disconnect_from_peer(peer.get());
+
+        // inventory sets only expire items when something is inserted, clean up after quiet peers too
+        for (const peer_connection_ptr& peer : _active_connections)
+        {
+          peer->inventory_peer_advertised_to_us.expire_old_items();
+          peer->inventory_advertised_to_peer.expire_old_items();
+        }
         fc::usleep(fc::seconds(15));
       }
     }
@@ -985,8 +1801,9 @@ namespace bts { namespace net {
       }
     }
 
-    void node_impl::on_message(peer_connection* originating_peer, const message& received_message)
+    void node_impl::on_message(peer_connection* originating_peer, const message_ptr& received_message_ptr)
     {
+      const message& received_message = *received_message_ptr;
       message_hash_type message_hash = received_message.id();
       //ilog("handling message ${hash} size ${size} from peer ${endpoint}", ("hash", message_hash)("size", received_message.size)("endpoint", originating_peer->get_remote_endpoint()));
       switch (received_message.msg_type)
@@ -1015,20 +1832,38 @@ namespace bts { namespace net {
       case core_message_type_enum::fetch_item_message_type:
         on_fetch_item_message(originating_peer, received_message.as<fetch_item_message>());
         break;
+      case core_message_type_enum::fetch_items_message_type:
+        on_fetch_items_message(originating_peer, received_message.as<fetch_items_message>());
+        break;
+      case core_message_type_enum::items_message_type:
+        {
+          items_message items_message_received(received_message.as<items_message>());
+          on_items_message(originating_peer, items_message_received);
+        }
+        break;
       case core_message_type_enum::item_not_available_message_type:
         on_item_not_available_message(originating_peer, received_message.as<item_not_available_message>());
         break;
       case core_message_type_enum::item_ids_inventory_message_type:
         on_item_ids_inventory_message(originating_peer, received_message.as<item_ids_inventory_message>());
         break;
+      case bts::client::message_type_enum::compact_block_message_type:
+        on_compact_block_message(originating_peer, received_message.as<bts::client::compact_block_message>());
+        break;
+      case bts::client::message_type_enum::fetch_compact_block_transactions_message_type:
+        on_fetch_compact_block_transactions_message(originating_peer, received_message.as<bts::client::fetch_compact_block_transactions_message>());
+        break;
+      case bts::client::message_type_enum::compact_block_transactions_message_type:
+        on_compact_block_transactions_message(originating_peer, received_message.as<bts::client::compact_block_transactions_message>());
+        break;
       case bts::client::message_type_enum::block_message_type:
         if (originating_peer->we_need_sync_items_from_peer)
-          process_block_during_sync(originating_peer, received_message, message_hash);
+          process_block_during_sync(originating_peer, received_message_ptr, message_hash);
         else
-          process_block_during_normal_operation(originating_peer, received_message, message_hash);
+          process_block_during_normal_operation(originating_peer, received_message_ptr, message_hash);
         break;
       default:
-        process_ordinary_message(originating_peer, received_message, message_hash);
+        process_ordinary_message(originating_peer, received_message_ptr, message_hash);
         break;
       }
     }
@@ -1054,6 +1889,15 @@ namespace bts { namespace net {
             originating_peer->fc_git_revision_unix_timestamp = fc::time_point_sec(user_agent_properties["fc_git_revision_unix_timestamp"].as<uint32_t>());
           if (user_agent_properties.contains("platform"))
             originating_peer->platform = user_agent_properties["platform"].as_string();
+          if (user_agent_properties.contains("compact_blocks"))
+            originating_peer->peer_supports_compact_blocks = user_agent_properties["compact_blocks"].as_bool();
+          if (user_agent_properties.contains("batched_fetch"))
+            originating_peer->peer_supports_batched_fetch = user_agent_properties["batched_fetch"].as_bool();
+          if (user_agent_properties.contains("compression"))
+          {
+            std::vector<std::string> compression_methods = user_agent_properties["compression"].as<std::vector<std::string> >();
+            originating_peer->peer_supports_compression = std::find(compression_methods.begin(), compression_methods.end(), "zlib") != compression_methods.end();
+          }
         }
         else
           originating_peer->user_agent = user_agent;
@@ -1068,9 +1912,20 @@ namespace bts { namespace net {
     {
       bool already_connected_to_this_peer = is_already_connected_to_id(hello_message_received.node_id);
 
-      if( hello_message_received.chain_id != _chain_id )
+      if( hello_message_received.chain_id != _chain_id )
+      {
+         wlog( "Recieved hello message from peer on a different chain: ${message}", ("message",hello_message_received) );
+         connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, originating_peer->get_socket().remote_endpoint());
+         originating_peer->state = peer_connection::connection_rejected_sent;
+         originating_peer->send_message(message(connection_rejected));
+         disconnect_from_peer( originating_peer );
+         return;
+      }
+
+      if( hello_message_received.core_protocol_version < BTS_NET_MINIMUM_PROTOCOL_VERSION )
       {
-         wlog( "Recieved hello message from peer on a different chain: ${message}", ("message",hello_message_received) );
+         wlog( "Recieved hello message from peer running incompatible protocol version ${version}: ${message}", 
+               ("version", hello_message_received.core_protocol_version)("message",hello_message_received) );
          connection_rejected_message connection_rejected(_user_agent_string, core_protocol_version, originating_peer->get_socket().remote_endpoint());
          originating_peer->state = peer_connection::connection_rejected_sent;
          originating_peer->send_message(message(connection_rejected));
@@ -1161,7 +2016,13 @@ namespace bts { namespace net {
       if (originating_peer->state == peer_connection::hello_sent && 
           originating_peer->direction == peer_connection_direction::outbound)
       {
-        if (already_connected_to_this_peer)
+        if (hello_reply_message_received.core_protocol_version < BTS_NET_MINIMUM_PROTOCOL_VERSION)
+        {
+          wlog("Established a connection with peer ${peer}, but it runs incompatible protocol version ${version}.  Closing the connection", 
+               ("peer", originating_peer->get_remote_endpoint())("version", hello_reply_message_received.core_protocol_version));
+          disconnect_from_peer(originating_peer);
+        }
+        else if (already_connected_to_this_peer)
         {
           ilog("Established a connection with peer ${peer}, but I'm already connected to it.  Closing the connection", 
                ("peer", originating_peer->get_remote_endpoint()));
@@ -1432,17 +2293,32 @@ namespace bts { namespace net {
       ilog("received item request for id ${id} from peer ${endpoint}", ("id", fetch_item_message_received.item_to_fetch.item_hash)("endpoint", originating_peer->get_remote_endpoint()));
       try
       {
-        message requested_message = _message_cache.get_message(fetch_item_message_received.item_to_fetch.item_hash);
+        message_ptr requested_message = _message_cache.get_message(fetch_item_message_received.item_to_fetch.item_hash);
         ilog("received item request for item ${id} from peer ${endpoint}, returning the item from my message cache",
              ("endpoint", originating_peer->get_remote_endpoint())
-             ("id", requested_message.id()));
-        originating_peer->send_message(requested_message);
+             ("id", fetch_item_message_received.item_to_fetch.item_hash));
+        // blocks in the cache are ones being relayed right now, so the peer probably has most of
+        // their transactions.  (blocks requested during sync come from the delegate instead)
+        if (requested_message->msg_type == bts::client::block_message_type && originating_peer->peer_supports_compact_blocks &&
+            !originating_peer->compact_blocks_sent_to_peer.contains(fetch_item_message_received.item_to_fetch))
+        {
+          message_ptr compact_block_message = _message_cache.get_compact_message(fetch_item_message_received.item_to_fetch.item_hash);
+          if (compact_block_message)
+          {
+            originating_peer->compact_blocks_sent_to_peer.insert(fetch_item_message_received.item_to_fetch);
+            originating_peer->send_urgent_message(compact_block_message);
+            return;
+          }
+        }
+        originating_peer->send_urgent_message(requested_message, _message_cache.get_compressed_message(fetch_item_message_received.item_to_fetch.item_hash));
         return;
       }
       catch (fc::key_not_found_exception&)
       {
       }
 
+      // anything not in the cache is an old item, usually a block for a peer that's syncing from us.
+      // these are the messages the upload rate limits hold back
       try
       {
         message requested_message = _delegate->get_item(fetch_item_message_received.item_to_fetch);
@@ -1465,22 +2341,151 @@ namespace bts { namespace net {
       }
     }
 
+    /**
+     *  Builds an items_message straight from the bodies of the given messages, so each body is
+     *  copied once into the reply instead of into an items_message and then into the reply.
+     */
+    message_ptr node_impl::pack_items_message(uint32_t item_type, const std::vector<message_ptr>& items)
+    {
+      size_t packed_size = fc::raw::pack_size(item_type) + fc::raw::pack_size(fc::unsigned_int((uint32_t)items.size()));
+      for (const message_ptr& item : items)
+        packed_size += fc::raw::pack_size(fc::unsigned_int((uint32_t)item->data.size())) + item->data.size();
+
+      std::shared_ptr<message> reply = std::make_shared<message>();
+      reply->msg_type = items_message::type;
+      reply->data.resize(packed_size);
+      fc::datastream<char*> stream(reply->data.data(), reply->data.size());
+      fc::raw::pack(stream, item_type);
+      fc::raw::pack(stream, fc::unsigned_int((uint32_t)items.size()));
+      for (const message_ptr& item : items)
+      {
+        fc::raw::pack(stream, fc::unsigned_int((uint32_t)item->data.size()));
+        if (!item->data.empty())
+          stream.write(item->data.data(), item->data.size());
+      }
+      reply->size = (uint32_t)reply->data.size();
+      return reply;
+    }
+
+    /**
+     *  Answers a batched request.  Items in our message cache are being relayed right now and 
+     *  are sent urgently like in on_fetch_item_message, older items come from the delegate and 
+     *  are held to the upload rate limits.  Each group is packed into as few items_messages as 
+     *  fit under MAX_MESSAGE_SIZE, the items we don't have get item_not_available.
+     *  We never batch blocks or ask for more than MAX_ITEMS_PER_FETCH_REQUEST items, so a peer
+     *  that does is disconnected.
+     */
+    void node_impl::on_fetch_items_message(peer_connection* originating_peer, const fetch_items_message& fetch_items_message_received)
+    {
+      ilog("received request for ${count} items from peer ${endpoint}", 
+           ("count", fetch_items_message_received.items_to_fetch.size())("endpoint", originating_peer->get_remote_endpoint()));
+      if (fetch_items_message_received.item_type == bts::client::block_message_type ||
+          fetch_items_message_received.items_to_fetch.size() > MAX_ITEMS_PER_FETCH_REQUEST)
+      {
+        wlog("peer ${endpoint} sent an invalid batched request for ${count} items of type ${type}, disconnecting from peer", 
+             ("endpoint", originating_peer->get_remote_endpoint())("count", fetch_items_message_received.items_to_fetch.size())
+             ("type", fetch_items_message_received.item_type));
+        disconnect_from_peer(originating_peer);
+        return;
+      }
+      std::vector<message_ptr> cached_items;
+      std::vector<message_ptr> stored_items;
+      size_t cached_items_size = 0;
+      size_t stored_items_size = 0;
+      for (const item_hash_t& item_hash : fetch_items_message_received.items_to_fetch)
+      {
+        // stop doing work for a peer the send queue limit is about to disconnect (or already has)
+        if (originating_peer->is_closing() || originating_peer->get_send_queue_size() > MAX_SEND_QUEUE_SIZE)
+        {
+          wlog("peer ${endpoint} is closing or has too much queued, not answering the rest of its batched request", 
+               ("endpoint", originating_peer->get_remote_endpoint()));
+          return;
+        }
+        item_id requested_item(fetch_items_message_received.item_type, item_hash);
+        message_ptr requested_message;
+        bool from_cache = true;
+        try
+        {
+          requested_message = _message_cache.get_message(item_hash);
+        }
+        catch (fc::key_not_found_exception&)
+        {
+          from_cache = false;
+          try
+          {
+            requested_message = std::make_shared<const message>(_delegate->get_item(requested_item));
+          }
+          catch (fc::key_not_found_exception&)
+          {
+          }
+        }
+        if (!requested_message || requested_message->msg_type != fetch_items_message_received.item_type)
+        {
+          originating_peer->send_message(item_not_available_message(requested_item));
+          continue;
+        }
+
+        std::vector<message_ptr>& items = from_cache ? cached_items : stored_items;
+        size_t& items_size = from_cache ? cached_items_size : stored_items_size;
+        // leave room for the length prefixes and the items_message header
+        if (!items.empty() && items_size + requested_message->size + 16 > MAX_MESSAGE_SIZE / 2)
+        {
+          if (from_cache)
+            originating_peer->send_urgent_message(pack_items_message(fetch_items_message_received.item_type, items));
+          else
+            originating_peer->send_message(pack_items_message(fetch_items_message_received.item_type, items));
+          items.clear();
+          items_size = 0;
+        }
+        items.push_back(requested_message);
+        items_size += requested_message->size + 16;
+      }
+      if (!cached_items.empty())
+        originating_peer->send_urgent_message(pack_items_message(fetch_items_message_received.item_type, cached_items));
+      if (!stored_items.empty())
+        originating_peer->send_message(pack_items_message(fetch_items_message_received.item_type, stored_items));
+    }
+
+    void node_impl::on_items_message(peer_connection* originating_peer, items_message& items_message_received)
+    {
+      // we only ever ask for blocks one at a time, they need the processing in on_message()
+      if (items_message_received.item_type == bts::client::block_message_type)
+      {
+        wlog("peer ${endpoint} sent us blocks in an items_message, disconnecting from peer", ("endpoint", originating_peer->get_remote_endpoint()));
+        disconnect_from_peer(originating_peer);
+        return;
+      }
+
+      for (std::vector<char>& item_data : items_message_received.items)
+      {
+        std::shared_ptr<message> item_message = std::make_shared<message>();
+        item_message->msg_type = items_message_received.item_type;
+        item_message->size = (uint32_t)item_data.size();
+        item_message->data = std::move(item_data);
+        process_ordinary_message(originating_peer, item_message, item_message->id());
+        if (_active_connections.find(originating_peer->shared_from_this()) == _active_connections.end())
+          break; // we disconnected from the peer because of that item
+      }
+    }
+
     void node_impl::on_item_not_available_message(peer_connection* originating_peer, const item_not_available_message& item_not_available_message_received)
     {
       auto regular_item_iter = originating_peer->items_requested_from_peer.find(item_not_available_message_received.requested_item);
       if (regular_item_iter != originating_peer->items_requested_from_peer.end())
       {
         originating_peer->items_requested_from_peer.erase(regular_item_iter);
+        originating_peer->compact_blocks_being_reconstructed.erase(item_not_available_message_received.requested_item.item_hash);
         ilog("Peer doesn't have the requested item.");
+        reschedule_item_fetch(item_not_available_message_received.requested_item, originating_peer);
         trigger_fetch_items_loop();
         return;
-        // TODO: reschedule fetching this item from a different peer
       }
 
       auto sync_item_iter = originating_peer->sync_items_requested_from_peer.find(item_not_available_message_received.requested_item);
       if (sync_item_iter != originating_peer->sync_items_requested_from_peer.end())
       {
         originating_peer->sync_items_requested_from_peer.erase(sync_item_iter);
+        _active_sync_requests.erase(item_not_available_message_received.requested_item.item_hash);
         ilog("Peer doesn't have the requested sync item.  This reqlly shouldn't happen");
         trigger_fetch_sync_items_loop();
         return;
@@ -1489,10 +2494,190 @@ namespace bts { namespace net {
       ilog("Peer doesn't have an item we're looking for, which is fine because we weren't looking for it");
     }
 
+    void node_impl::on_compact_block_message(peer_connection* originating_peer, const bts::client::compact_block_message& compact_block_message_received)
+    {
+      item_id block_item_id(bts::client::block_message_type, compact_block_message_received.block_message_hash);
+      if (originating_peer->items_requested_from_peer.find(block_item_id) == originating_peer->items_requested_from_peer.end() &&
+          !originating_peer->items_timed_out_from_peer.contains(block_item_id))
+      {
+        wlog("received a compact block I didn't ask for from peer ${endpoint}, disconnecting from peer", ("endpoint", originating_peer->get_remote_endpoint()));
+        disconnect_from_peer(originating_peer);
+        return;
+      }
+
+      partially_reconstructed_block incomplete_block;
+      incomplete_block.compact_block = compact_block_message_received;
+      incomplete_block.all_transactions_requested = false;
+      incomplete_block.transactions = _delegate->get_unconfirmed_transactions(compact_block_message_received.short_transaction_ids);
+      if (incomplete_block.transactions.size() != compact_block_message_received.short_transaction_ids.size())
+        incomplete_block.transactions.resize(compact_block_message_received.short_transaction_ids.size());
+      unsigned transactions_found = 0;
+      for (const fc::optional<bts::blockchain::signed_transaction>& transaction : incomplete_block.transactions)
+        if (transaction)
+          ++transactions_found;
+      ilog("received compact block ${id} from peer ${endpoint}, found ${found} of its ${count} transactions locally",
+           ("id", compact_block_message_received.block_id)("endpoint", originating_peer->get_remote_endpoint())
+           ("found", transactions_found)("count", incomplete_block.transactions.size()));
+
+      if (transactions_found == incomplete_block.transactions.size() &&
+          try_to_finish_compact_block(originating_peer, incomplete_block))
+        return;
+      // either we're missing transactions or a short id matched the wrong one, ask the peer
+      request_missing_compact_block_transactions(originating_peer, incomplete_block);
+    }
+
+    void node_impl::request_missing_compact_block_transactions(peer_connection* originating_peer, partially_reconstructed_block& incomplete_block)
+    {
+      std::vector<uint32_t> missing_indices;
+      for (uint32_t i = 0; i < incomplete_block.transactions.size(); ++i)
+        if (!incomplete_block.transactions[i])
+          missing_indices.push_back(i);
+      if (missing_indices.empty())
+      {
+        // we had them all but the block didn't match, so one of the short ids must have collided
+        for (uint32_t i = 0; i < incomplete_block.transactions.size(); ++i)
+          missing_indices.push_back(i);
+        incomplete_block.all_transactions_requested = true;
+      }
+      else if (missing_indices.size() == incomplete_block.transactions.size())
+        incomplete_block.all_transactions_requested = true;
+
+      item_hash_t block_message_hash = incomplete_block.compact_block.block_message_hash;
+      if (originating_peer->compact_blocks_being_reconstructed.size() >= MAX_COMPACT_BLOCKS_BEING_RECONSTRUCTED_PER_PEER &&
+          originating_peer->compact_blocks_being_reconstructed.find(block_message_hash) == originating_peer->compact_blocks_being_reconstructed.end())
+      {
+        wlog("already rebuilding ${count} compact blocks from peer ${endpoint}, fetching the full block instead",
+             ("count", originating_peer->compact_blocks_being_reconstructed.size())("endpoint", originating_peer->get_remote_endpoint()));
+        fetch_full_block_instead(originating_peer, block_message_hash);
+        return;
+      }
+      incomplete_block.last_request_time = fc::time_point::now();
+      originating_peer->compact_blocks_being_reconstructed[block_message_hash] = incomplete_block;
+      originating_peer->send_message(bts::client::fetch_compact_block_transactions_message(block_message_hash, missing_indices));
+    }
+
+    /**
+     *  Gives up on rebuilding a compact block and requests the block again from whichever 
+     *  peer that advertised it is free first.  A peer that already sent us the compact block
+     *  answers a second request with the full block.  If the original request's answer shows 
+     *  up later, it's still accepted.
+     */
+    void node_impl::fetch_full_block_instead(peer_connection* originating_peer, const item_hash_t& block_message_hash)
+    {
+      originating_peer->compact_blocks_being_reconstructed.erase(block_message_hash);
+      item_id block_item_id(bts::client::block_message_type, block_message_hash);
+      originating_peer->items_requested_from_peer.erase(block_item_id);
+      originating_peer->items_timed_out_from_peer.insert(block_item_id);
+      reschedule_item_fetch(block_item_id, nullptr);
+    }
+
+    /**
+     *  Rebuilds the block_message the peer would have sent us and, if it hashes to the id we
+     *  requested, processes it exactly as if the full block had arrived.
+     */
+    bool node_impl::try_to_finish_compact_block(peer_connection* originating_peer, const partially_reconstructed_block& block_to_finish)
+    {
+      bts::blockchain::full_block reconstructed_block;
+      (bts::blockchain::signed_block_header&)reconstructed_block = block_to_finish.compact_block.block_header;
+      reconstructed_block.user_transactions.reserve(block_to_finish.transactions.size());
+      for (const fc::optional<bts::blockchain::signed_transaction>& transaction : block_to_finish.transactions)
+      {
+        if (!transaction)
+          return false;
+        reconstructed_block.user_transactions.push_back(*transaction);
+      }
+
+      bts::client::block_message reconstructed_block_message(reconstructed_block);
+      if (reconstructed_block_message.block_id != block_to_finish.compact_block.block_id)
+        return false;
+      std::shared_ptr<message> reconstructed_message = std::make_shared<message>(reconstructed_block_message);
+      if (reconstructed_message->id() != block_to_finish.compact_block.block_message_hash)
+        return false;
+
+      item_hash_t block_message_hash = block_to_finish.compact_block.block_message_hash;
+      originating_peer->compact_blocks_being_reconstructed.erase(block_message_hash);
+      on_message(originating_peer, reconstructed_message);
+      return true;
+    }
+
+    void node_impl::on_fetch_compact_block_transactions_message(peer_connection* originating_peer, 
+                                                                const bts::client::fetch_compact_block_transactions_message& fetch_compact_block_transactions_message_received)
+    {
+      item_id block_item_id(bts::client::block_message_type, fetch_compact_block_transactions_message_received.block_message_hash);
+      bts::client::block_message requested_block_message;
+      try
+      {
+        requested_block_message = _message_cache.get_message(fetch_compact_block_transactions_message_received.block_message_hash)->as<bts::client::block_message>();
+      }
+      catch (fc::key_not_found_exception&)
+      {
+        ilog("peer ${endpoint} asked for transactions of a compact block we no longer have", ("endpoint", originating_peer->get_remote_endpoint()));
+        originating_peer->send_message(item_not_available_message(block_item_id));
+        return;
+      }
+
+      bts::client::compact_block_transactions_message reply;
+      reply.block_message_hash = fetch_compact_block_transactions_message_received.block_message_hash;
+      const bts::blockchain::signed_transactions& block_transactions = requested_block_message.block.user_transactions;
+      for (uint32_t index : fetch_compact_block_transactions_message_received.indices)
+        if (index < block_transactions.size())
+        {
+          reply.indices.push_back(index);
+          reply.transactions.push_back(block_transactions[index]);
+        }
+      originating_peer->send_urgent_message(reply);
+    }
+
+    void node_impl::on_compact_block_transactions_message(peer_connection* originating_peer, 
+                                                          const bts::client::compact_block_transactions_message& compact_block_transactions_message_received)
+    {
+      auto iter = originating_peer->compact_blocks_being_reconstructed.find(compact_block_transactions_message_received.block_message_hash);
+      if (iter == originating_peer->compact_blocks_being_reconstructed.end())
+      {
+        wlog("received transactions for a compact block we weren't reconstructing from peer ${endpoint}", ("endpoint", originating_peer->get_remote_endpoint()));
+        return;
+      }
+
+      partially_reconstructed_block& incomplete_block = iter->second;
+      if (compact_block_transactions_message_received.indices.size() != compact_block_transactions_message_received.transactions.size())
+      {
+        wlog("peer ${endpoint} sent a malformed compact block transactions message, disconnecting", ("endpoint", originating_peer->get_remote_endpoint()));
+        disconnect_from_peer(originating_peer);
+        return;
+      }
+      for (unsigned i = 0; i < compact_block_transactions_message_received.indices.size(); ++i)
+      {
+        uint32_t index = compact_block_transactions_message_received.indices[i];
+        if (index < incomplete_block.transactions.size())
+          incomplete_block.transactions[index] = compact_block_transactions_message_received.transactions[i];
+      }
+
+      if (try_to_finish_compact_block(originating_peer, incomplete_block))
+        return;
+
+      if (!incomplete_block.all_transactions_requested)
+      {
+        for (fc::optional<bts::blockchain::signed_transaction>& transaction : incomplete_block.transactions)
+          transaction.reset();
+        request_missing_compact_block_transactions(originating_peer, incomplete_block);
+        return;
+      }
+
+      wlog("peer ${endpoint} sent us transactions that don't match its compact block, disconnecting", ("endpoint", originating_peer->get_remote_endpoint()));
+      originating_peer->compact_blocks_being_reconstructed.erase(iter);
+      disconnect_from_peer(originating_peer);
+    }
+
     void node_impl::on_item_ids_inventory_message(peer_connection* originating_peer, const item_ids_inventory_message& item_ids_inventory_message_received)
     {
       ilog("received inventory of ${count} items from peer ${endpoint}", 
            ("count", item_ids_inventory_message_received.item_hashes_available.size())("endpoint", originating_peer->get_remote_endpoint()));
+
+      // make room for the new items by dropping the ones we've fetched from other peers since
+      if (originating_peer->items_to_fetch_from_peer.size() + item_ids_inventory_message_received.item_hashes_available.size() > MAX_INVENTORY_ITEMS_TRACKED_PER_PEER)
+        prune_items_to_fetch_from_peer(originating_peer);
+
+      unsigned items_ignored = 0;
       for (const item_hash_t& item_hash : item_ids_inventory_message_received.item_hashes_available)
       {
         item_id advertised_item_id(item_ids_inventory_message_received.item_type, item_hash);
@@ -1500,7 +2685,7 @@ namespace bts { namespace net {
         bool we_requested_this_item_from_a_peer = false;
         for (const peer_connection_ptr peer : _active_connections)
         {
-          if (peer->inventory_advertised_to_peer.find(advertised_item_id) != peer->inventory_advertised_to_peer.end())
+          if (peer->inventory_advertised_to_peer.contains(advertised_item_id))
           {
             we_advertised_this_item_to_a_peer = true;
             break;
@@ -1513,19 +2698,26 @@ namespace bts { namespace net {
         if (!we_advertised_this_item_to_a_peer)
         {
           originating_peer->inventory_peer_advertised_to_us.insert(advertised_item_id);
-          if (!we_requested_this_item_from_a_peer)
+          if (originating_peer->items_to_fetch_from_peer.size() >= MAX_INVENTORY_ITEMS_TRACKED_PER_PEER)
+            ++items_ignored;
+          else if (!we_requested_this_item_from_a_peer)
           {
+            originating_peer->items_to_fetch_from_peer.push_back(advertised_item_id);
             auto insert_result = _items_to_fetch.push_back(advertised_item_id);
             if (insert_result.second)
             {
+              _first_advertised_times.insert(std::make_pair(advertised_item_id, fc::time_point::now()));
               ilog("addinged item ${item_hash} from inventory message to our list of items to fetch",
                    ("item_hash", item_hash));
-              trigger_fetch_items_loop();
             }
+            if (originating_peer->idle())
+              trigger_fetch_items_loop();
           }
         }
       }
-      
+      if (items_ignored)
+        wlog("peer ${endpoint} has advertised too many items we haven't fetched yet, ignored ${count} of them",
+             ("endpoint", originating_peer->get_remote_endpoint())("count", items_ignored));
     }
 
     void node_impl::on_connection_closed(peer_connection* originating_peer)
@@ -1538,194 +2730,314 @@ namespace bts { namespace net {
       else if (_handshaking_connections.find(originating_peer_ptr) != _handshaking_connections.end())
         _handshaking_connections.erase(originating_peer_ptr);
       ilog("Remote peer ${endpoint} closed their connection to us", ("endpoint", originating_peer->get_remote_endpoint()));
+
+      // remember how well this peer served us, so we can prefer fast peers next time we connect
+      fc::optional<fc::ip::endpoint> peer_endpoint = get_peer_database_endpoint(originating_peer);
+      if (peer_endpoint && originating_peer->average_item_latency.count() != 0)
+      {
+        potential_peer_record updated_peer_record = _potential_peer_db.lookup_or_create_entry_for_endpoint(*peer_endpoint);
+        updated_peer_record.average_item_latency_ms = (uint32_t)std::max<int64_t>(originating_peer->average_item_latency.count() / 1000, 1);
+        updated_peer_record.average_item_throughput = (uint32_t)std::min<uint64_t>(originating_peer->average_item_throughput, std::numeric_limits<uint32_t>::max());
+        _potential_peer_db.update_entry(updated_peer_record);
+      }
+
+      // ask other peers for anything this peer never sent us
+      for (const auto& item_and_time : originating_peer->items_requested_from_peer)
+        reschedule_item_fetch(item_and_time.first, originating_peer);
+      originating_peer->items_requested_from_peer.clear();
+
+      // forget items that only this peer offered us
+      for (const item_id& item_to_fetch : originating_peer->items_to_fetch_from_peer)
+      {
+        bool item_available_elsewhere = false;
+        for (const peer_connection_ptr& peer : _active_connections)
+          if (peer->inventory_peer_advertised_to_us.contains(item_to_fetch))
+          {
+            item_available_elsewhere = true;
+            break;
+          }
+        if (!item_available_elsewhere)
+        {
+          _items_to_fetch.get<1>().erase(item_to_fetch);
+          _first_advertised_times.erase(item_to_fetch);
+        }
+      }
+      originating_peer->items_to_fetch_from_peer.clear();
+
+      // let other peers pick up any sync requests this peer never answered
+      if (!originating_peer->sync_items_requested_from_peer.empty())
+      {
+        for (const auto& sync_item_and_time : originating_peer->sync_items_requested_from_peer)
+          _active_sync_requests.erase(sync_item_and_time.first.item_hash);
+        originating_peer->sync_items_requested_from_peer.clear();
+        trigger_fetch_sync_items_loop();
+      }
+      originating_peer->sync_items_timed_out_from_peer.clear();
       display_current_connections();
       trigger_p2p_network_connect_loop();
     }
 
+    /**
+     *  Returns the block in the backlog that we can hand to the client next, if we have it.
+     *  That's the block following the one we just accepted, or failing that the first block
+     *  on any peer's list of items to get.  Both are hash lookups.
+     */
+    received_sync_items_container::iterator node_impl::find_next_sync_block_in_backlog(const fc::optional<bts::blockchain::block_id_type>& last_block_accepted)
+    {
+      auto& items_by_block_id = _received_sync_items.get<received_sync_item_block_id_index>();
+      if (last_block_accepted)
+      {
+        auto& items_by_previous_id = _received_sync_items.get<received_sync_item_previous_id_index>();
+        auto range = items_by_previous_id.equal_range(*last_block_accepted);
+        for (auto iter = range.first; iter != range.second; ++iter)
+          for (const peer_connection_ptr& peer : _active_connections)
+            if (!peer->ids_of_items_to_get.empty() && peer->ids_of_items_to_get.front() == iter->block_id)
+              return _received_sync_items.project<received_sync_item_block_id_index>(iter);
+      }
+      for (const peer_connection_ptr& peer : _active_connections)
+        if (!peer->ids_of_items_to_get.empty())
+        {
+          auto iter = items_by_block_id.find(peer->ids_of_items_to_get.front());
+          if (iter != items_by_block_id.end())
+            return iter;
+        }
+      return items_by_block_id.end();
+    }
+
+    /** removes the blocks in the backlog that build on a block the client rejected, they can never be applied */
+    void node_impl::purge_descendants_from_sync_backlog(const bts::blockchain::block_id_type& rejected_block_id)
+    {
+      auto& items_by_previous_id = _received_sync_items.get<received_sync_item_previous_id_index>();
+      std::vector<bts::blockchain::block_id_type> rejected_block_ids(1, rejected_block_id);
+      while (!rejected_block_ids.empty())
+      {
+        bts::blockchain::block_id_type parent_id = rejected_block_ids.back();
+        rejected_block_ids.pop_back();
+        auto range = items_by_previous_id.equal_range(parent_id);
+        for (auto iter = range.first; iter != range.second; )
+        {
+          wlog("discarding sync block ${block_id} because it builds on rejected block ${parent_id}", ("block_id", iter->block_id)("parent_id", parent_id));
+          rejected_block_ids.push_back(iter->block_id);
+          _received_sync_items_size_in_bytes -= iter->size_in_bytes;
+          iter = items_by_previous_id.erase(iter);
+        }
+      }
+    }
+
     void node_impl::process_backlog_of_sync_blocks()
     {
+      fc::optional<bts::blockchain::block_id_type> last_block_accepted;
       bool block_processed_this_iteration;
       do
       {
         block_processed_this_iteration = false;
-        for (auto received_block_iter = _received_sync_items.begin(); 
-             received_block_iter != _received_sync_items.end(); 
-             ++received_block_iter)
+        auto received_block_iter = find_next_sync_block_in_backlog(last_block_accepted);
+        if (received_block_iter != _received_sync_items.get<received_sync_item_block_id_index>().end())
         {
-          // find out if this block is the next block that we can hand directly to the client
-          bool potential_first_block = false;
-          for (const peer_connection_ptr& peer : _active_connections)
-            if (!peer->ids_of_items_to_get.empty() &&
-                peer->ids_of_items_to_get.front() == received_block_iter->block_id)
+          // this block is the next block that we can hand directly to the client, 
+          // process it, remove it from all sync peers lists
+          message_ptr block_message_to_process = received_block_iter->block_message;
+          bts::blockchain::block_id_type block_id_to_process = received_block_iter->block_id;
+          _received_sync_items_size_in_bytes -= received_block_iter->size_in_bytes;
+          _received_sync_items.get<received_sync_item_block_id_index>().erase(received_block_iter);
+
+          bool client_accepted_block = false;
+          try
+          {
+            ilog("sync: this block is a potential first block, passing it to the client");
+
+            // we can get into an intersting situation near the end of synchronization.  We can be in
+            // sync with one peer who is sending us the last block on the chain via a regular inventory
+            // message, while at the same time still be synchronizing with a peer who is sending us the
+            // block through the sync mechanism.  Further, we must request both blocks because 
+            // we don't know they're the same (for the peer in normal operation, it has only told us the
+            // message id, for the peer in the sync case we only known the block_id).
+            if (std::find(_most_recent_blocks_accepted.begin(), _most_recent_blocks_accepted.end(),
+                          block_id_to_process) == _most_recent_blocks_accepted.end())
             {
-              potential_first_block = true;
-              break;
+              _delegate->handle_message(*block_message_to_process);
+              // TODO: only record as accepted if it has a valid signature.
+              _most_recent_blocks_accepted.push_back(block_id_to_process);
             }
+            else
+              ilog("Already received and accepted this block (presumably through normal inventory mechanism), treating it as accepted");
 
-          // if it is, process it, remove it from all sync peers lists
-          if (potential_first_block)
+            client_accepted_block = true;
+          }
+          catch (fc::exception&)
           {
-            bts::client::block_message block_message_to_process = *received_block_iter;
-            _received_sync_items.erase(received_block_iter);
+            wlog("sync: client rejected sync block sent by peer");
+          }
 
-            bool client_accepted_block = false;
-            try
+          if (client_accepted_block)
+          {
+            --_total_number_of_unfetched_items;
+            block_processed_this_iteration = true;
+            last_block_accepted = block_id_to_process;
+            ilog("sync: client accpted the block, we now have only ${count} items left to fetch before we're in sync", ("count", _total_number_of_unfetched_items));
+            std::set<peer_connection_ptr> peers_with_newly_empty_item_lists;
+            std::set<peer_connection_ptr> peers_we_need_to_sync_to;
+            for (const peer_connection_ptr& peer : _active_connections)
             {
-              ilog("sync: this block is a potential first block, passing it to the client");
-
-              // we can get into an intersting situation near the end of synchronization.  We can be in
-              // sync with one peer who is sending us the last block on the chain via a regular inventory
-              // message, while at the same time still be synchronizing with a peer who is sending us the
-              // block through the sync mechanism.  Further, we must request both blocks because 
-              // we don't know they're the same (for the peer in normal operation, it has only told us the
-              // message id, for the peer in the sync case we only known the block_id).
-              if (std::find(_most_recent_blocks_accepted.begin(), _most_recent_blocks_accepted.end(),
-                            block_message_to_process.block_id) == _most_recent_blocks_accepted.end())
+              if (peer->ids_of_items_to_get.empty())
               {
-                _delegate->handle_message(block_message_to_process);
-                // TODO: only record as accepted if it has a valid signature.
-                _most_recent_blocks_accepted.push_back(block_message_to_process.block_id);
+                ilog("Cannot pop first element off peer ${peer}'s list, its list is empty", ("peer", peer->get_remote_endpoint()));
+                // we don't know for sure that this peer has the item we just received.
+                // If peer is still syncing to us, we know they will ask us for
+                // sync item ids at least one more time and we'll notify them about
+                // the item then, so there's no need to do anything.  If we still need items
+                // from them, we'll be asking them for more items at some point, and
+                // that will clue them in that they are out of sync.  If we're fully in sync 
+                // we need to kick off another round of synchronization with them so they can 
+                // find out about the new item.
+                if (!peer->peer_needs_sync_items_from_us && !peer->we_need_sync_items_from_peer)
+                {
+                  ilog("We will be restarting synchronization with peer ${peer}", ("peer", peer->get_remote_endpoint()));
+                  peers_we_need_to_sync_to.insert(peer);
+                }
               }
               else
-                ilog("Already received and accepted this block (presumably through normal inventory mechanism), treating it as accepted");
-
-              client_accepted_block = true;
-            }
-            catch (fc::exception&)
-            {
-              wlog("sync: client rejected sync block sent by peer");
-            }
-
-            if (client_accepted_block)
-            {
-              --_total_number_of_unfetched_items;
-              block_processed_this_iteration = true;
-              ilog("sync: client accpted the block, we now have only ${count} items left to fetch before we're in sync", ("count", _total_number_of_unfetched_items));
-              std::set<peer_connection_ptr> peers_with_newly_empty_item_lists;
-              std::set<peer_connection_ptr> peers_we_need_to_sync_to;
-              for (const peer_connection_ptr& peer : _active_connections)
               {
-                if (peer->ids_of_items_to_get.empty())
+                if (peer->ids_of_items_to_get.front() == block_id_to_process)
                 {
-                  ilog("Cannot pop first element off peer ${peer}'s list, its list is empty", ("peer", peer->get_remote_endpoint()));
-                  // we don't know for sure that this peer has the item we just received.
-                  // If peer is still syncing to us, we know they will ask us for
-                  // sync item ids at least one more time and we'll notify them about
-                  // the item then, so there's no need to do anything.  If we still need items
-                  // from them, we'll be asking them for more items at some point, and
-                  // that will clue them in that they are out of sync.  If we're fully in sync 
-                  // we need to kick off another round of synchronization with them so they can 
-                  // find out about the new item.
-                  if (!peer->peer_needs_sync_items_from_us && !peer->we_need_sync_items_from_peer)
-                  {
-                    ilog("We will be restarting synchronization with peer ${peer}", ("peer", peer->get_remote_endpoint()));
-                    peers_we_need_to_sync_to.insert(peer);
-                  }
+                  peer->ids_of_items_to_get.pop_front();
+                  ilog("Popped item from front of ${endpoint}'s sync list, new list length is ${len}", ("endpoint", peer->get_remote_endpoint())("len", peer->ids_of_items_to_get.size()));
+
+                  // if we just received the last item in our list from this peer, we will want to 
+                  // send another request to find out if we are in sync, but we can't do this yet
+                  // (we don't want to allow a fiber swap in the middle of popping items off the list)
+                  if (peer->ids_of_items_to_get.empty() && peer->number_of_unfetched_item_ids == 0)
+                    peers_with_newly_empty_item_lists.insert(peer);
+
+                  // in this case, we know the peer was offering us this exact item, no need to 
+                  // try to inform them of its existence
                 }
                 else
                 {
-                  if (peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
-                  {
-                    peer->ids_of_items_to_get.pop_front();
-                    ilog("Popped item from front of ${endpoint}'s sync list, new list length is ${len}", ("endpoint", peer->get_remote_endpoint())("len", peer->ids_of_items_to_get.size()));
-
-                    // if we just received the last item in our list from this peer, we will want to 
-                    // send another request to find out if we are in sync, but we can't do this yet
-                    // (we don't want to allow a fiber swap in the middle of popping items off the list)
-                    if (peer->ids_of_items_to_get.empty() && peer->number_of_unfetched_item_ids == 0)
-                      peers_with_newly_empty_item_lists.insert(peer);
-
-                    // in this case, we know the peer was offering us this exact item, no need to 
-                    // try to inform them of its existence
-                  }
-                  else
-                  {
-                    // the peer's list of sync items is nonempty, and its first item doesn't match
-                    // the one we just accepted.
-                    // 
-                    // This probably means that this peer is offering us garbage (its blockchain
-                    // should match everyone else's blockchain).  We could see this during a fork,
-                    // though.  I'm not certain if we've settled on what a fork looks like at this
-                    // level, so I'm just leaving the peer connected here.  If it turns out
-                    // that forks are impossible or won't effect sync behavior, we should disconnect 
-                    // the offending peer here.
-                    ilog("Cannot pop first element off peer ${peer}'s list, its first is ${hash}", ("peer", peer->get_remote_endpoint())("hash", peer->ids_of_items_to_get.front()));
-                  }
+                  // the peer's list of sync items is nonempty, and its first item doesn't match
+                  // the one we just accepted.
+                  // 
+                  // This probably means that this peer is offering us garbage (its blockchain
+                  // should match everyone else's blockchain).  We could see this during a fork,
+                  // though.  I'm not certain if we've settled on what a fork looks like at this
+                  // level, so I'm just leaving the peer connected here.  If it turns out
+                  // that forks are impossible or won't effect sync behavior, we should disconnect 
+                  // the offending peer here.
+                  ilog("Cannot pop first element off peer ${peer}'s list, its first is ${hash}", ("peer", peer->get_remote_endpoint())("hash", peer->ids_of_items_to_get.front()));
                 }
               }
-              for (const peer_connection_ptr& peer : peers_with_newly_empty_item_lists)
-                fetch_next_batch_of_item_ids_from_peer(peer.get(), item_id(bts::client::block_message_type, block_message_to_process.block_id));
-
-              for (const peer_connection_ptr& peer : peers_we_need_to_sync_to)
-                start_synchronizing_with_peer(peer);
             }
-            else
-            {
-              // invalid message received
-              std::list<peer_connection_ptr> peers_to_disconnect;
-              for (const peer_connection_ptr& peer : _active_connections)
-                if (!peer->ids_of_items_to_get.empty() &&
-                    peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
-                  peers_to_disconnect.push_back(peer);
-              for (const peer_connection_ptr& peer : peers_to_disconnect)
-              {
-                wlog("disconnecting client ${endpoint} because it offered us the rejected block", ("endpoint", peer->get_remote_endpoint()));
-                disconnect_from_peer(peer.get());
-              }
-              break;
-            }              
+            for (const peer_connection_ptr& peer : peers_with_newly_empty_item_lists)
+              fetch_next_batch_of_item_ids_from_peer(peer.get(), item_id(bts::client::block_message_type, block_id_to_process));
 
-            break; // start iterating _received_sync_items from the beginning
-          } // end if potential_first_block
-        } // end for each block in _received_sync_items
+            for (const peer_connection_ptr& peer : peers_we_need_to_sync_to)
+              start_synchronizing_with_peer(peer);
+          }
+          else
+          {
+            // invalid message received
+            std::list<peer_connection_ptr> peers_to_disconnect;
+            for (const peer_connection_ptr& peer : _active_connections)
+              if (!peer->ids_of_items_to_get.empty() &&
+                  peer->ids_of_items_to_get.front() == block_id_to_process)
+                peers_to_disconnect.push_back(peer);
+            for (const peer_connection_ptr& peer : peers_to_disconnect)
+            {
+              wlog("disconnecting client ${endpoint} because it offered us the rejected block", ("endpoint", peer->get_remote_endpoint()));
+              disconnect_from_peer(peer.get());
+            }
+            purge_descendants_from_sync_backlog(block_id_to_process);
+          }
+        }
       } while (block_processed_this_iteration);
-      ilog("Currently backlog is ${count} blocks", ("count", _received_sync_items.size()));
+      ilog("Currently backlog is ${count} blocks (${bytes} bytes)", ("count", _received_sync_items.size())("bytes", _received_sync_items_size_in_bytes));
     }
 
-    void node_impl::process_block_during_sync(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash)
+    void node_impl::process_block_during_sync(peer_connection* originating_peer, const message_ptr& message_to_process, const message_hash_type& message_hash)
     {
       assert(originating_peer->we_need_sync_items_from_peer);
-      assert(message_to_process.msg_type == bts::client::message_type_enum::block_message_type);
-      bts::client::block_message block_message_to_process(message_to_process.as<bts::client::block_message>());
+      assert(message_to_process->msg_type == bts::client::message_type_enum::block_message_type);
+      bts::client::block_message_header block_header_to_process(bts::client::block_message_header::peek(*message_to_process));
       
       // only process it if we asked for it
-      auto iter = originating_peer->sync_items_requested_from_peer.find(item_id(bts::client::block_message_type, block_message_to_process.block_id));
-      if (iter == originating_peer->sync_items_requested_from_peer.end())
+      item_id block_item_id(bts::client::block_message_type, block_header_to_process.block_id);
+      auto iter = originating_peer->sync_items_requested_from_peer.find(block_item_id);
+      auto timed_out_iter = originating_peer->sync_items_timed_out_from_peer.find(block_item_id);
+      if (iter == originating_peer->sync_items_requested_from_peer.end() &&
+          timed_out_iter == originating_peer->sync_items_timed_out_from_peer.end())
       {
         wlog("received a sync block ${block_id} I didn't ask for from peer ${endpoint}, disconnecting from peer", 
              ("endpoint", originating_peer->get_remote_endpoint())
-             ("block_id",block_message_to_process.block_id));
+             ("block_id",block_header_to_process.block_id));
         disconnect_from_peer(originating_peer);
         return;
       }
       else
       {
         ilog("received a sync block from peer ${endpoint}", ("endpoint", originating_peer->get_remote_endpoint()));
-        originating_peer->sync_items_requested_from_peer.erase(iter);
+        if (iter != originating_peer->sync_items_requested_from_peer.end())
+        {
+          originating_peer->record_item_received(fc::time_point::now() - iter->second, message_to_process->size);
+          originating_peer->sync_items_requested_from_peer.erase(iter);
+          _active_sync_requests.erase(block_header_to_process.block_id);
+        }
+        else
+        {
+          originating_peer->record_item_received(fc::time_point::now() - timed_out_iter->second, message_to_process->size);
+          originating_peer->sync_items_timed_out_from_peer.erase(timed_out_iter);
+        }
+      }
+
+      // a request that timed out may have been answered by two peers, or answered after we
+      // got the block elsewhere.  Only keep the first copy of each block we asked for
+      if (_sync_items_outstanding.erase(block_header_to_process.block_id) == 0 ||
+          have_already_received_sync_item(block_header_to_process.block_id))
+      {
+        ilog("discarding duplicate sync block ${block_id}", ("block_id", block_header_to_process.block_id));
+        trigger_fetch_sync_items_loop();
+        return;
+      }
+
+      // start the expensive, order-independent checks now so they overlap with
+      // the client applying the blocks that come before this one
+      try
+      {
+        _delegate->prevalidate_message(*message_to_process);
+      }
+      catch (const fc::exception& e)
+      {
+        wlog("client was unable to prevalidate sync block ${block_id}: ${e}", ("block_id", block_header_to_process.block_id)("e", e.to_string()));
       }
 
-      // add it to the front of _received_sync_items, then process _received_sync_items to try to 
+      // add it to _received_sync_items, then process _received_sync_items to try to 
       // pass as many messages as possible to the client.
-      _received_sync_items.push_front(block_message_to_process);
+      if (_average_sync_block_size == 0)
+        _average_sync_block_size = message_to_process->size;
+      else
+        _average_sync_block_size = (_average_sync_block_size * 7 + message_to_process->size) / 8;
+      if (_received_sync_items.insert(received_sync_item(message_to_process, block_header_to_process)).second)
+        _received_sync_items_size_in_bytes += message_to_process->size;
       process_backlog_of_sync_blocks();
 
       // we should be ready to request another block now
       trigger_fetch_sync_items_loop();
     }
 
-    void node_impl::process_block_during_normal_operation(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash)
+    void node_impl::process_block_during_normal_operation(peer_connection* originating_peer, const message_ptr& message_to_process, const message_hash_type& message_hash)
     {
       fc::time_point message_receive_time = fc::time_point::now();
 
       dump_node_status();
 
       assert(!originating_peer->we_need_sync_items_from_peer);
-      assert(message_to_process.msg_type == bts::client::message_type_enum::block_message_type);
-      bts::client::block_message block_message_to_process(message_to_process.as<bts::client::block_message>());
+      assert(message_to_process->msg_type == bts::client::message_type_enum::block_message_type);
+      bts::client::block_message_header block_header_to_process(bts::client::block_message_header::peek(*message_to_process));
       
       // only process it if we asked for it
-      auto iter = originating_peer->items_requested_from_peer.find(item_id(bts::client::block_message_type, message_hash));
-      if (iter == originating_peer->items_requested_from_peer.end())
+      item_id block_item_id(bts::client::block_message_type, message_hash);
+      auto iter = originating_peer->items_requested_from_peer.find(block_item_id);
+      if (iter == originating_peer->items_requested_from_peer.end() &&
+          !originating_peer->items_timed_out_from_peer.contains(block_item_id))
       {
         wlog("received a block I didn't ask for from peer ${endpoint}, disconnecting from peer", ("endpoint", originating_peer->get_remote_endpoint()));
         disconnect_from_peer(originating_peer);
@@ -1734,7 +3046,14 @@ namespace bts { namespace net {
       else
       {
         ilog("received a block from peer ${endpoint}, passing it to client", ("endpoint", originating_peer->get_remote_endpoint()));
-        originating_peer->items_requested_from_peer.erase(iter);
+        if (iter != originating_peer->items_requested_from_peer.end())
+        {
+          originating_peer->record_item_received(message_receive_time - iter->second, message_to_process->size);
+          _request_to_receive_latency[message_to_process->msg_type].record(message_receive_time - iter->second);
+          originating_peer->items_requested_from_peer.erase(iter);
+        }
+        else
+          originating_peer->items_timed_out_from_peer.erase(block_item_id);
         trigger_fetch_items_loop();
 
         try
@@ -1747,12 +3066,12 @@ namespace bts { namespace net {
           // message id, for the peer in the sync case we only known the block_id).
           fc::time_point message_validated_time;
           if (std::find(_most_recent_blocks_accepted.begin(), _most_recent_blocks_accepted.end(), 
-                        block_message_to_process.block_id) == _most_recent_blocks_accepted.end())
+                        block_header_to_process.block_id) == _most_recent_blocks_accepted.end())
           {
-            _delegate->handle_message(block_message_to_process);
+            _delegate->handle_message(*message_to_process);
             message_validated_time = fc::time_point::now();
             // TODO: only record it as accepted if it has a valid signature.
-            _most_recent_blocks_accepted.push_back(block_message_to_process.block_id);
+            _most_recent_blocks_accepted.push_back(block_header_to_process.block_id);
           }
           else
             ilog("Already received and accepted this block (presumably through sync mechanism), treating it as accepted");
@@ -1762,17 +3081,18 @@ namespace bts { namespace net {
           for (const peer_connection_ptr& peer : _active_connections)
           {
             item_id block_message_item_id(bts::client::message_type_enum::block_message_type, message_hash);
-            auto iter = peer->inventory_peer_advertised_to_us.find(block_message_item_id);
-            if (iter != peer->inventory_peer_advertised_to_us.end())
+            if (peer->inventory_peer_advertised_to_us.contains(block_message_item_id))
             {
               // this peer offered us the item; remove it from the list of items they offered us, and 
               // add it to the list of items we've offered them.  That will prevent us from offering them
               // the same item back (no reason to do that; we already know they have it)
-              peer->inventory_peer_advertised_to_us.erase(iter);
+              peer->inventory_peer_advertised_to_us.erase(block_message_item_id);
               peer->inventory_advertised_to_peer.insert(block_message_item_id);
             }
           }
           message_propagation_data propagation_data{message_receive_time, message_validated_time, originating_peer->node_id};
+          if (message_validated_time != fc::time_point())
+            record_item_propagation(originating_peer, bts::client::block_message_type, propagation_data);
           broadcast(message_to_process, propagation_data);
           _message_cache.block_accepted();
         }
@@ -1783,7 +3103,7 @@ namespace bts { namespace net {
           std::list<peer_connection_ptr> peers_to_disconnect;
           for (const peer_connection_ptr& peer : _active_connections)
             if (!peer->ids_of_items_to_get.empty() &&
-                peer->ids_of_items_to_get.front() == block_message_to_process.block_id)
+                peer->ids_of_items_to_get.front() == block_header_to_process.block_id)
               peers_to_disconnect.push_back(peer);
           for (const peer_connection_ptr& peer : peers_to_disconnect)
           {
@@ -1799,13 +3119,15 @@ namespace bts { namespace net {
     // messages.  (transaction messages would be handled here, for example)
     // this just passes the message to the client, and does the bookkeeping 
     // related to requesting and rebroadcasting the message.
-    void node_impl::process_ordinary_message(peer_connection* originating_peer, const message& message_to_process, const message_hash_type& message_hash)
+    void node_impl::process_ordinary_message(peer_connection* originating_peer, const message_ptr& message_to_process, const message_hash_type& message_hash)
     {
       fc::time_point message_receive_time = fc::time_point::now();
 
       // only process it if we asked for it
-      auto iter = originating_peer->items_requested_from_peer.find(item_id(message_to_process.msg_type, message_hash));
-      if (iter == originating_peer->items_requested_from_peer.end())
+      item_id message_item_id(message_to_process->msg_type, message_hash);
+      auto iter = originating_peer->items_requested_from_peer.find(message_item_id);
+      if (iter == originating_peer->items_requested_from_peer.end() &&
+          !originating_peer->items_timed_out_from_peer.contains(message_item_id))
       {
         wlog("received a message I didn't ask for from peer ${endpoint}, disconnecting from peer", 
              ("endpoint", originating_peer->get_remote_endpoint()));
@@ -1814,14 +3136,21 @@ namespace bts { namespace net {
       }
       else
       {
-        originating_peer->items_requested_from_peer.erase(iter);
+        if (iter != originating_peer->items_requested_from_peer.end())
+        {
+          originating_peer->record_item_received(message_receive_time - iter->second, message_to_process->size);
+          _request_to_receive_latency[message_to_process->msg_type].record(message_receive_time - iter->second);
+          originating_peer->items_requested_from_peer.erase(iter);
+        }
+        else
+          originating_peer->items_timed_out_from_peer.erase(message_item_id);
         trigger_fetch_items_loop();
 
         // Next: have the delegate process the message
         fc::time_point message_validated_time;
         try
         {
-          _delegate->handle_message(message_to_process);
+          _delegate->handle_message(*message_to_process);
           message_validated_time = fc::time_point::now();
         }
         catch (fc::exception& e)
@@ -1832,6 +3161,7 @@ namespace bts { namespace net {
 
         // finally, if the delegate validated the message, broadcast it to our other peers
         message_propagation_data propagation_data{message_receive_time, message_validated_time, originating_peer->node_id};
+        record_item_propagation(originating_peer, message_to_process->msg_type, propagation_data);
         broadcast(message_to_process, propagation_data);
       }
     }
@@ -1849,8 +3179,32 @@ namespace bts { namespace net {
         start_synchronizing_with_peer(peer);
     }
 
+    fc::optional<fc::ip::endpoint> node_impl::get_peer_database_endpoint(peer_connection* peer)
+    {
+      if (peer->direction == peer_connection_direction::inbound)
+        return peer->inbound_endpoint;
+      return peer->get_remote_endpoint();
+    }
+
+    void node_impl::configure_peer_connection(const peer_connection_ptr& peer)
+    {
+      peer->set_upload_rate_limit(_maximum_upload_rate_per_peer);
+      peer->set_shared_upload_rate_limit(_total_upload_limit);
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      peer->set_simulated_network_conditions(_simulated_latency, _simulated_loss_rate, _simulated_loss_seed + _simulated_connections_configured++);
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+    }
+
     void node_impl::new_peer_just_added(const peer_connection_ptr& peer)
     {
+      // start from what we measured the last time we were connected to this peer
+      fc::optional<fc::ip::endpoint> peer_endpoint = get_peer_database_endpoint(peer.get());
+      if (peer_endpoint)
+      {
+        potential_peer_record peer_record = _potential_peer_db.lookup_or_create_entry_for_endpoint(*peer_endpoint);
+        peer->average_item_latency = fc::milliseconds(peer_record.average_item_latency_ms);
+        peer->average_item_throughput = peer_record.average_item_throughput;
+      }
       start_synchronizing_with_peer(peer);
       _delegate->connection_count_changed(_active_connections.size());
     }
@@ -1863,6 +3217,18 @@ namespace bts { namespace net {
         _accept_loop_complete.cancel();
         _accept_loop_complete.wait();
       }
+
+      // stop the tasks that call into the delegate.  They may be blocked, so we don't wait 
+      // for them here, detaching the delegate keeps them from reaching the client
+      for (fc::future<void>* loop_done : {&_p2p_network_connect_loop_done, &_fetch_sync_items_loop_done, &_fetch_item_loop_done,
+                                          &_advertise_inventory_loop_done, &_terminate_inactive_connections_loop_done})
+        if (loop_done->valid() && !loop_done->ready())
+          loop_done->cancel();
+
+      std::list<peer_connection_ptr> peers_to_disconnect(_handshaking_connections.begin(), _handshaking_connections.end());
+      peers_to_disconnect.insert(peers_to_disconnect.end(), _active_connections.begin(), _active_connections.end());
+      for (const peer_connection_ptr& peer : peers_to_disconnect)
+        disconnect_from_peer(peer.get());
     }
 
     void node_impl::accept_connection_task(peer_connection_ptr new_peer)
@@ -1875,6 +3241,7 @@ namespace bts { namespace net {
       while (!_accept_loop_complete.canceled())
       {
         peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this)));
+        configure_peer_connection(new_peer);
         try
         {
           _tcp_server.accept(new_peer->get_socket());
@@ -1927,18 +3294,25 @@ namespace bts { namespace net {
 
         throw except;
       }
-      hello_message hello(_user_agent_string, core_protocol_version, _node_configuration.listen_endpoint, _node_id, _chain_id);
+      hello_message hello(_user_agent_string, core_protocol_version, _actual_listening_endpoint, _node_id, _chain_id);
       new_peer->state = peer_connection::hello_sent;
       new_peer->send_message(message(hello));
       ilog("Sent \"hello\" to remote peer ${peer}", ("peer", new_peer->get_remote_endpoint()));
     }
 
     // methods implementing node's public interface
-    void node_impl::set_delegate(node_delegate* del)
+    void node_impl::set_delegate(node_delegate* del, fc::thread* delegate_thread)
     {
-      _delegate = del;
+      // fibers may still be waiting on the old delegate.  Detaching makes their calls fail
+      // rather than reach it, and a detached wrapper is left in place when del is null so 
+      // any later calls fail the same way
       if (_delegate)
-        _chain_id = del->get_chain_id();
+        _delegate->detach();
+      if (del)
+      {
+        _delegate = std::make_shared<threaded_node_delegate_wrapper>(del, delegate_thread);
+        _chain_id = _delegate->get_chain_id();
+      }
     }
 
     void node_impl::load_configuration(const fc::path& configuration_directory)
@@ -1996,7 +3370,8 @@ namespace bts { namespace net {
             _tcp_server.listen(_node_configuration.listen_endpoint);
           else
             _tcp_server.listen(_node_configuration.listen_endpoint.port());
-          ilog("listening for connections on endpoint ${endpoint}", ("endpoint", _node_configuration.listen_endpoint));
+          _actual_listening_endpoint = fc::ip::endpoint(_node_configuration.listen_endpoint.get_address(), _tcp_server.get_port());
+          ilog("listening for connections on endpoint ${endpoint}", ("endpoint", _actual_listening_endpoint));
           _accept_loop_complete = fc::async( [=](){ accept_loop(); });
         } FC_RETHROW_EXCEPTIONS(warn, "unable to listen on ${endpoint}", ("endpoint",_node_configuration.listen_endpoint))
       } 
@@ -2021,6 +3396,7 @@ namespace bts { namespace net {
 
       ilog("node_impl::connect_to(${endpoint})", ("endpoint", remote_endpoint));
       peer_connection_ptr new_peer(std::make_shared<peer_connection>(std::ref(*this)));
+      configure_peer_connection(new_peer);
       new_peer->get_socket().open();
       new_peer->get_socket().set_reuse_address();
       new_peer->set_remote_endpoint(remote_endpoint);
@@ -2072,19 +3448,30 @@ namespace bts { namespace net {
       }
 
       ilog("--------- MEMORY USAGE ------------");
-      ilog("node._active_sync_requests size: ${size} (this is known to be broken)", ("size", _active_sync_requests.size())); // TODO: un-break this
-      ilog("node._received_sync_items size: ${size}", ("size", _received_sync_items.size()));
+      // every active sync request is outstanding with exactly one peer, so these should match
+      size_t sync_items_requested_from_peers = 0;
+      for (const peer_connection_ptr& peer : _active_connections)
+        sync_items_requested_from_peers += peer->sync_items_requested_from_peer.size();
+      ilog("node._active_sync_requests size: ${size} (${requested} requested from peers)", 
+           ("size", _active_sync_requests.size())("requested", sync_items_requested_from_peers));
+      ilog("node._sync_items_outstanding size: ${size}", ("size", _sync_items_outstanding.size()));
+      ilog("node._received_sync_items size: ${size} (${bytes} bytes)", ("size", _received_sync_items.size())("bytes", _received_sync_items_size_in_bytes));
       ilog("node._items_to_fetch size: ${size}", ("size", _items_to_fetch.size()));
       ilog("node._new_inventory size: ${size}", ("size", _new_inventory.size()));
-      ilog("node._message_cache size: ${size}", ("size", _message_cache.size()));
+      ilog("node._message_cache size: ${size} (${bytes} of ${max_bytes} bytes, ${evictions} evictions, ${misses} misses)", 
+           ("size", _message_cache.size())("bytes", _message_cache.get_size_in_bytes())("max_bytes", _message_cache.get_max_size_in_bytes())
+           ("evictions", _message_cache.get_total_evictions())("misses", _message_cache.get_total_misses()));
       for (const peer_connection_ptr& peer : _active_connections)
       {
         ilog("  peer ${endpoint}", ("endpoint", peer->get_remote_endpoint()));
         ilog("    peer.ids_of_items_to_get size: ${size}", ("size", peer->ids_of_items_to_get.size()));
-        ilog("    peer.inventory_peer_advertised_to_us size: ${size}", ("size", peer->inventory_peer_advertised_to_us.size()));
-        ilog("    peer.inventory_advertised_to_peer size: ${size}", ("size", peer->inventory_advertised_to_peer.size()));
+        ilog("    peer.inventory_peer_advertised_to_us size: ${size} (${bytes} bytes)", 
+             ("size", peer->inventory_peer_advertised_to_us.size())("bytes", peer->inventory_peer_advertised_to_us.get_memory_usage()));
+        ilog("    peer.inventory_advertised_to_peer size: ${size} (${bytes} bytes)", 
+             ("size", peer->inventory_advertised_to_peer.size())("bytes", peer->inventory_advertised_to_peer.get_memory_usage()));
         ilog("    peer.items_requested_from_peer size: ${size}", ("size", peer->items_requested_from_peer.size()));
         ilog("    peer.sync_items_requested_from_peer size: ${size}", ("size", peer->sync_items_requested_from_peer.size()));
+        ilog("    peer.sync_items_timed_out_from_peer size: ${size}", ("size", peer->sync_items_timed_out_from_peer.size()));
       }
       ilog("--------- END MEMORY USAGE ------------");
     }
@@ -2127,6 +3514,15 @@ namespace bts { namespace net {
         peer_details["lastrecv"] = peer->get_last_message_received_time().sec_since_epoch();
         peer_details["bytessent"] = peer->get_total_bytes_sent();
         peer_details["bytesrecv"] = peer->get_total_bytes_received();
+        peer_details["sendqueue"] = peer->get_send_queue_size();
+        peer_details["inventory_tracked"] = peer->inventory_peer_advertised_to_us.size() + peer->inventory_advertised_to_peer.size();
+        peer_details["inventory_memory_usage"] = peer->inventory_peer_advertised_to_us.get_memory_usage() + peer->inventory_advertised_to_peer.get_memory_usage();
+        peer_details["compression"] = peer->peer_supports_compression;
+        peer_details["bytes_saved_by_compression_sending"] = peer->bytes_saved_by_compression_sending;
+        peer_details["bytes_saved_by_compression_receiving"] = peer->bytes_saved_by_compression_receiving;
+        peer_details["average_item_latency_ms"] = peer->average_item_latency.count() / 1000;
+        peer_details["average_item_throughput"] = peer->average_item_throughput;
+        peer_details["bandwidth"] = peer->get_bandwidth_statistics();
         peer_details["conntime"] = ""; // TODO: fill me for bitcoin compatibility
         peer_details["pingtime"] = ""; // TODO: fill me for bitcoin compatibility
         peer_details["pingwait"] = ""; // TODO: fill me for bitcoin compatibility
@@ -2197,29 +3593,34 @@ namespace bts { namespace net {
       return _active_connections.size();
     }
 
-    void node_impl::broadcast(const message& item_to_broadcast, const message_propagation_data& propagation_data)
+    fc::ip::endpoint node_impl::get_actual_listening_endpoint() const
+    {
+      return _actual_listening_endpoint;
+    }
+
+    void node_impl::broadcast(const message_ptr& item_to_broadcast, const message_propagation_data& propagation_data)
     {
       fc::uint160_t hash_of_message_contents;
-      if (item_to_broadcast.msg_type == bts::client::block_message_type)
+      if (item_to_broadcast->msg_type == bts::client::block_message_type)
       {
-        bts::client::block_message block_message_to_broadcast = item_to_broadcast.as<bts::client::block_message>();
-        hash_of_message_contents = block_message_to_broadcast.block_id; // for debugging
-        _most_recent_blocks_accepted.push_back(block_message_to_broadcast.block_id);
+        bts::client::block_message_header block_header_to_broadcast = bts::client::block_message_header::peek(*item_to_broadcast);
+        hash_of_message_contents = block_header_to_broadcast.block_id; // for debugging
+        _most_recent_blocks_accepted.push_back(block_header_to_broadcast.block_id);
       }
-      else if (item_to_broadcast.msg_type == bts::client::trx_message_type)
+      else if (item_to_broadcast->msg_type == bts::client::trx_message_type)
       {
-        bts::client::trx_message transaction_message_to_broadcast = item_to_broadcast.as<bts::client::trx_message>();
-        hash_of_message_contents = transaction_message_to_broadcast.trx.id(); // for debugging
+        bts::client::trx_message_header transaction_header_to_broadcast = bts::client::trx_message_header::peek(*item_to_broadcast);
+        hash_of_message_contents = transaction_header_to_broadcast.trx_id; // for debugging
       }
-      message_hash_type hash_of_item_to_broadcast = item_to_broadcast.id();
+      message_hash_type hash_of_item_to_broadcast = item_to_broadcast->id();
 
       _message_cache.cache_message(item_to_broadcast, hash_of_item_to_broadcast, propagation_data, hash_of_message_contents);
-      _new_inventory.insert(item_id(item_to_broadcast.msg_type, hash_of_item_to_broadcast));
+      _new_inventory.insert(item_id(item_to_broadcast->msg_type, hash_of_item_to_broadcast));
       trigger_advertise_inventory_loop();
       dump_node_status();
     }
 
-    void node_impl::broadcast(const message& item_to_broadcast)
+    void node_impl::broadcast(const message_ptr& item_to_broadcast)
     {
       // this version is called directly from the clien
       message_propagation_data propagation_data{fc::time_point::now(), fc::time_point::now(), _node_id};
@@ -2245,6 +3646,28 @@ namespace bts { namespace net {
         _desired_number_of_connections = (uint32_t)params["desired_number_of_connections"].as_uint64();
       if (params.contains("maximum_number_of_connections"))
         _maximum_number_of_connections = (uint32_t)params["maximum_number_of_connections"].as_uint64();
+      if (params.contains("maximum_sync_items_in_flight_per_peer"))
+        _maximum_sync_items_in_flight_per_peer = std::max<uint32_t>((uint32_t)params["maximum_sync_items_in_flight_per_peer"].as_uint64(), 1);
+      if (params.contains("sync_item_request_timeout"))
+        _sync_item_request_timeout = (uint32_t)params["sync_item_request_timeout"].as_uint64();
+      if (params.contains("message_cache_max_size_in_bytes"))
+        _message_cache.set_max_size_in_bytes((size_t)params["message_cache_max_size_in_bytes"].as_uint64());
+      if (params.contains("maximum_upload_rate"))
+        _total_upload_limit->set_rate(params["maximum_upload_rate"].as_uint64());
+      if (params.contains("maximum_upload_rate_per_peer"))
+        _maximum_upload_rate_per_peer = params["maximum_upload_rate_per_peer"].as_uint64();
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      if (params.contains("simulated_latency_ms"))
+        _simulated_latency = fc::milliseconds(params["simulated_latency_ms"].as_uint64());
+      if (params.contains("simulated_loss_rate"))
+        _simulated_loss_rate = params["simulated_loss_rate"].as_double();
+      if (params.contains("simulated_loss_seed"))
+        _simulated_loss_seed = (uint32_t)params["simulated_loss_seed"].as_uint64();
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+
+      for (const std::unordered_set<peer_connection_ptr>* connections : {&_handshaking_connections, &_active_connections, &_closing_connections})
+        for (const peer_connection_ptr& peer : *connections)
+          configure_peer_connection(peer);
     }
 
     fc::variant_object node_impl::get_advanced_node_parameters()
@@ -2253,6 +3676,62 @@ namespace bts { namespace net {
       result["peer_connection_retry_timeout"] = _peer_connection_retry_timeout;
       result["desired_number_of_connections"] = _desired_number_of_connections;
       result["maximum_number_of_connections"] = _maximum_number_of_connections;
+      result["maximum_sync_items_in_flight_per_peer"] = _maximum_sync_items_in_flight_per_peer;
+      result["sync_item_request_timeout"] = _sync_item_request_timeout;
+      result["message_cache_max_size_in_bytes"] = _message_cache.get_max_size_in_bytes();
+      result["maximum_upload_rate"] = _total_upload_limit->get_rate();
+      result["maximum_upload_rate_per_peer"] = _maximum_upload_rate_per_peer;
+#ifdef ENABLE_P2P_NETWORK_SIMULATION
+      result["simulated_latency_ms"] = _simulated_latency.count() / 1000;
+      result["simulated_loss_rate"] = _simulated_loss_rate;
+      result["simulated_loss_seed"] = _simulated_loss_seed;
+#endif // ENABLE_P2P_NETWORK_SIMULATION
+      return result;
+    }
+
+    void node_impl::record_item_propagation(peer_connection* originating_peer, uint32_t item_type, const message_propagation_data& propagation_data)
+    {
+      _receive_to_validate_latency[item_type].record(propagation_data.validated_time - propagation_data.received_time);
+      ++originating_peer->number_of_first_deliveries;
+    }
+
+    static fc::variant_object get_histograms_by_message_type(const std::map<uint32_t, latency_histogram>& histograms)
+    {
+      fc::mutable_variant_object result;
+      for (const auto& type_and_histogram : histograms)
+        result[std::to_string(type_and_histogram.first)] = type_and_histogram.second.get_statistics();
+      return result;
+    }
+
+    fc::variant_object node_impl::get_propagation_statistics() const
+    {
+      fc::mutable_variant_object result;
+      result["advertise_to_request"] = get_histograms_by_message_type(_advertise_to_request_latency);
+      result["request_to_receive"] = get_histograms_by_message_type(_request_to_receive_latency);
+      result["receive_to_validate"] = get_histograms_by_message_type(_receive_to_validate_latency);
+
+      // the counts live on the connections, so they're only kept for the peers we're connected to
+      fc::variants first_deliveries;
+      for (const peer_connection_ptr& peer : _active_connections)
+      {
+        fc::mutable_variant_object peer_details;
+        peer_details["node_id"] = peer->node_id;
+        peer_details["addr"] = peer->get_remote_endpoint();
+        peer_details["first_deliveries"] = peer->number_of_first_deliveries;
+        first_deliveries.push_back(peer_details);
+      }
+      result["first_deliveries_by_peer"] = first_deliveries;
+      return result;
+    }
+
+    fc::variant_object node_impl::get_message_cache_statistics() const
+    {
+      fc::mutable_variant_object result;
+      result["messages"] = _message_cache.size();
+      result["size_in_bytes"] = _message_cache.get_size_in_bytes();
+      result["max_size_in_bytes"] = _message_cache.get_max_size_in_bytes();
+      result["evictions"] = _message_cache.get_total_evictions();
+      result["misses"] = _message_cache.get_total_misses();
       return result;
     }
 
@@ -2303,96 +3782,129 @@ namespace bts { namespace net {
 
   node::~node()
   {
+    // node_impl's tasks run on its thread, so it has to be destroyed there.  Hold on to
+    // the thread until that's done, it shuts down when node_thread goes out of scope
+    std::shared_ptr<fc::thread> node_thread = my->_thread;
+    node_thread->async([&](){ my.reset(); }).wait();
   }
 
+// runs the node_impl method on the p2p thread and waits for the result
+#define INVOKE_IN_IMPL(method_name, ...) \
+    return my->_thread->async([&](){ return my->method_name(__VA_ARGS__); }).wait()
+
   void node::set_delegate(node_delegate* del)
   {
-    my->set_delegate(del);
+    fc::thread* delegate_thread = &fc::thread::current();
+    INVOKE_IN_IMPL(set_delegate, del, delegate_thread);
+  }
+
+  void node::close()
+  {
+    INVOKE_IN_IMPL(close);
   }
 
   void node::load_configuration(const fc::path& configuration_directory)
   {
-    my->load_configuration(configuration_directory);
+    INVOKE_IN_IMPL(load_configuration, configuration_directory);
   }
 
   void node::connect_to_p2p_network()
   {
-    my->connect_to_p2p_network();
+    INVOKE_IN_IMPL(connect_to_p2p_network);
   }
 
   void node::add_node(const fc::ip::endpoint& ep)
   {
-    my->add_node(ep);
+    INVOKE_IN_IMPL(add_node, ep);
   }
 
   void node::connect_to(const fc::ip::endpoint& remote_endpoint)
   {
-    my->connect_to(remote_endpoint);
+    INVOKE_IN_IMPL(connect_to, remote_endpoint);
   }
 
   void node::listen_on_endpoint(const fc::ip::endpoint& ep)
   {
-    my->listen_on_endpoint(ep);
+    INVOKE_IN_IMPL(listen_on_endpoint, ep);
   }
 
   void node::listen_on_port(uint16_t port)
   {
-    my->listen_on_port(port);
+    INVOKE_IN_IMPL(listen_on_port, port);
   }
 
   std::vector<peer_status> node::get_connected_peers() const
   {
-    return my->get_connected_peers();
+    INVOKE_IN_IMPL(get_connected_peers);
   }
 
   uint32_t node::get_connection_count() const
   {
-    return my->get_connection_count();
+    INVOKE_IN_IMPL(get_connection_count);
+  }
+
+  fc::ip::endpoint node::get_actual_listening_endpoint() const
+  {
+    INVOKE_IN_IMPL(get_actual_listening_endpoint);
   }
 
   void node::broadcast(const message& msg)
   {
-    my->broadcast(msg);
+    message_ptr message_to_broadcast = std::make_shared<const message>(msg);
+    INVOKE_IN_IMPL(broadcast, message_to_broadcast);
   }
 
   void node::sync_from(const item_id& id)
   {
-    my->sync_from(id);
+    INVOKE_IN_IMPL(sync_from, id);
   }
 
   bool node::is_connected() const
   {
-    return my->is_connected();
+    INVOKE_IN_IMPL(is_connected);
   }
 
   void node::set_advanced_node_parameters(const fc::variant_object& params)
   {
-    my->set_advanced_node_parameters(params);
+    INVOKE_IN_IMPL(set_advanced_node_parameters, params);
+  }
+
+  fc::variant_object node::get_message_cache_statistics() const
+  {
+    INVOKE_IN_IMPL(get_message_cache_statistics);
+  }
+
+  fc::variant_object node::get_propagation_statistics() const
+  {
+    INVOKE_IN_IMPL(get_propagation_statistics);
   }
 
   fc::variant_object node::get_advanced_node_parameters()
   {
-    return my->get_advanced_node_parameters();
+    INVOKE_IN_IMPL(get_advanced_node_parameters);
   }
 
   message_propagation_data node::get_transaction_propagation_data(const bts::blockchain::transaction_id_type& transaction_id)
   {
-    return my->get_transaction_propagation_data(transaction_id);
+    INVOKE_IN_IMPL(get_transaction_propagation_data, transaction_id);
   }
   message_propagation_data node::get_block_propagation_data(const bts::blockchain::block_id_type& block_id)
   {
-    return my->get_block_propagation_data(block_id);
+    INVOKE_IN_IMPL(get_block_propagation_data, block_id);
   }
   node_id_t node::get_node_id() const
   {
-    return my->get_node_id();
+    INVOKE_IN_IMPL(get_node_id);
   }
   void node::set_allowed_peers(const std::vector<node_id_t>& allowed_peers)
   {
-    my->set_allowed_peers(allowed_peers);
+    INVOKE_IN_IMPL(set_allowed_peers, allowed_peers);
   }
   void node::clear_peer_database()
   {
-    my->clear_peer_database();
+    INVOKE_IN_IMPL(clear_peer_database);
   }
+
+#undef INVOKE_IN_IMPL
+
 } } // end namespace bts::net
@@ -78,8 +78,18 @@ namespace bts { namespace net {
       _leveldb.open(databaseFilename, true);
       _potential_peer_set.clear();
 
-      for (auto iter = _leveldb.begin(); iter.valid(); ++iter)
-        _potential_peer_set.insert(potential_peer_database_entry(iter.key(), iter.value()));
+      try
+      {
+        for (auto iter = _leveldb.begin(); iter.valid(); ++iter)
+          _potential_peer_set.insert(potential_peer_database_entry(iter.key(), iter.value()));
+      }
+      catch (const fc::exception& e)
+      {
+        // records written by an older version don't have the peer performance fields.
+        // the database is just a cache of peers we've heard about, so start over
+        wlog("unable to read the peer database, clearing it: ${e}", ("e", e.to_detail_string()));
+        clear();
+      }
     }
 
     void peer_database_impl::close()
@@ -14,7 +14,6 @@
 namespace bts { namespace net {
 
 stcp_socket::stcp_socket()
-:_buf_len(0)
 {
 }
 stcp_socket::~stcp_socket()
@@ -53,23 +52,22 @@ void stcp_socket::connect_to( const fc::ip::endpoint& remote_endpoint, const fc:
 
 /**
  *   This method must read at least 16 bytes at a time from
- *   the underlying TCP socket so that it can decrypt them. It
- *   will buffer any left-over.
+ *   the underlying TCP socket so that it can decrypt them. 
+ *   The data is read straight into buffer and decrypted in 
+ *   place, so one call can return as much as len bytes.
  */
 size_t stcp_socket::readsome( char* buffer, size_t len )
 { try {
     assert( (len % 16) == 0 );
     assert( len >= 16 );
-    char crypt_buf[4096];
-    len = std::min<size_t>(sizeof(crypt_buf),len);
 
-    size_t s = _sock.readsome( crypt_buf, len );
+    size_t s = _sock.readsome( buffer, len );
     if( s % 16 ) 
     {
-        _sock.read( crypt_buf + s, 16 - (s%16) );
+        _sock.read( buffer + s, 16 - (s%16) );
         s += 16-(s%16);
     }
-    _recv_aes.decode( crypt_buf, s, buffer );
+    _recv_aes.decode( buffer, s, buffer );
     return s;
 } FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
 
@@ -78,25 +76,20 @@ bool stcp_socket::eof()const
   return _sock.eof();
 }
 
+/**
+ *   Encrypts the whole of buffer in one pass into a scratch buffer 
+ *   that is kept between calls, then writes all of it.  The AES
+ *   context carries the CBC state from one call to the next, so the
+ *   caller can hand us data of any length that is a multiple of 16.
+ */
 size_t stcp_socket::writesome( const char* buffer, size_t len )
 { try {
     assert( len % 16 == 0 );
     assert( len > 0 );
-    char crypt_buf[4096];
-    len = std::min<size_t>(sizeof(crypt_buf),len);
-    memcpy( crypt_buf, buffer, len );
-    /**
-     * every sizeof(crypt_buf) bytes the aes channel
-     * has an error and doesn't decrypt properly...  disable
-     * for now because we are going to upgrade to something
-     * better.
-     */
-    //auto cipher_len =
-    _send_aes.encode( buffer, len, crypt_buf );
-    FC_ASSERT( len >= 16 );
-    FC_ASSERT( len % 16 == 0);
-   // memcpy( crypt_buf, buffer, len );
-    _sock.write( (char*)crypt_buf, len );
+    if( _send_buffer.size() < len )
+       _send_buffer.resize( len );
+    _send_aes.encode( buffer, len, _send_buffer.data() );
+    _sock.write( _send_buffer.data(), len );
     return len;
 } FC_RETHROW_EXCEPTIONS( warn, "", ("len",len) ) }
 
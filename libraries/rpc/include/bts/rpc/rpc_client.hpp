@@ -140,6 +140,7 @@ namespace bts { namespace rpc {
 
          virtual bts::net::message_propagation_data network_get_transaction_propagation_data(const transaction_id_type& transaction_id) = 0;
          virtual bts::net::message_propagation_data network_get_block_propagation_data(const block_id_type& block_id) = 0;
+         virtual fc::variant_object network_get_propagation_statistics() = 0;
     };
 
   /**
@@ -270,6 +271,7 @@ namespace bts { namespace rpc {
 
          bts::net::message_propagation_data network_get_transaction_propagation_data(const transaction_id_type& transaction_id) override;
          bts::net::message_propagation_data network_get_block_propagation_data(const block_id_type& block_id) override;
+         fc::variant_object network_get_propagation_statistics() override;
 
   private:
     std::unique_ptr<detail::rpc_client_impl> my;
@@ -53,6 +53,7 @@ namespace bts { namespace rpc {
       void network_set_advanced_node_parameters(const fc::variant_object& params);
       bts::net::message_propagation_data network_get_transaction_propagation_data(const bts::blockchain::transaction_id_type& transaction_id);
       bts::net::message_propagation_data network_get_block_propagation_data(const bts::blockchain::block_id_type& block_id);
+      fc::variant_object network_get_propagation_statistics();
       void network_set_allowed_peers(const std::vector<bts::net::node_id_t>& allowed_peers);
 
       void network_add_node(const fc::ip::endpoint& node, const std::string& command);
@@ -206,6 +207,10 @@ namespace bts { namespace rpc {
     {
       return _json_connection->call<bts::net::message_propagation_data>("network_get_block_propagation_data", fc::variant(block_id));
     }
+    fc::variant_object rpc_client_impl::network_get_propagation_statistics()
+    {
+      return _json_connection->async_call("network_get_propagation_statistics").wait().get_object();
+    }
     void rpc_client_impl::network_set_allowed_peers(const std::vector<bts::net::node_id_t>& allowed_peers)
     {
       _json_connection->async_call("network_set_allowed_peers", fc::variant(allowed_peers)).wait();
@@ -363,6 +368,10 @@ namespace bts { namespace rpc {
   {
     return my->network_get_block_propagation_data(block_id);
   }
+  fc::variant_object rpc_client::network_get_propagation_statistics()
+  {
+    return my->network_get_propagation_statistics();
+  }
   void rpc_client::network_set_allowed_peers(const std::vector<bts::net::node_id_t>& allowed_peers)
   {
     return my->network_set_allowed_peers(allowed_peers);
@@ -77,6 +77,7 @@ namespace bts { namespace rpc {
              (wallet_list_delegate_trust_status)\
              (network_get_block_propagation_data)\
              (network_get_transaction_propagation_data)\
+             (network_get_propagation_statistics)\
              (_list_json_commands)\
              (wallet_get_pretty_transaction)\
              (network_broadcast_transaction)\
@@ -651,6 +652,7 @@ Result:
 
        info["network_num_connections"]              = _client->network_get_connection_count();
        info["network_num_connections_max"]          = advanced_params["maximum_number_of_connections"];
+       info["network_message_cache"]                = _client->get_node()->get_message_cache_statistics();
 
        info["network_protocol_version"]             = BTS_NET_PROTOCOL_VERSION;
 
@@ -1764,6 +1766,29 @@ in our test network.
       return fc::variant(_client->network_get_block_propagation_data(params[0].as<block_id_type>()));
     }
 
+    static rpc_server::method_data network_get_propagation_statistics_metadata{"network_get_propagation_statistics", nullptr,
+            /* description */ "Returns histograms of where the time goes when this client relays blocks and transactions",
+            /* returns: */    "json_object",
+            /* params:     */ {},
+          /* prerequisites */ rpc_server::json_authenticated,
+R"(
+network_get_propagation_statistics
+
+Returns histograms of where the time goes when this client relays blocks and transactions.
+
+Each histogram is keyed by message type and covers every item relayed since the client started:
+  advertise_to_request: from the first peer advertising the item to us requesting it
+  request_to_receive: from requesting the item to the peer delivering it
+  receive_to_validate: from receiving the item to the client accepting it
+first_deliveries_by_peer counts how many items each connected peer was the first to deliver to us
+since we connected to it.
+Peers that deliver little or that are slow to answer are the ones adding latency.
+)" };
+    fc::variant rpc_server_impl::network_get_propagation_statistics(const fc::variants& params)
+    {
+      return _client->network_get_propagation_statistics();
+    }
+
     static rpc_server::method_data _list_json_commands_metadata{"_list_json_commands", nullptr,
         /* description */ "Lists commands",
         /* returns: */    "vector<string>",
@@ -23,9 +23,11 @@ struct config
    config():ignore_console(false){}
    bts::rpc::rpc_server::config rpc;
    bool                         ignore_console;
+   /** trusted block ids, signature checks are skipped up to the highest one */
+   std::map<uint32_t, bts::blockchain::block_id_type> checkpoints;
 };
 
-FC_REFLECT( config, (rpc)(ignore_console) )
+FC_REFLECT( config, (rpc)(ignore_console)(checkpoints) )
 
 
 void print_banner();
@@ -100,6 +102,7 @@ int main( int argc, char** argv )
 
       auto cfg   = load_config(datadir);
       auto chain = load_and_configure_chain_database(datadir, option_variables);
+      chain->set_checkpoints( cfg.checkpoints );
       auto wall  = std::make_shared<bts::wallet::wallet>(chain);
       wall->set_data_directory( datadir );
 
@@ -1,12 +1,14 @@
 #define BOOST_TEST_MODULE BlockchainTests2
 #include <boost/test/unit_test.hpp>
 #include <bts/blockchain/chain_database.hpp>
+#include <bts/client/messages.hpp>
 #include <bts/wallet/wallet.hpp>
 #include <bts/blockchain/config.hpp>
 #include <bts/blockchain/time.hpp>
 #include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
 #include <fc/io/json.hpp>
+#include <fc/io/raw_variant.hpp>
 #include <fc/thread/thread.hpp>
 #include <iostream>
 
@@ -85,6 +87,119 @@ BOOST_AUTO_TEST_CASE( price_math )
    }
 }
 
+BOOST_AUTO_TEST_CASE( undo_log_test )
+{
+   try {
+      auto base_state = std::make_shared<pending_chain_state>();
+      base_state->set_property( last_asset_id, fc::variant( 7 ) );
+
+      auto block_state = std::make_shared<pending_chain_state>( base_state );
+      block_state->set_property( last_asset_id, fc::variant( 8 ) );
+      block_state->set_property( last_name_id, fc::variant( 3 ) );
+
+      undo_log log;
+      block_state->get_undo_log( log );
+      FC_ASSERT( log.size() == 2 );
+      block_state->apply_changes();
+      FC_ASSERT( base_state->get_property( last_name_id ).as_int64() == 3 );
+
+      auto stored_log = fc::raw::unpack<undo_log>( fc::raw::pack( log ) );
+      stored_log.apply( base_state );
+
+      FC_ASSERT( base_state->get_property( last_asset_id ).as_int64() == 7 );
+      FC_ASSERT( base_state->get_property( last_name_id ).is_null() );
+   } catch ( const fc::exception& e )
+   {
+      elog( "${e}", ("e",e.to_detail_string() ) );
+      throw;
+   }
+}
+
+BOOST_AUTO_TEST_CASE( undo_log_record_test )
+{
+   try {
+      auto owner_key = fc::ecc::private_key::generate().get_public_key();
+      auto owner     = address( owner_key );
+
+      asset_record modified_asset;
+      modified_asset.id                   = 1;
+      modified_asset.symbol               = "MOD";
+      modified_asset.maximum_share_supply = 1000;
+      asset_record deleted_asset = modified_asset;
+      deleted_asset.id     = 2;
+      deleted_asset.symbol = "DEL";
+      asset_record created_asset = modified_asset;
+      created_asset.id     = 3;
+      created_asset.symbol = "NEW";
+
+      name_record modified_name;
+      modified_name.id        = 1;
+      modified_name.name      = "modified";
+      modified_name.owner_key = owner_key.serialize();
+      name_record deleted_name = modified_name;
+      deleted_name.id   = 2;
+      deleted_name.name = "deleted";
+      name_record created_name = modified_name;
+      created_name.id   = 3;
+      created_name.name = "created";
+
+      market_index_key modified_key( price( 1.0, 1, 0 ), owner );
+      market_index_key deleted_key( price( 2.0, 1, 0 ), owner );
+      market_index_key created_key( price( 3.0, 1, 0 ), owner );
+      order_record     original_order( 100, 1 );
+
+      auto base_state = std::make_shared<pending_chain_state>();
+      base_state->store_asset_record( modified_asset );
+      base_state->store_asset_record( deleted_asset );
+      base_state->store_name_record( modified_name );
+      base_state->store_name_record( deleted_name );
+      base_state->store_bid_record( modified_key, original_order );
+      base_state->store_bid_record( deleted_key, original_order );
+
+      auto block_state = std::make_shared<pending_chain_state>( base_state );
+      auto changed_asset = modified_asset;
+      changed_asset.current_share_supply = 500;
+      block_state->store_asset_record( changed_asset );
+      block_state->store_asset_record( deleted_asset.make_null() );
+      block_state->store_asset_record( created_asset );
+      auto changed_name = modified_name;
+      changed_name.json_data = fc::variant( "changed" );
+      block_state->store_name_record( changed_name );
+      block_state->store_name_record( deleted_name.make_null() );
+      block_state->store_name_record( created_name );
+      block_state->store_bid_record( modified_key, order_record( 50, 1 ) );
+      block_state->store_bid_record( deleted_key, order_record() );
+      block_state->store_bid_record( created_key, original_order );
+
+      undo_log log;
+      block_state->get_undo_log( log );
+      FC_ASSERT( log.size() == 9 );
+      block_state->apply_changes();
+      FC_ASSERT( base_state->get_asset_record( created_asset.id )->symbol == "NEW" );
+      FC_ASSERT( base_state->get_name_record( deleted_name.id )->is_null() );
+      FC_ASSERT( base_state->get_bid_record( modified_key )->balance == 50 );
+
+      auto stored_log = fc::raw::unpack<undo_log>( fc::raw::pack( log ) );
+      stored_log.apply( base_state );
+
+      FC_ASSERT( fc::raw::pack( *base_state->get_asset_record( modified_asset.id ) ) == fc::raw::pack( modified_asset ) );
+      FC_ASSERT( fc::raw::pack( *base_state->get_asset_record( deleted_asset.id ) ) == fc::raw::pack( deleted_asset ) );
+      FC_ASSERT( base_state->get_asset_record( created_asset.id )->is_null() );
+
+      FC_ASSERT( fc::raw::pack( *base_state->get_name_record( modified_name.id ) ) == fc::raw::pack( modified_name ) );
+      FC_ASSERT( fc::raw::pack( *base_state->get_name_record( deleted_name.id ) ) == fc::raw::pack( deleted_name ) );
+      FC_ASSERT( base_state->get_name_record( created_name.id )->is_null() );
+
+      FC_ASSERT( base_state->get_bid_record( modified_key )->balance == original_order.balance );
+      FC_ASSERT( base_state->get_bid_record( deleted_key )->balance == original_order.balance );
+      FC_ASSERT( base_state->get_bid_record( created_key )->is_null() );
+   } catch ( const fc::exception& e )
+   {
+      elog( "${e}", ("e",e.to_detail_string() ) );
+      throw;
+   }
+}
+
 BOOST_AUTO_TEST_CASE( block_signing )
 {
    try {
@@ -766,6 +881,144 @@ BOOST_AUTO_TEST_CASE( basic_chain_test )
   }
 }
 
+BOOST_AUTO_TEST_CASE( packed_block_test )
+{
+   try {
+    // blocks served to peers straight from their stored bytes must be the same message
+    // we'd get by decoding the block and packing a block_message
+    fc::temp_directory my_dir;
+    chain_database_ptr my_chain = std::make_shared<chain_database>();
+    my_chain->open( my_dir.path(), "genesis.dat" );
+
+    wallet  my_wallet( my_chain );
+    my_wallet.set_data_directory( my_dir.path() );
+    my_wallet.create(  "my_wallet", "password" );
+    my_wallet.unlock( fc::seconds( 10000000 ), "password" );
+
+    auto keys = fc::json::from_string( test_keys ).as<std::vector<fc::ecc::private_key> >();
+    for( uint32_t i = 0; i < keys.size(); ++i )
+       my_wallet.import_private_key( keys[i] );
+    my_wallet.scan_state();
+
+    for( uint32_t i = 0; i < 10; ++i )
+    {
+       auto now = bts::blockchain::now();
+       auto my_next_block_time = my_wallet.next_block_production_time();
+       if( my_next_block_time == now )
+       {
+          auto my_block = my_chain->generate_block( my_next_block_time );
+          my_wallet.sign_block( my_block );
+          my_chain->push_block( my_block );
+       }
+       bts::blockchain::advance_time( (uint32_t)(BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC - (now.sec_since_epoch() % BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC)) );
+    }
+    FC_ASSERT( my_chain->get_head_block_num() > 0 );
+
+    for( uint32_t block_num = 1; block_num <= my_chain->get_head_block_num(); ++block_num )
+    {
+       auto block_id = *my_chain->find_block_id( block_num );
+       std::vector<char> packed_block_message( bts::client::block_message_header::packed_size );
+       my_chain->get_packed_block( block_id, packed_block_message );
+       auto framed_message = bts::client::block_message_header::frame_packed_block( block_id, std::move(packed_block_message) );
+
+       auto expected_data = fc::raw::pack( bts::client::block_message( my_chain->get_block( block_id ) ) );
+       FC_ASSERT( framed_message.msg_type == bts::client::block_message::type );
+       FC_ASSERT( framed_message.size == expected_data.size() );
+       FC_ASSERT( framed_message.data == expected_data, "", ("block_num",block_num) );
+    }
+  }
+  catch ( const fc::exception& e )
+  {
+     elog( "${e}", ("e",e.to_detail_string() ) );
+     throw;
+  }
+}
+
+BOOST_AUTO_TEST_CASE( checkpoint_test )
+{
+   try {
+    // the purpose of this test is to validate that blocks below a
+    // checkpoint are applied without signature checks as they arrive,
+    // that a block that is not an ancestor of the checkpoint is rolled
+    // back once the checkpointed chain arrives, and that a block that 
+    // does not match its checkpoint is rejected.
+
+    fc::temp_directory my_dir;
+    fc::temp_directory your_dir;
+    fc::temp_directory their_dir;
+
+    chain_database_ptr my_chain = std::make_shared<chain_database>();
+    my_chain->open( my_dir.path(), "genesis.dat" );
+
+    wallet  my_wallet( my_chain );
+    my_wallet.set_data_directory( my_dir.path() );
+    my_wallet.create(  "my_wallet", "password" );
+    my_wallet.unlock( fc::seconds( 10000000 ), "password" );
+
+    auto keys = fc::json::from_string( test_keys ).as<std::vector<fc::ecc::private_key> >();
+    for( uint32_t i = 0; i < keys.size(); ++i )
+          my_wallet.import_private_key( keys[i] );
+    my_wallet.scan_state();
+
+    for( uint32_t i = 0; i < 20; ++i )
+    {
+       auto now = bts::blockchain::now();
+       auto my_next_block_time = my_wallet.next_block_production_time();
+       if( my_next_block_time == now )
+       {
+          auto my_block = my_chain->generate_block( my_next_block_time );
+          my_wallet.sign_block( my_block );
+          my_chain->push_block( my_block );
+       }
+       uint32_t sleep_time_sec = (uint32_t)(BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC  - (now.sec_since_epoch() % BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC));
+       bts::blockchain::advance_time(sleep_time_sec);
+    }
+
+    uint32_t my_length = my_chain->get_head_block_num();
+    FC_ASSERT( my_length > 3 );
+
+    std::map<uint32_t,block_id_type> checkpoints;
+    checkpoints[my_length-1] = my_chain->get_block( my_length-1 ).id();
+
+    chain_database_ptr your_chain = std::make_shared<chain_database>();
+    your_chain->open( your_dir.path(), "genesis.dat" );
+    your_chain->set_checkpoints( checkpoints );
+
+    // an unsigned copy of the first block is applied, but it has a different id, so 
+    // it can't be on the checkpointed chain
+    full_block unsigned_block = my_chain->get_block( 1 );
+    unsigned_block.delegate_signature = signature_type();
+    your_chain->push_block( unsigned_block );
+    FC_ASSERT( your_chain->get_head_block_id() == unsigned_block.id() );
+
+    // the real chain replaces it as soon as it is longer
+    for( uint32_t i = 1; i < my_length-1; ++i )
+    {
+       your_chain->push_block( my_chain->get_block( i ) );
+       FC_ASSERT( your_chain->get_head_block_num() == std::max<uint32_t>( i, 1 ) );
+    }
+    FC_ASSERT( your_chain->get_head_block_id() == my_chain->get_block( my_length-2 ).id() );
+    for( uint32_t i = my_length-1; i <= my_length; ++i )
+       your_chain->push_block( my_chain->get_block( i ) );
+    FC_ASSERT( your_chain->get_head_block_id() == my_chain->get_head_block_id() );
+
+    checkpoints[my_length-1] = my_chain->get_block( my_length-2 ).id();
+
+    chain_database_ptr their_chain = std::make_shared<chain_database>();
+    their_chain->open( their_dir.path(), "genesis.dat" );
+    their_chain->set_checkpoints( checkpoints );
+    for( uint32_t i = 1; i < my_length-1; ++i )
+       their_chain->push_block( my_chain->get_block( i ) );
+    BOOST_CHECK_THROW( their_chain->push_block( my_chain->get_block( my_length-1 ) ), fc::exception );
+    FC_ASSERT( their_chain->get_head_block_num() == my_length-2 );
+  }
+  catch ( const fc::exception& e )
+  {
+     elog( "${e}", ("e",e.to_detail_string() ) );
+     throw;
+  }
+}
+
 BOOST_AUTO_TEST_CASE( undo_state_test )
 {
     try {
@@ -898,3 +1151,58 @@ BOOST_AUTO_TEST_CASE( undo_state_test )
         throw;
     }
 }
+
+BOOST_AUTO_TEST_CASE( block_id_index_test )
+{
+   try {
+    // get_block_ids/find_block_num/find_block_id are what the p2p code uses to
+    // answer sync requests, they must agree with get_block() and never throw
+    fc::temp_directory my_dir;
+    chain_database_ptr my_chain = std::make_shared<chain_database>();
+    my_chain->open( my_dir.path(), "genesis.dat" );
+
+    wallet  my_wallet( my_chain );
+    my_wallet.set_data_directory( my_dir.path() );
+    my_wallet.create(  "my_wallet", "password" );
+    my_wallet.unlock( fc::seconds( 10000000 ), "password" );
+
+    auto keys = fc::json::from_string( test_keys ).as<std::vector<fc::ecc::private_key> >();
+    for( uint32_t i = 0; i < keys.size(); ++i )
+       my_wallet.import_private_key( keys[i] );
+    my_wallet.scan_state();
+
+    for( uint32_t i = 0; i < 20; ++i )
+    {
+       auto now = bts::blockchain::now();
+       auto next_block_time = my_wallet.next_block_production_time();
+       if( next_block_time == now )
+       {
+          auto block = my_chain->generate_block( next_block_time );
+          my_wallet.sign_block( block );
+          my_chain->push_block( block );
+       }
+       bts::blockchain::advance_time( (uint32_t)(BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC - (now.sec_since_epoch() % BTS_BLOCKCHAIN_BLOCK_INTERVAL_SEC)) );
+    }
+
+    uint32_t head_block_num = my_chain->get_head_block_num();
+
+    auto block_ids = my_chain->get_block_ids( 1, head_block_num + 10 );
+    FC_ASSERT( block_ids.size() == head_block_num );
+    for( uint32_t block_num = 1; block_num <= head_block_num; ++block_num )
+    {
+       FC_ASSERT( block_ids[block_num - 1] == my_chain->get_block( block_num ).id() );
+       FC_ASSERT( *my_chain->find_block_id( block_num ) == block_ids[block_num - 1] );
+       FC_ASSERT( *my_chain->find_block_num( block_ids[block_num - 1] ) == block_num );
+    }
+
+    FC_ASSERT( my_chain->get_block_ids( head_block_num + 1, 10 ).empty() );
+    FC_ASSERT( !my_chain->find_block_id( head_block_num + 1 ) );
+    FC_ASSERT( *my_chain->find_block_num( block_id_type() ) == 0 );
+    FC_ASSERT( !my_chain->find_block_num( fc::ripemd160::hash( "not a block" ) ) );
+  }
+  catch ( const fc::exception& e )
+  {
+     elog( "${e}", ("e",e.to_detail_string() ) );
+     throw;
+  }
+}
@@ -0,0 +1,441 @@
+/**
+ *  A loopback benchmark, not a simulator: runs many bts::net::node instances in one process,
+ *  connected to each other over the loopback interface, then broadcasts transactions and 
+ *  blocks from random nodes and reports how long they took to reach the others.
+ *
+ *  Link latency and packet loss are added by the node's network simulation parameters
+ *  (configure with -DBTS_ENABLE_NETWORK_SIMULATION=ON to build this), bandwidth with its 
+ *  upload rate limits.  The seed fixes the topology, the broadcasting nodes and each 
+ *  connection's packet loss, but the nodes run on real sockets in real time, so results 
+ *  only repeat to within scheduling noise.
+ *
+ *  Every node's delegate callbacks (handle_message(), get_item(), ...) run on this program's
+ *  main thread, the same one that drives the broadcasts, so with many nodes the measured
+ *  delays include time spent waiting for that thread.  Keep the number of nodes low enough 
+ *  that the machine isn't the bottleneck (watch the CPU while it runs).
+ */
+#include <boost/program_options.hpp>
+
+#include <bts/net/node.hpp>
+#include <bts/net/config.hpp>
+#include <bts/client/messages.hpp>
+
+#include <fc/filesystem.hpp>
+#include <fc/log/logger.hpp>
+#include <fc/network/ip.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/variant_object.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+using namespace bts::net;
+using namespace bts::client;
+using namespace bts::blockchain;
+
+/** when each item was broadcast, and how long it took to reach each node that got it */
+struct item_propagation_record
+{
+  uint32_t                      item_type;
+  fc::time_point                broadcast_time;
+  std::vector<fc::microseconds> delays;
+};
+
+class propagation_tracker
+{
+  public:
+    void item_broadcast(uint32_t item_type, const item_hash_t& item_id)
+    {
+      item_propagation_record& record = _items[item_id];
+      record.item_type = item_type;
+      record.broadcast_time = fc::time_point::now();
+    }
+
+    void item_received(const item_hash_t& item_id)
+    {
+      auto iter = _items.find(item_id);
+      if (iter != _items.end())
+        iter->second.delays.push_back(fc::time_point::now() - iter->second.broadcast_time);
+    }
+
+    void report(uint32_t item_type, const std::string& item_name, uint32_t number_of_receivers) const;
+
+  private:
+    std::map<item_hash_t, item_propagation_record> _items;
+};
+
+static fc::microseconds get_percentile(const std::vector<fc::microseconds>& sorted_values, double percentile)
+{
+  if (sorted_values.empty())
+    return fc::microseconds();
+  size_t index = std::min<size_t>((size_t)(percentile / 100 * sorted_values.size()), sorted_values.size() - 1);
+  return sorted_values[index];
+}
+
+void propagation_tracker::report(uint32_t item_type, const std::string& item_name, uint32_t number_of_receivers) const
+{
+  std::vector<fc::microseconds> all_delays;
+  std::vector<fc::microseconds> time_to_reach_90_percent;
+  uint32_t number_of_items = 0;
+  for (const auto& id_and_record : _items)
+  {
+    const item_propagation_record& record = id_and_record.second;
+    if (record.item_type != item_type)
+      continue;
+    ++number_of_items;
+    all_delays.insert(all_delays.end(), record.delays.begin(), record.delays.end());
+    std::vector<fc::microseconds> delays(record.delays);
+    std::sort(delays.begin(), delays.end());
+    size_t receivers_for_90_percent = (number_of_receivers * 9 + 9) / 10;
+    if (receivers_for_90_percent > 0 && delays.size() >= receivers_for_90_percent)
+      time_to_reach_90_percent.push_back(delays[receivers_for_90_percent - 1]);
+  }
+  std::sort(all_delays.begin(), all_delays.end());
+  std::sort(time_to_reach_90_percent.begin(), time_to_reach_90_percent.end());
+
+  uint64_t expected_deliveries = (uint64_t)number_of_items * number_of_receivers;
+  std::cout << item_name << ": " << number_of_items << " broadcast, "
+            << all_delays.size() << " of " << expected_deliveries << " deliveries made";
+  if (expected_deliveries)
+    std::cout << " (" << std::fixed << std::setprecision(1) << (100.0 * all_delays.size() / expected_deliveries) << "%)";
+  std::cout << "\n";
+  std::cout << "  delivery time (ms):";
+  for (double percentile : {50.0, 90.0, 99.0, 100.0})
+    std::cout << "  p" << percentile << "=" << get_percentile(all_delays, percentile).count() / 1000;
+  std::cout << "\n";
+  std::cout << "  time to reach 90% of nodes (ms), " << time_to_reach_90_percent.size() << " items got there:";
+  for (double percentile : {50.0, 90.0, 100.0})
+    std::cout << "  p" << percentile << "=" << get_percentile(time_to_reach_90_percent, percentile).count() / 1000;
+  std::cout << "\n";
+}
+
+/** just enough of a client to relay blocks and transactions and sync a chain of blocks */
+class simulated_client : public node_delegate
+{
+  public:
+    simulated_client(propagation_tracker& tracker) :
+      _tracker(tracker)
+    {
+      _node.set_delegate(this);
+    }
+
+    void start(const fc::path& data_directory, const fc::ip::endpoint& listen_endpoint, const fc::variant_object& node_parameters);
+    node& get_node() { return _node; }
+    uint32_t get_head_block_num() const { return _chain.size(); }
+
+    void broadcast_transaction(uint64_t unique_number, size_t transaction_size);
+    void produce_block();
+
+    /* Implement node_delegate */
+    bool has_item(const item_id& id) override;
+    void handle_message(const message& message_to_handle) override;
+    std::vector<osigned_transaction> get_unconfirmed_transactions(const std::vector<uint64_t>& short_transaction_ids) override;
+    std::vector<item_hash_t> get_item_ids(const item_id& from_id, uint32_t& remaining_item_count, uint32_t limit = 2000) override;
+    message get_item(const item_id& id) override;
+    fc::sha256 get_chain_id() const override { return fc::sha256(); }
+    std::vector<item_hash_t> get_blockchain_synopsis() override;
+    void sync_status(uint32_t item_type, uint32_t item_count) override {}
+    void connection_count_changed(uint32_t c) override {}
+
+  private:
+    propagation_tracker&                     _tracker;
+    std::map<block_id_type, block_message>   _blocks;
+    std::vector<block_id_type>               _chain; /// block ids in order, _chain[0] is block 1
+    std::map<transaction_id_type, signed_transaction> _pending_transactions;
+    std::set<transaction_id_type>            _transactions_seen;
+    node                                     _node; // last, so it's destroyed before the state it calls back into
+
+    void accept_block(const block_message& block_to_accept);
+};
+
+void simulated_client::start(const fc::path& data_directory, const fc::ip::endpoint& listen_endpoint, const fc::variant_object& node_parameters)
+{
+  fc::create_directories(data_directory);
+  _node.load_configuration(data_directory);
+  _node.set_advanced_node_parameters(node_parameters);
+  _node.listen_on_endpoint(listen_endpoint);
+  _node.sync_from(item_id(block_message_type, item_hash_t()));
+  _node.connect_to_p2p_network();
+}
+
+void simulated_client::broadcast_transaction(uint64_t unique_number, size_t transaction_size)
+{
+  signed_transaction transaction;
+  transaction.expiration = fc::time_point_sec((uint32_t)unique_number);
+  operation padding;
+  padding.data.resize(transaction_size);
+  memcpy(padding.data.data(), &unique_number, std::min(sizeof(unique_number), transaction_size));
+  transaction.operations.push_back(padding);
+
+  trx_message transaction_message(transaction);
+  _tracker.item_broadcast(trx_message_type, transaction_message.trx_id);
+  _transactions_seen.insert(transaction_message.trx_id);
+  _pending_transactions[transaction_message.trx_id] = transaction;
+  _node.broadcast(message(transaction_message));
+}
+
+void simulated_client::produce_block()
+{
+  full_block new_block;
+  new_block.block_num = _chain.size() + 1;
+  if (!_chain.empty())
+    new_block.previous = _chain.back();
+  new_block.timestamp = fc::time_point::now();
+  for (const auto& id_and_transaction : _pending_transactions)
+    new_block.user_transactions.push_back(id_and_transaction.second);
+
+  block_message new_block_message(new_block);
+  _tracker.item_broadcast(block_message_type, new_block_message.block_id);
+  accept_block(new_block_message);
+  _node.broadcast(message(new_block_message));
+}
+
+void simulated_client::accept_block(const block_message& block_to_accept)
+{
+  _blocks[block_to_accept.block_id] = block_to_accept;
+  // blocks that don't build on our chain are kept so we can serve them, but nothing more
+  if (block_to_accept.block_num != _chain.size() + 1 ||
+      (!_chain.empty() && block_to_accept.previous != _chain.back()))
+    return;
+  _chain.push_back(block_to_accept.block_id);
+  for (const signed_transaction& transaction : block_to_accept.block.user_transactions)
+  {
+    transaction_id_type transaction_id = transaction.id();
+    _transactions_seen.insert(transaction_id);
+    _pending_transactions.erase(transaction_id);
+  }
+}
+
+bool simulated_client::has_item(const item_id& id)
+{
+  if (id.item_type == block_message_type)
+    return _blocks.find(id.item_hash) != _blocks.end();
+  if (id.item_type == trx_message_type)
+    return _transactions_seen.find(id.item_hash) != _transactions_seen.end();
+  return false;
+}
+
+void simulated_client::handle_message(const message& message_to_handle)
+{
+  switch (message_to_handle.msg_type)
+  {
+  case block_message_type:
+    {
+      block_message block_message_to_handle(message_to_handle.as<block_message>());
+      FC_ASSERT(block_message_to_handle.header_matches_block(), "block message header doesn't match its block");
+      if (_blocks.find(block_message_to_handle.block_id) == _blocks.end())
+      {
+        _tracker.item_received(block_message_to_handle.block_id);
+        accept_block(block_message_to_handle);
+      }
+      break;
+    }
+  case trx_message_type:
+    {
+      trx_message trx_message_to_handle(message_to_handle.as<trx_message>());
+      FC_ASSERT(trx_message_to_handle.header_matches_transaction(), "transaction message header doesn't match its transaction");
+      if (_transactions_seen.insert(trx_message_to_handle.trx_id).second)
+      {
+        _tracker.item_received(trx_message_to_handle.trx_id);
+        _pending_transactions[trx_message_to_handle.trx_id] = trx_message_to_handle.trx;
+      }
+      break;
+    }
+  }
+}
+
+std::vector<osigned_transaction> simulated_client::get_unconfirmed_transactions(const std::vector<uint64_t>& short_transaction_ids)
+{
+  std::vector<osigned_transaction> result;
+  result.reserve(short_transaction_ids.size());
+  for (uint64_t short_id : short_transaction_ids)
+  {
+    transaction_id_type id_prefix;
+    memcpy(id_prefix.data(), (const char*)&short_id, sizeof(short_id));
+    auto iter = _pending_transactions.lower_bound(id_prefix);
+    if (iter != _pending_transactions.end() && memcmp(iter->first.data(), id_prefix.data(), sizeof(short_id)) == 0)
+      result.push_back(iter->second);
+    else
+      result.push_back(osigned_transaction());
+  }
+  return result;
+}
+
+std::vector<item_hash_t> simulated_client::get_item_ids(const item_id& from_id, uint32_t& remaining_item_count, uint32_t limit)
+{
+  // a null id asks for the chain from the start
+  uint32_t first_index = 0;
+  if (from_id.item_hash != item_hash_t())
+  {
+    auto iter = std::find(_chain.begin(), _chain.end(), from_id.item_hash);
+    if (iter == _chain.end())
+    {
+      remaining_item_count = 0;
+      return std::vector<item_hash_t>();
+    }
+    first_index = iter - _chain.begin() + 1;
+  }
+  uint32_t items_to_return = std::min<uint32_t>(limit, _chain.size() - first_index);
+  std::vector<item_hash_t> result(_chain.begin() + first_index, _chain.begin() + first_index + items_to_return);
+  remaining_item_count = _chain.size() - first_index - items_to_return;
+  return result;
+}
+
+message simulated_client::get_item(const item_id& id)
+{
+  if (id.item_type == block_message_type)
+  {
+    auto iter = _blocks.find(id.item_hash);
+    if (iter != _blocks.end())
+      return message(iter->second);
+  }
+  else if (id.item_type == trx_message_type)
+  {
+    auto iter = _pending_transactions.find(id.item_hash);
+    if (iter != _pending_transactions.end())
+      return message(trx_message(iter->second));
+  }
+  FC_THROW_EXCEPTION(key_not_found_exception, "I don't have the item you're looking for");
+}
+
+std::vector<item_hash_t> simulated_client::get_blockchain_synopsis()
+{
+  // same shape as the real client's: genesis, then halfway to the head each step
+  std::vector<item_hash_t> synopsis;
+  uint32_t high_block_num = _chain.size();
+  uint32_t low_block_num = 1;
+  while (low_block_num <= high_block_num)
+  {
+    synopsis.push_back(_chain[low_block_num - 1]);
+    low_block_num += ((high_block_num - low_block_num + 2) / 2);
+  }
+  return synopsis;
+}
+
+int main(int argc, char* argv[])
+{
+  boost::program_options::options_description option_config("Allowed options");
+  option_config.add_options()("help", "display this help message")
+                             ("nodes", boost::program_options::value<uint32_t>()->default_value(100), "number of nodes to run")
+                             ("connections", boost::program_options::value<uint32_t>()->default_value(4), "number of peers each node connects to at startup")
+                             ("latency-ms", boost::program_options::value<uint32_t>()->default_value(50), "simulated one-way latency of every connection")
+                             ("loss-rate", boost::program_options::value<double>()->default_value(0), "fraction of writes treated as lost packets")
+                             ("upload-rate", boost::program_options::value<uint64_t>()->default_value(0), "each node's upload limit in bytes per second, 0 for none")
+                             ("blocks", boost::program_options::value<uint32_t>()->default_value(10), "number of blocks to produce")
+                             ("block-interval-ms", boost::program_options::value<uint32_t>()->default_value(5000), "time between blocks")
+                             ("transactions-per-block", boost::program_options::value<uint32_t>()->default_value(50), "transactions broadcast between blocks")
+                             ("transaction-size", boost::program_options::value<uint32_t>()->default_value(250), "bytes of padding in each transaction")
+                             ("port", boost::program_options::value<uint16_t>()->default_value(0), "first port to listen on, node n listens on port + n (0 lets the system pick free ports)")
+                             ("data-dir", boost::program_options::value<std::string>(), "where the nodes keep their peer databases (default: a temp directory)")
+                             ("seed", boost::program_options::value<uint32_t>()->default_value(1), "random seed for the topology, the choice of broadcasting nodes and the packet loss");
+  boost::program_options::variables_map option_variables;
+  boost::program_options::store(boost::program_options::parse_command_line(argc, argv, option_config), option_variables);
+  boost::program_options::notify(option_variables);
+  if (option_variables.count("help"))
+  {
+    std::cout << option_config << "\n";
+    return 0;
+  }
+
+  uint32_t number_of_nodes = std::max<uint32_t>(option_variables["nodes"].as<uint32_t>(), 2);
+  uint32_t connections_per_node = option_variables["connections"].as<uint32_t>();
+  uint32_t number_of_blocks = option_variables["blocks"].as<uint32_t>();
+  fc::microseconds block_interval = fc::milliseconds(option_variables["block-interval-ms"].as<uint32_t>());
+  uint32_t transactions_per_block = option_variables["transactions-per-block"].as<uint32_t>();
+  uint32_t transaction_size = option_variables["transaction-size"].as<uint32_t>();
+  uint16_t first_port = option_variables["port"].as<uint16_t>();
+  fc::path data_directory = option_variables.count("data-dir") ? fc::path(option_variables["data-dir"].as<std::string>()) :
+                                                                 fc::temp_directory_path() / "bts_p2p_loopback_benchmark";
+
+  // the nodes' own logging would drown out the report
+  fc::logger::get().set_log_level(fc::log_level::error);
+
+  uint32_t seed = option_variables["seed"].as<uint32_t>();
+  std::mt19937 random_generator(seed);
+
+  fc::mutable_variant_object node_parameters;
+  node_parameters["desired_number_of_connections"] = connections_per_node;
+  node_parameters["maximum_number_of_connections"] = std::max<uint32_t>(connections_per_node * 3, 8);
+  node_parameters["maximum_upload_rate"] = option_variables["upload-rate"].as<uint64_t>();
+  node_parameters["simulated_latency_ms"] = option_variables["latency-ms"].as<uint32_t>();
+  node_parameters["simulated_loss_rate"] = option_variables["loss-rate"].as<double>();
+
+  if (fc::exists(data_directory))
+    fc::remove_all(data_directory);
+
+  propagation_tracker tracker;
+  std::vector<std::unique_ptr<simulated_client> > clients;
+  std::vector<fc::ip::endpoint> endpoints;
+  fc::ip::address loopback_address("127.0.0.1");
+  for (uint32_t i = 0; i < number_of_nodes; ++i)
+  {
+    clients.emplace_back(new simulated_client(tracker));
+    fc::mutable_variant_object this_node_parameters(node_parameters);
+    this_node_parameters["simulated_loss_seed"] = (uint32_t)random_generator();
+    clients.back()->start(data_directory / std::to_string(i), 
+                          fc::ip::endpoint(loopback_address, first_port ? first_port + i : 0), this_node_parameters);
+    endpoints.push_back(fc::ip::endpoint(loopback_address, clients.back()->get_node().get_actual_listening_endpoint().port()));
+  }
+
+  // each node connects to a few random nodes started before it, so the network is connected
+  for (uint32_t i = 1; i < number_of_nodes; ++i)
+  {
+    std::set<uint32_t> peers;
+    while (peers.size() < std::min(connections_per_node, i))
+      peers.insert(random_generator() % i);
+    for (uint32_t peer : peers)
+      clients[i]->get_node().connect_to(endpoints[peer]);
+  }
+
+  std::cout << "started " << number_of_nodes << " nodes, waiting for them to connect\n";
+  fc::time_point connect_deadline = fc::time_point::now() + fc::seconds(60);
+  for (;;)
+  {
+    uint32_t unconnected_nodes = 0;
+    for (const std::unique_ptr<simulated_client>& client : clients)
+      if (client->get_node().get_connection_count() == 0)
+        ++unconnected_nodes;
+    if (unconnected_nodes == 0)
+      break;
+    if (fc::time_point::now() > connect_deadline)
+    {
+      std::cout << unconnected_nodes << " nodes never connected, continuing without them\n";
+      break;
+    }
+    fc::usleep(fc::milliseconds(100));
+  }
+
+  uint64_t transactions_broadcast = 0;
+  for (uint32_t block = 0; block < number_of_blocks; ++block)
+  {
+    // spread the transactions over the first half of the block interval
+    for (uint32_t i = 0; i < transactions_per_block; ++i)
+    {
+      clients[random_generator() % number_of_nodes]->broadcast_transaction(++transactions_broadcast, transaction_size);
+      fc::usleep(fc::microseconds(block_interval.count() / 2 / std::max<uint32_t>(transactions_per_block, 1)));
+    }
+    fc::usleep(fc::microseconds(block_interval.count() / 2));
+
+    // a node with the longest chain produces, so we don't fork when a block hasn't reached everyone
+    simulated_client* producer = clients[random_generator() % number_of_nodes].get();
+    for (const std::unique_ptr<simulated_client>& client : clients)
+      if (client->get_head_block_num() > producer->get_head_block_num())
+        producer = client.get();
+    producer->produce_block();
+    std::cout << "produced block " << producer->get_head_block_num() << "\n";
+  }
+  fc::usleep(block_interval); // let the last block get around
+
+  std::cout << "\n";
+  tracker.report(block_message_type, "blocks", number_of_nodes - 1);
+  tracker.report(trx_message_type, "transactions", number_of_nodes - 1);
+
+  clients.clear();
+  return 0;
+}
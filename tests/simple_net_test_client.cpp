@@ -110,11 +110,11 @@ class simple_net_test_miner : public bts::net::node_delegate
      // blockchain is a series of block_messages
      struct block_hash_index{};
      typedef boost::multi_index_container<block_message, indexed_by<random_access<>,
-                                                                    ordered_unique<tag<block_hash_index>, member<block_message, block_id_type, &block_message::block_id> > > > ordered_blockchain_container;
+                                                                    ordered_unique<tag<block_hash_index>, member<block_message_header, block_id_type, &block_message_header::block_id> > > > ordered_blockchain_container;
      ordered_blockchain_container _blockchain;
 
      // the list of unsigned blocks we're considering adding to our chain
-     typedef boost::multi_index_container<block_message, indexed_by<ordered_unique<member<block_message, block_id_type, &block_message::block_id> > > > block_container;
+     typedef boost::multi_index_container<block_message, indexed_by<ordered_unique<member<block_message_header, block_id_type, &block_message_header::block_id> > > > block_container;
      block_container _unsigned_blocks;
 
      // the list of transactions we're considering adding to a new block if we mine one.
@@ -0,0 +1,61 @@
+#include <bts/net/stcp_socket.hpp>
+#include <fc/network/tcp_socket.hpp>
+#include <fc/network/ip.hpp>
+#include <fc/crypto/rand.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+#include <fc/thread/thread.hpp>
+#include <fc/time.hpp>
+#include <iostream>
+#include <vector>
+
+using namespace bts::net;
+
+/** 
+ *  Measures how fast stcp_socket encrypts and decrypts by sending data to ourselves
+ *  over the loopback interface.  Usage: stcp_socket_benchmark [megabytes]
+ */
+int main( int argc, char** argv )
+{ try {
+   const size_t chunk_size = 1024 * 1024;
+   size_t megabytes = argc > 1 ? std::stoul( argv[1] ) : 256;
+   const size_t total_size = megabytes * chunk_size;
+
+   fc::tcp_server server;
+   stcp_socket    sender;
+   stcp_socket    receiver;
+   server.listen( 0 );
+   fc::ip::endpoint server_endpoint( fc::ip::address( "127.0.0.1" ), server.get_port() );
+   fc::future<void> connect_done = fc::async( [&](){ sender.connect_to( server_endpoint ); } );
+   server.accept( receiver.get_socket() );
+   receiver.accept();
+   connect_done.wait();
+
+   std::vector<char> chunk( chunk_size );
+   fc::rand_bytes( chunk.data(), chunk.size() );
+
+   fc::time_point start_time = fc::time_point::now();
+   fc::future<void> send_done = fc::async( [&](){
+      for( size_t bytes_sent = 0; bytes_sent < total_size; bytes_sent += chunk_size )
+         sender.write( chunk.data(), chunk.size() );
+      sender.flush();
+   } );
+
+   std::vector<char> received( chunk_size );
+   for( size_t bytes_received = 0; bytes_received < total_size; bytes_received += chunk_size )
+      receiver.read( received.data(), received.size() );
+   send_done.wait();
+
+   fc::microseconds elapsed = fc::time_point::now() - start_time;
+   double megabytes_per_second = double(megabytes) / ( double(elapsed.count()) / 1000000 );
+   std::cout << "encrypted and decrypted " << megabytes << " MB in " << elapsed.count() / 1000 
+             << " ms, " << megabytes_per_second << " MB/s\n";
+
+   sender.close();
+   receiver.close();
+   return received == chunk ? 0 : 1;
+} catch ( const fc::exception& e )
+{
+   elog( "${e}", ("e",e.to_detail_string()) );
+   return 1;
+} }
@@ -0,0 +1,68 @@
+#define BOOST_TEST_MODULE StcpSocketTests
+#include <boost/test/unit_test.hpp>
+#include <bts/net/stcp_socket.hpp>
+#include <fc/network/tcp_socket.hpp>
+#include <fc/network/ip.hpp>
+#include <fc/crypto/rand.hpp>
+#include <fc/exception/exception.hpp>
+#include <fc/log/logger.hpp>
+#include <fc/thread/thread.hpp>
+#include <vector>
+
+using namespace bts::net;
+
+/** connects two stcp_sockets to each other over the loopback interface */
+struct stcp_socket_pair
+{
+   fc::tcp_server server;
+   stcp_socket    sender;
+   stcp_socket    receiver;
+
+   stcp_socket_pair()
+   {
+      server.listen( 0 );
+      fc::ip::endpoint server_endpoint( fc::ip::address( "127.0.0.1" ), server.get_port() );
+      fc::future<void> connect_done = fc::async( [&](){ sender.connect_to( server_endpoint ); } );
+      server.accept( receiver.get_socket() );
+      receiver.accept();
+      connect_done.wait();
+   }
+   ~stcp_socket_pair()
+   {
+      try { sender.close(); } catch ( const fc::exception& ) {}
+      try { receiver.close(); } catch ( const fc::exception& ) {}
+   }
+};
+
+BOOST_AUTO_TEST_CASE( stcp_round_trip_test )
+{ try {
+   stcp_socket_pair sockets;
+
+   // none of these are multiples of the old 4096 byte limit
+   std::vector<size_t> message_sizes = { 16, 4 * 1024 * 1024 + 48, 5 * 1024 * 1024 + 4112, 4080 };
+   std::vector< std::vector<char> > messages;
+   for( size_t size : message_sizes )
+   {
+      std::vector<char> message( size );
+      fc::rand_bytes( message.data(), message.size() );
+      messages.push_back( message );
+   }
+
+   fc::future<void> send_done = fc::async( [&](){
+      for( const std::vector<char>& message : messages )
+         sockets.sender.write( message.data(), message.size() );
+      sockets.sender.flush();
+   } );
+
+   for( const std::vector<char>& message : messages )
+   {
+      std::vector<char> received( message.size() );
+      sockets.receiver.read( received.data(), received.size() );
+      BOOST_CHECK( received == message );
+   }
+   send_done.wait();
+} catch ( const fc::exception& e )
+{
+   elog( "${e}", ("e",e.to_detail_string()) );
+   throw;
+} }